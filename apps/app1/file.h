@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/uio.h>
 
 
 
@@ -18,7 +19,7 @@ void read_block(FILE* fp, int block_num, char* buffer);
 void read_block_value(FILE*  fp, int block_num, char* buffer, int byte_offset, size_t length_of_value);
 
 
-unsigned short get_inode_address(FILE* fp, char directory_inode_id);
+unsigned short get_inode_address(FILE* fp, unsigned char directory_inode_id);
 unsigned short check_fbv_for_available_block(FILE* fp);
 void set_fbv_bit(FILE* fp, unsigned short block_number);
 void reset_fbv_bit(FILE* fp, unsigned int block_number);
@@ -33,15 +34,101 @@ unsigned char create_file_in_directory(FILE* fp, unsigned char parent_inode_id,c
 
 void assign_location_to_inode_map(FILE* fp, unsigned short inode_address, unsigned char inode_id);
 void init_vdisk(FILE* fp);
+void init_vdisk_with_journal(FILE* fp, unsigned int journal_blocks);
+//replays the metadata journal after a crash. call it when opening a vdisk. returns the number of blocks replayed
+int recover_vdisk(FILE* fp);
+//writes out anything held for the vdisk, drops what is cached about it, and fcloses it. use it instead of fclose()
+int close_vdisk(FILE* fp);
+//while mounted log-structured, every block is written at the log head and inodes move instead of being rewritten
+int mount_log_structured(FILE* fp);
+void unmount_log_structured(FILE* fp);
+//copies live blocks out of mostly empty segments until budget blocks have moved. returns how many did
+int clean_segments(FILE* fp, int budget);
+//the cleaner runs inline after each commit, moving at most budget blocks. 0 leaves cleaning to clean_segments()
+int set_cleaner_budget(FILE* fp, int budget);
 void delete_filepath(FILE* fp, char* filename);
 void delete_file(FILE* fp, unsigned char filename);
 void delete_inode(FILE* fp, unsigned char inode_id);
 void clear_single_indirection_block(FILE* fp, unsigned short indirection_block_num);
 FILE* download_file(FILE* fp, char* target_filename, char* new_filename);
+size_t read_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, char* buffer, size_t length);
+//writes length bytes at offset of the file, pwrite() style, growing the file when they go past its end
+size_t write_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, const char* buffer, size_t length);
+size_t append_to_file(FILE* fp, unsigned char inode_id, const char* buffer, size_t length);
+//cuts the file to size bytes, or grows it to size with zeros. returns 0, or -1 if that could not be done
+int truncate_file(FILE* fp, unsigned char inode_id, unsigned long long size);
+//from now on, data blocks with the same bytes are stored once and shared. returns 0, or -1 if there is no room
+int enable_deduplication(FILE* fp);
+//when on, files uploaded from then on are stored compressed, and read back as they were
+void set_compression(FILE* fp, int enabled);
+unsigned short get_file_block_address(FILE* fp, unsigned char inode_id, unsigned long long logical_block_index);
+void invalidate_block_map_cache(FILE* fp, unsigned char inode_id);
+void drop_vdisk_caches(FILE* fp);
+//returned by find_file_inode_id() and upload_file() when there is no such file
+extern const unsigned char INODE_NOT_FOUND;
 unsigned char find_file_inode_id(FILE* fp, char* absolute_file_path);
+int file_exists(FILE* fp, char* absolute_file_path);
 void create_directory(FILE* fp, char* parent_directory_name, char* new_directory_name);
-void delete_directory(FILE* fp, unsigned char directory_inode_id);
+void create_sorted_directory(FILE* fp, char* parent_directory_name, char* new_directory_name);
+unsigned char create_directory_path(FILE* fp, char* path);
+//moves a file or directory to a new path without touching its data. returns 0, or -1 if nothing was moved
+int rename_file(FILE* fp, char* old_path, char* new_path);
+//between these two, block writes are held in memory and written together, each block once
+void begin_metadata_batch(FILE* fp);
+void commit_metadata_batch(FILE* fp);
+//how far the outermost commit takes a batch: kept in memory, written to the vdisk file (the default), or fsync'd
+extern const int DURABILITY_DEFERRED;
+extern const int DURABILITY_WRITTEN;
+extern const int DURABILITY_SYNCED;
+void commit_metadata_batch_with_durability(FILE* fp, int durability);
+//writes a deferred batch and waits until everything written to the vdisk is on the device
+void sync_vdisk(FILE* fp);
+int delete_directory(FILE* fp, unsigned char directory_inode_id);
 void delete_file(FILE* fp, unsigned char file_inode_id);
 unsigned char upload_file(FILE* fp, char* path_to_parent_dir, char* file_name, FILE* fpin);
+//a source of file data for upload_stream(). returns how many bytes it put in buffer, 0 once it has no more
+typedef size_t (*upload_read_function)(void* context, char* buffer, size_t length);
+unsigned char upload_stream(FILE* fp, char* path_to_parent_dir, char* file_name, upload_read_function read_function, void* context);
+unsigned char upload_fd(FILE* fp, char* path_to_parent_dir, char* file_name, int fd);
+//uploads straight from memory, without copying whole blocks
+unsigned char upload_buffer(FILE* fp, char* path_to_parent_dir, char* file_name, const void* data, size_t length);
+unsigned char upload_iovec(FILE* fp, char* path_to_parent_dir, char* file_name, const struct iovec* iov, int iovcnt);
+//one file for bulk_upload(), which sets inode_id to the new file's inode id, or INODE_NOT_FOUND if it failed
+struct bulk_upload_item
+{
+	char* host_path;
+	char* parent_path;
+	char* name;
+	unsigned char inode_id;
+};
+//uploads the items in parallel on thread_count threads, or one per processor for 0. returns how many were uploaded
+int bulk_upload(FILE* fp, struct bulk_upload_item* items, int item_count, int thread_count);
+
+//a directory opened once, for operations on the names inside it without walking a path each time
+struct directory_handle;
+struct directory_handle* open_directory(FILE* fp, char* absolute_directory_path);
+struct directory_handle* open_directory_at(struct directory_handle* dir, char* name);
+void close_directory(struct directory_handle* dir);
+unsigned char get_directory_handle_inode_id(struct directory_handle* dir);
+unsigned char find_file_inode_id_at(struct directory_handle* dir, char* name);
+unsigned char upload_file_at(struct directory_handle* dir, char* file_name, FILE* fpin);
+FILE* download_file_at(struct directory_handle* dir, char* file_name, char* new_filename);
+void create_directory_at(struct directory_handle* dir, char* new_directory_name);
+void create_sorted_directory_at(struct directory_handle* dir, char* new_directory_name);
+int delete_file_at(struct directory_handle* dir, char* name);
+int rename_file_at(struct directory_handle* old_dir, char* old_name, struct directory_handle* new_dir, char* new_name);
+
+struct directory_entry_info
+{
+	unsigned char inode_id;
+	char type; //'f' or 'd'
+	unsigned long long size;
+	char name[31];
+};
+struct directory_iterator;
+struct directory_iterator* open_directory_iterator(struct directory_handle* dir);
+struct directory_iterator* open_directory_iterator_from(struct directory_handle* dir, char* after_name, char* prefix);
+int read_directory_entries(struct directory_iterator* it, struct directory_entry_info* entries, int max_entries);
+void close_directory_iterator(struct directory_iterator* it);
 
 #endif
@@ -33,13 +33,20 @@ filesystem.
 · Next 4 bytes: flags – i.e., type of file (flat or directory); an integer
 · Next 2 bytes, multiplied by 10: block numbers for file’s first ten blocks
 · Next 2 bytes: single-indirect block
-· Last 2 bytes: double-indirect block
+· Next 2 bytes: double-indirect block
+· Next byte: inode id
+· Next byte: format, the DIRECTORY_FORMAT of a directory or the FILE_FORMAT of a file
+· Next 2 bytes: triple-indirect block
+· Next 4 bytes: high 32 bits of the file size, so sizes are 64 bit
+· Next byte: inode id of the directory holding the file
+· Next 31 bytes: name of the file in that directory, empty for the root and for files from older disks
 * 
 Directory format:
 · Each directory block contains 16 entries.
 · Each entry is 32 bytes long
 · First byte indicates the inode (value of 0 means no entry)
 · Next 31 bytes are for the filename, terminated with a “null” character.
+· Directories are hashed over many blocks, and leaf entries carry a 4 byte name hash, see DIRECTORIES below
  * */
 #include "file.h"
 #include <errno.h>
@@ -49,27 +56,62 @@ Directory format:
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <pthread.h>
 const size_t BYTES_PER_BLOCK=512;
 const size_t BITS_PER_BLOCK=4096;
 const size_t MAX_BLOCK_INDEX=4095;
 const size_t FREE_BLOCK_VECTOR_OFFSET=1;
 const size_t DATA_SECTION_OFFSET = 16;
-const size_t INODE_BYTES=33;
+const size_t INODE_BYTES=72;
 const size_t INODE_SIZE_OFFSET=0;
 const size_t INODE_TYPE_OFFSET=4;
 const size_t INODE_DIRECT_OFFSET=8;
 const size_t INODE_SINGLEIND_OFFSET=28;
 const size_t INODE_DOUBLEIND_OFFSET=30;
 const size_t INODE_ID_OFFSET=32;
+const size_t INODE_FLAGS_OFFSET=33;
+const size_t INODE_TRIPLEIND_OFFSET=34;
+const size_t INODE_SIZE_HIGH_OFFSET=36;
+const size_t INODE_PARENT_OFFSET=40;
+const size_t INODE_NAME_OFFSET=41;
+//byte offsets of the single, double and triple indirection pointers, indexed by depth-1
+const size_t INODE_INDIRECTION_OFFSETS[3]={28,30,34};
+const size_t MAX_INDIRECTION_DEPTH=3;
 const size_t INODE_MAX_NUM=256;
+//the last inode id is never handed out, so it can stand for "no such file"
+const unsigned char INODE_NOT_FOUND=255;
 const size_t INODE_ID_SIZE = 2;
 const size_t INODE_MAP_OFFSET = 2;
+const size_t POINTERS_PER_BLOCK = 256;
+const size_t DIRECT_POINTER_COUNT = 10;
 
 
 const size_t DIRECTORY_BYTES = 512;
 const size_t DIRECTORY_ELEMENT_SIZE=32;
 const size_t DIRECTORY_INODE_OFFSET = 0;
 const size_t DIRECTORY_ENTRY_OFFSET=1;
+const size_t DIRECTORY_SLOTS_PER_BLOCK=16;
+const size_t DIRECTORY_NAME_MAX=30;
+const unsigned char DIRECTORY_FORMAT_LINEAR=0;
+const unsigned char DIRECTORY_FORMAT_HASHED=1;
+const unsigned char DIRECTORY_FORMAT_SORTED=2;
+//file formats share the format byte with directories, so they take values no DIRECTORY_FORMAT uses
+const unsigned char FILE_FORMAT_PLAIN=0;
+const unsigned char FILE_FORMAT_COMPRESSED=0x80;
+const size_t COMPRESSION_EXTENT_BLOCKS=16;
+const size_t DIRECTORY_INDEX_HEADER_OFFSET=64;
+const size_t DIRECTORY_INDEX_ENTRIES_OFFSET=72;
+const size_t DIRECTORY_INDEX_ENTRY_SIZE=8;
+//a directory has one index block, so at most 55 leaves of 12 slots: 660 names when every leaf is full, and about
+//half that in the worst case, since leaves split at the median. inode ids are one byte, so a whole vdisk holds
+//at most 254 files and directories besides the root, which fits even the worst case. leaves are not merged when
+//names are deleted, though, so names added and deleted in hash order can still use up the index
+const size_t DIRECTORY_INDEX_MAX_ENTRIES=55;
+const size_t DIRECTORY_LEAF_SLOTS=12;
+const size_t DIRECTORY_LEAF_SLOTS_OFFSET=128;
+const size_t DIRECTORY_LEAF_SIZES_OFFSET=48;
+const size_t DIRECTORY_LEAF_TYPES_OFFSET=96;
 
 
 
@@ -78,9 +120,45 @@ const size_t DIRECTORY_ENTRY_OFFSET=1;
 void write_block(FILE* fp, int block_num, void* data,int size_of_data_in_bytes);
 void read_block(FILE* fp, int block_num, char* buffer);
 void read_block_value(FILE*  fp, int block_num, char* buffer, int byte_offset, size_t length_of_value);
+char* find_batched_block(FILE* fp, int block_num);
+char* get_batched_block(FILE* fp, int block_num, int read_existing);
+void drop_batched_block(FILE* fp, int block_num);
+unsigned int get_journal_capacity(FILE* fp);
+int block_is_free(unsigned char* free_block_vector, unsigned int block_num);
+void append_to_journal(FILE* fp, int count, int* block_numbers, char* blocks);
+int append_spilled_transaction(FILE* fp, int count, int* block_numbers, char* blocks);
+void retire_spilled_transaction(FILE* fp);
+void retire_journal_block(FILE* fp, int block_num);
+void write_block_run(FILE* fp, unsigned short first_block_num, const char* data, unsigned int block_count);
+int is_log_structured(FILE* fp);
+int write_log_inode_block(FILE* fp, unsigned int block_num, void* data, int size_of_data_in_bytes);
+unsigned short next_log_block(FILE* fp, unsigned char* free_block_vector);
+void commit_log_structured(FILE* fp);
+void recover_log_inode_map(FILE* fp);
+void clean_segments_when_low(FILE* fp);
+void flush_vdisk(FILE* fp, int durability);
+struct block_referrer;
+unsigned int claim_data_blocks(FILE* fp, const char* data, unsigned int count, unsigned short* block_addresses, char* shared);
+unsigned char get_dedup_inode(FILE* fp);
+unsigned short share_duplicate_block(FILE* fp, const char* block, const unsigned short* pending_addresses, const char* pending_data, unsigned int pending_count);
+void index_data_block(FILE* fp, unsigned short block_address, const char* block);
+int release_data_block(FILE* fp, unsigned short block_address);
+int release_data_block_would_free(FILE* fp, unsigned short block_address);
+int get_vdisk_compression(FILE* fp);
+int is_compressed_file(FILE* fp, unsigned char inode_id);
+void set_file_format(FILE* fp, unsigned char inode_id, unsigned short inode_address, unsigned char format);
+unsigned int get_extent_block_count(unsigned long long block_count, unsigned long long first_logical_block);
+unsigned int pack_extent(const char* extent, unsigned int block_count, char* packed);
+int store_extent(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, const char* source, unsigned int stored_blocks, unsigned int old_block_count);
+int read_extent(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, unsigned int block_count, char* extent, char* packed);
+size_t read_compressed_file_range(FILE* fp, unsigned char inode_id, unsigned long long size, unsigned long long offset, char* buffer, size_t length);
+size_t write_compressed_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, const char* buffer, size_t length);
+int cut_compressed_extent(FILE* fp, unsigned char inode_id, unsigned long long old_size, unsigned long long size);
+void download_compressed_file(FILE* fp, unsigned char inode_id, unsigned long long size, FILE* fpout);
+void forget_shared_blocks(FILE* fp, struct block_referrer* referrers);
 
 
-unsigned short get_inode_address(FILE* fp, char directory_inode_id);
+unsigned short get_inode_address(FILE* fp, unsigned char directory_inode_id);
 unsigned short check_fbv_for_available_block(FILE* fp);
 void set_fbv_bit(FILE* fp, unsigned short block_number);
 void reset_fbv_bit(FILE* fp, unsigned int block_number);
@@ -99,15 +177,85 @@ FILE* download_file(FILE* fp, char* target_filename, char* new_filename);
 void delete_file(FILE* fp, unsigned char filename);
 void delete_inode(FILE* fp, unsigned char inode_id);
 void clear_single_indirection_block(FILE* fp, unsigned short indirection_block_num);
+void clear_indirection_block(FILE* fp, int depth, unsigned short indirection_block_address);
+unsigned long long get_inode_size(unsigned short* inode_buffer);
+char get_inode_type(FILE* fp, unsigned char inode_id);
+void set_inode_size(unsigned short* inode_buffer, unsigned long long size);
 
 unsigned char find_file_inode_id(FILE* fp, char* absolute_file_path);
+unsigned char resolve_path(FILE* fp, char* path, unsigned char* parent_inode_id, char* leaf_name);
+size_t next_path_component(char** cursor, char** component);
+unsigned char find_directory_inode_id(FILE* fp, char* absolute_directory_path, char* caller);
 void delete_filepath(FILE* fp, char* filename);
-void delete_directory(FILE* fp, unsigned char directory_inode_id);
+int delete_directory(FILE* fp, unsigned char directory_inode_id);
 void delete_file(FILE* fp, unsigned char file_inode_id);
+int delete_directory_entry(FILE* fp, unsigned char directory_inode_id, char* removal_filename);
+int directory_is_empty(FILE* fp, unsigned char directory_inode_id);
+int find_directory_entry(FILE* fp, unsigned char directory_inode_id, char* name);
+int lookup_directory_name(FILE* fp, unsigned char parent_inode_id, char* name);
+void insert_dentry_cache(FILE* fp, unsigned char parent_inode_id, char* name, unsigned char inode_id);
+void remove_dentry_cache(FILE* fp, unsigned char parent_inode_id, char* name);
+void invalidate_path_cache(void);
+void invalidate_negative_path_cache(void);
+void drop_name_filter(FILE* fp, unsigned char directory_inode_id);
+void add_to_name_filter(FILE* fp, unsigned char directory_inode_id, char* name);
+void build_name_filter(FILE* fp, unsigned char directory_inode_id);
+int delete_element_from_directory(FILE* fp, unsigned char parent_inode_id, char* name, unsigned char file_inode_id);
+int delete_element_with_entry(FILE* fp, unsigned char parent_inode_id, char* name, unsigned char file_inode_id);
+void wipe_block(FILE* fp, unsigned short block_address, char* empty_block_buffer);
+int directory_handle_is_open(FILE* fp, unsigned char directory_inode_id);
+void retire_directory_handles(FILE* fp, unsigned char directory_inode_id);
+unsigned short allocate_empty_block(FILE* fp);
+unsigned short* get_directory_index_header(char* root_block);
+void update_directory_entry_attributes(FILE* fp, unsigned char inode_id);
+unsigned short load_directory_leaf_for_name(FILE* fp, unsigned char directory_inode_id, unsigned int hash, char* leaf_block);
+unsigned short load_btree_leaf_for_name(FILE* fp, unsigned char directory_inode_id, char* name, char* leaf_block);
+unsigned short load_directory_leaf_for_entry(FILE* fp, unsigned char directory_inode_id, char* name, char* leaf_block);
+unsigned short load_next_btree_leaf(FILE* fp, unsigned char directory_inode_id, char* leaf_block);
+unsigned short* get_btree_leaf_header(char* leaf_block);
+void remove_btree_leaf_slot(char* leaf_block, int slot);
+int add_element_to_sorted_directory(FILE* fp, unsigned char directory_inode_id, unsigned char element_inode_id, char* element_file_name);
+unsigned short create_directory_with_format(FILE* fp, unsigned char parent_inode_id,char* new_directory_name, unsigned char format);
+void set_file_block_address(FILE* fp, unsigned char inode_id, unsigned long long logical_block_index, unsigned short block_address);
+unsigned int map_file_blocks(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, unsigned short* block_addresses, unsigned int count);
+unsigned int reserve_file_pointer_blocks(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, unsigned int count);
+
+unsigned short get_file_block_address(FILE* fp, unsigned char inode_id, unsigned long long logical_block_index);
+void invalidate_block_map_cache(FILE* fp, unsigned char inode_id);
+size_t read_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, char* buffer, size_t length);
+//the inode map of a vdisk mounted log-structured, see LOG-STRUCTURED MODE
+struct log_state
+{
+	FILE* fp; //NULL while no vdisk is mounted log-structured
+	unsigned int head; //the log goes on from this block
+	unsigned short inode_map[256];
+	int inode_map_dirty;
+	unsigned int clock; //counts commits, to date the segments
+	unsigned int segment_written[255]; //clock of the last block the log took in each segment
+	int cleaning; //set while the segment cleaner runs, so that its own commits do not start it again
+	int cleaner_budget; //blocks the cleaner may move after a commit, -1 for CLEANER_BLOCKS_PER_COMMIT, 0 for none
+};
+
+struct log_state log_state = {NULL,0,{0},0,0,{0},0,0};
+
 //////////////BASIC VDISK OPERATIONS
 
 void write_block(FILE* fp, int block_num, void* data,int size_of_data_in_bytes){
 	
+	if (block_num==INODE_MAP_OFFSET && is_log_structured(fp))
+	{
+		memcpy(log_state.inode_map,data,size_of_data_in_bytes);
+		log_state.inode_map_dirty = 1;
+		return;
+	}
+	if (write_log_inode_block(fp,block_num,data,size_of_data_in_bytes)) return;
+	char* batched_block = get_batched_block(fp,block_num,size_of_data_in_bytes<BYTES_PER_BLOCK);
+	if (batched_block)
+	{
+		memcpy(batched_block,data,size_of_data_in_bytes);
+		return;
+	}
+	retire_journal_block(fp,block_num);
 	off_t total_offset = fseek(fp, (off_t)block_num*BYTES_PER_BLOCK, SEEK_SET);
 	
 	
@@ -119,853 +267,4493 @@ void write_block(FILE* fp, int block_num, void* data,int size_of_data_in_bytes){
 }
 
 void read_block(FILE* fp, int block_num, char* buffer){
+	if (block_num==INODE_MAP_OFFSET && is_log_structured(fp))
+	{
+		memcpy(buffer,log_state.inode_map,BYTES_PER_BLOCK);
+		return;
+	}
+	char* batched_block = find_batched_block(fp,block_num);
+	if (batched_block)
+	{
+		memcpy(buffer,batched_block,BYTES_PER_BLOCK);
+		return;
+	}
 	off_t total_offset = fseek(fp, (off_t)block_num*BYTES_PER_BLOCK, SEEK_SET);
 	fread(buffer,  BYTES_PER_BLOCK, 1,fp);
 	return;
 	
 }
 
-//////////////////////////// BLOCK DATA MANIPULATION
+//////////////METADATA BATCHES
+/*
+ * While a batch is open on a vdisk, write_block() keeps the blocks it is given in memory and read_block() reads
+ * them from there. A block rewritten many times over, like the free block vector, the inode map or block 0 of a
+ * directory, then goes to the disk once. commit_metadata_batch() writes every batched block in block order and
+ * flushes the vdisk. Batches nest, and only the outermost commit writes. A batch grows for as long as it is open and
+ * is never written out part way, since each write of a batch is one transaction in the journal, see JOURNAL below,
+ * and an operation must reach the disk whole or not at all. A deferred batch which has grown past
+ * METADATA_BATCH_MAX_BLOCKS is written when the next operation begins, between two operations.
+ * There is one batch at a time, so operations which overlap, such as the uploads of bulk_upload(), share it and
+ * are committed together by the last of them to finish.
+ * How far the outermost commit takes the batch is chosen per call with commit_metadata_batch_with_durability().
+ * DURABILITY_WRITTEN, the default, writes the batch to the vdisk file. DURABILITY_SYNCED also waits with fsync()
+ * until the journal transaction, and then its homes, are on the device. DURABILITY_DEFERRED writes nothing: the
+ * batch stays in memory, still read by read_block(), and the next operations on the vdisk add their blocks to it
+ * until one of them commits with a stronger durability, the batch fills up, a batch is begun on another vdisk or
+ * sync_vdisk() is called. A crash loses deferred operations whole, as none of their metadata reached the disk.
+ */
+const size_t METADATA_BATCH_MAX_BLOCKS = 64;
+const size_t METADATA_BATCH_INITIAL_BLOCKS = 64;
+const int DURABILITY_DEFERRED = 0;
+const int DURABILITY_WRITTEN = 1;
+const int DURABILITY_SYNCED = 2;
 
-void read_block_value(FILE*  fp, int block_num, char* buffer, int byte_offset, size_t length_of_value)
+struct metadata_batch
 {
-	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
-	read_block(fp, block_num, block_buffer);
-//	printf("read_block :%s\n", (char*)block_buffer);
-	//not check within that buffer to get the values we wanted
-	int index;
-	for(index=0; index<length_of_value;index++)
+	FILE* fp; //NULL while no batch is open
+	int depth;
+	int count;
+	int allocated; //blocks there is room for in block_numbers and blocks
+	int* block_numbers;
+	char* blocks;
+	int durability; //the strongest asked of the batch by a commit, -1 if none asked
+};
+
+//a batch which was committed with DURABILITY_DEFERRED stays, with its fp set and a depth of 0
+struct metadata_batch metadata_batch = {NULL,0,0,0,NULL,NULL,-1};
+
+char* find_batched_block(FILE* fp, int block_num)
+{
+	if (!metadata_batch.fp || metadata_batch.fp!=fp) return NULL;
+	int i;
+	for (i=0;i<metadata_batch.count;i++)
 	{
-		buffer[index] = block_buffer[index+byte_offset];
-		
+		if (metadata_batch.block_numbers[i]==block_num) return metadata_batch.blocks+i*BYTES_PER_BLOCK;
 	}
-	
-	free(block_buffer);
-	return;
+	return NULL;
 }
-unsigned short get_inode_address(FILE* fp, char directory_inode_id){
 
-	unsigned short address;
-	read_block_value(fp, 2,(char*)&address,directory_inode_id*2,2);
-	return address;
-}
-////////////////////////////PRIVATE FILE SYSTEM FUNCTIONS
-//note type=1 when the inode is a directory file, 2 when anything other type of file
-//block_type_needed can be either 'i' for index or 'd' for data. This will determine where in the free block vector to begin searching
-unsigned short check_fbv_for_available_block(FILE* fp)
+//writes every batched block to the disk and empties the batch, leaving it open
+void flush_metadata_batch(void)
 {
-	
-		
-	char* free_block_vector = (char*) malloc(BITS_PER_BLOCK);
-	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,free_block_vector);
-	unsigned int tester = 1;
-	unsigned short i;
-	unsigned short byte_pos= 2;
-	for(byte_pos; byte_pos<DATA_SECTION_OFFSET+MAX_BLOCK_INDEX; byte_pos++)
+	FILE* fp = metadata_batch.fp;
+	int count = metadata_batch.count;
+	int i,j;
+	//block order, so the writes sweep the vdisk once
+	for (i=1;i<count;i++)
 	{
-		for( i =0; i< 8;i++)
+		for (j=i;j>0 && metadata_batch.block_numbers[j-1]>metadata_batch.block_numbers[j];j--)
 		{
-			//printf("%u\n",tester);
-			
-			if (tester & free_block_vector[byte_pos])
-			{
-//	printf("check_fbv_for_available_block: found an available block to write in at bit %u in byte %u \n",i, byte_pos);
-				free(free_block_vector);
-				return(byte_pos*8 + i);
-			
-			}
-			tester=tester<<1;
+			int temp_block_num = metadata_batch.block_numbers[j];
+			metadata_batch.block_numbers[j] = metadata_batch.block_numbers[j-1];
+			metadata_batch.block_numbers[j-1] = temp_block_num;
+			char temp_block[512];
+			memcpy(temp_block,metadata_batch.blocks+j*BYTES_PER_BLOCK,BYTES_PER_BLOCK);
+			memcpy(metadata_batch.blocks+j*BYTES_PER_BLOCK,metadata_batch.blocks+(j-1)*BYTES_PER_BLOCK,BYTES_PER_BLOCK);
+			memcpy(metadata_batch.blocks+(j-1)*BYTES_PER_BLOCK,temp_block,BYTES_PER_BLOCK);
+		}
+	}
+	if (!count) return;
+	//the transaction is committed in the journal before any block reaches its home
+	int piece = count;
+	int spilled = 0;
+	if (count>get_journal_capacity(fp))
+	{
+		spilled = !append_spilled_transaction(fp,count,metadata_batch.block_numbers,metadata_batch.blocks);
+		if (!spilled)
+		{
+			printf("flush_metadata_batch: no free blocks to journal %d blocks at once, they are committed in parts\n",count);
+			piece = get_journal_capacity(fp);
+		}
+	}
+	int first;
+	for (first=0;first<count;first+=piece)
+	{
+		int piece_count = count-first<piece ? count-first : piece;
+		int* block_numbers = metadata_batch.block_numbers+first;
+		char* blocks = metadata_batch.blocks+first*BYTES_PER_BLOCK;
+		if (!spilled) append_to_journal(fp,piece_count,block_numbers,blocks);
+		int run_start = 0;
+		for (i=1;i<=piece_count;i++)
+		{
+			if (i<piece_count && block_numbers[i]==block_numbers[i-1]+1) continue;
+			write_block_run(fp,block_numbers[run_start],blocks+run_start*BYTES_PER_BLOCK,i-run_start);
+			run_start = i;
 		}
-		tester = 1;
 	}
+	flush_vdisk(fp,metadata_batch.durability);
+	//the copies of a spilled transaction are in free blocks, which the next operation may take
+	if (spilled) retire_spilled_transaction(fp);
+	metadata_batch.count = 0;
+}
 
+//returns the batched copy of the block, adding it to the batch if it is not there yet. the copy is filled from
+//the disk only when read_existing is set, that is when the caller is about to overwrite part of the block.
+//returns NULL if no batch is open on fp. a deferred batch takes no new blocks
+char* get_batched_block(FILE* fp, int block_num, int read_existing)
+{
+	if (!metadata_batch.fp || metadata_batch.fp!=fp) return NULL;
+	char* batched_block = find_batched_block(fp,block_num);
+	if (batched_block || !metadata_batch.depth) return batched_block;
+	if (metadata_batch.count==metadata_batch.allocated)
+	{
+		metadata_batch.allocated *= 2;
+		metadata_batch.block_numbers = (int*)realloc(metadata_batch.block_numbers,metadata_batch.allocated*sizeof(int));
+		metadata_batch.blocks = (char*)realloc(metadata_batch.blocks,metadata_batch.allocated*BYTES_PER_BLOCK);
+	}
 	
-	printf("no blocks are free!\n");
-	return 0;
+	batched_block = metadata_batch.blocks+metadata_batch.count*BYTES_PER_BLOCK;
+	if (read_existing) read_block(fp,block_num,batched_block);
+	else memset(batched_block,0,BYTES_PER_BLOCK);
+	metadata_batch.block_numbers[metadata_batch.count++] = block_num;
+	return batched_block;
 }
 
-void set_fbv_bit(FILE* fp, unsigned short block_number)
+//forgets the batched copy of a block, for a caller about to write the whole block straight to the disk
+void drop_batched_block(FILE* fp, int block_num)
 {
-	char* vector = malloc(BITS_PER_BLOCK); 
-	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector);
-	int byte_num = block_number / 8;
-	int bit_pos = block_number%8;
-	char target = 1;
-	int i;
-	for (i=0;i<bit_pos;i++)
+	char* batched_block = find_batched_block(fp,block_num);
+	if (!batched_block) return;
+	int last = --metadata_batch.count;
+	int i = (batched_block-metadata_batch.blocks)/BYTES_PER_BLOCK;
+	if (i==last) return;
+	metadata_batch.block_numbers[i] = metadata_batch.block_numbers[last];
+	memcpy(batched_block,metadata_batch.blocks+last*BYTES_PER_BLOCK,BYTES_PER_BLOCK);
+}
+
+//flushes the vdisk, and with DURABILITY_SYNCED waits until it is on the device
+void flush_vdisk(FILE* fp, int durability)
+{
+	fflush(fp);
+	if (durability==DURABILITY_SYNCED && fsync(fileno(fp))) printf("flush_vdisk: fsync failed\n");
+}
+
+//writes the batch, which is no longer open, and forgets it
+void write_metadata_batch(FILE* fp)
+{
+	//the moved inodes and the checkpoint are written with the batch, so the batch is held open while they are made
+	if (is_log_structured(fp))
 	{
-		target = target<<1;
-		
+		metadata_batch.depth++;
+		commit_log_structured(fp);
+		metadata_batch.depth--;
 	}
+	flush_metadata_batch();
+	metadata_batch.fp = NULL;
+	metadata_batch.durability = -1;
+	if (is_log_structured(fp)) clean_segments_when_low(fp);
+}
 
-	vector[byte_num] = vector[byte_num]|target;
-	write_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector,BYTES_PER_BLOCK);
-	return;
-	
+void write_deferred_metadata_batch(FILE* fp)
+{
+	if (!metadata_batch.depth && metadata_batch.fp && metadata_batch.fp==fp) write_metadata_batch(fp);
 }
 
-//void  reset_fbv_bit
-void reset_fbv_bit(FILE* fp, unsigned int block_number)
+void begin_metadata_batch(FILE* fp)
 {
-	char* vector = malloc(BYTES_PER_BLOCK); 
-	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector);
-	int byte_num = block_number / 8;
-	int bit_pos = block_number%8;
-	char target = 1;
-	int i;
-	for (i=0;i<bit_pos;i++)
+	if (metadata_batch.depth && metadata_batch.fp!=fp)
 	{
-		target = target<<1;
-		
+		printf("begin_metadata_batch: a batch is already open on another vdisk\n");
+		return;
 	}
-	vector[byte_num] = vector[byte_num]^target;
-//	printf("reset_fbv_bit: reset bit in position %d, in block number %d\n", (int)i,(int)block_number);
-	write_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector,BYTES_PER_BLOCK);
-	free(vector);
-	return;
-	
-}
-unsigned char find_next_free_inode_id(FILE* fp){
-	
-	unsigned short* inode_map = (unsigned short*) malloc(BYTES_PER_BLOCK);
-	read_block(fp, INODE_MAP_OFFSET,(char*)inode_map);
-	int i ;
-	for ( i=0; i< INODE_MAX_NUM; i++)
-	{// checking through the inode map block to determine which has a free address we can use
-		if (inode_map[i]==0)
-		{
-//			printf("find_next_free_inode_id: found an empty inode space in inode id %d\n",(unsigned short)i);
-			free(inode_map);
-			return (unsigned char)i;
-			
-		}
-		
+	if (metadata_batch.fp && metadata_batch.fp!=fp) write_deferred_metadata_batch(metadata_batch.fp);
+	if (metadata_batch.count>=METADATA_BATCH_MAX_BLOCKS) write_deferred_metadata_batch(fp);
+	if (!metadata_batch.blocks)
+	{
+		metadata_batch.allocated = METADATA_BATCH_INITIAL_BLOCKS;
+		metadata_batch.block_numbers = (int*)malloc(metadata_batch.allocated*sizeof(int));
+		metadata_batch.blocks = (char*)malloc(metadata_batch.allocated*BYTES_PER_BLOCK);
 	}
-	fprintf(stderr,"no available inodes left");
-	exit(1);
-	return -1;
+	//a deferred batch goes on with this operation, which decides afresh how far it is taken
+	if (!metadata_batch.depth) metadata_batch.durability = -1;
+	metadata_batch.fp = fp;
+	metadata_batch.depth++;
 }
 
+void commit_metadata_batch(FILE* fp)
+{
+	if (!metadata_batch.depth || metadata_batch.fp!=fp) return;
+	if (--metadata_batch.depth) return;
+	if (metadata_batch.durability==DURABILITY_DEFERRED) return;
+	write_metadata_batch(fp);
+}
 
-// TWO FILE TYPES: "f" and "d" for file and directory file, respectively
-unsigned short create_empty_inode(FILE* fp, int inode_number, int size, int type)
+//the same, asking durability of the batch. when batches nest, the outermost commit takes the batch as far as the
+//strongest durability any commit asked, and DURABILITY_WRITTEN if none did
+void commit_metadata_batch_with_durability(FILE* fp, int durability)
 {
-	
-	void* inode_block = malloc(INODE_BYTES);
-	memset(inode_block,0,INODE_BYTES);
-	((unsigned int*)inode_block)[0] = (unsigned int)size;
-	((unsigned int*)inode_block)[1] = (unsigned int)type;
-	((char*)inode_block)[32] = inode_number;
-//	printf("Create_empty_inode: looking for empty block for inode id %d\n",(int)inode_number);
-	unsigned short available_block = check_fbv_for_available_block(fp);
-	write_block(fp, available_block, inode_block,INODE_BYTES);
-//	printf("Create_empty_inode: writing  inode block to  location  %d\n", (short)available_block);
-	
-	reset_fbv_bit(fp,available_block);
-	free(inode_block);
-	//returns the absolute block address where the empty inode was created
-	return available_block;
+	if (!metadata_batch.depth || metadata_batch.fp!=fp) return;
+	if (durability>metadata_batch.durability) metadata_batch.durability = durability;
+	commit_metadata_batch(fp);
 }
-unsigned short create_and_write_data_block_from_file(FILE* fp, size_t number_of_bytes,FILE* infile)
+
+void sync_vdisk(FILE* fp)
 {
-	
-	void* buffer = malloc(BYTES_PER_BLOCK);
-	memset(buffer,0,BYTES_PER_BLOCK);
-	//find a free block
-	unsigned short available_block =  check_fbv_for_available_block(fp);
-	//read block worth of data to a buffer
-	
-	fread(buffer,1,number_of_bytes,infile);
-	//write buffer out to block
-	
-	write_block(fp, available_block,buffer,number_of_bytes);
-	reset_fbv_bit(fp, available_block);
-	//updte the fbv to fill that block
-	free(buffer);	
-	return available_block;
-	
+	if (!metadata_batch.depth && metadata_batch.fp==fp)
+	{
+		metadata_batch.durability = DURABILITY_SYNCED;
+		write_metadata_batch(fp);
 	}
-	
-unsigned short create_indirection_block(FILE* fp, unsigned char parent_inode_id)
+	flush_vdisk(fp,DURABILITY_SYNCED);
+}
+
+//////////////JOURNAL
+/*
+ * Blocks 3 to 15, the reserved checkpoint region, hold a write-ahead journal for metadata. Each write of a metadata
+ * batch is one transaction. Its blocks are first appended to the journal with one sequential write, then the
+ * descriptor in block 3, which lists their home block numbers and a checksum over them, commits the transaction.
+ * Only then are the blocks written to their homes, which is the checkpoint. After a crash, recover_vdisk() copies a
+ * committed transaction to its homes again. A transaction whose checksum does not match was never committed, and
+ * its homes were never touched.
+ * The descriptor is retired lazily. It stays committed after the checkpoint, and is only marked empty when one of
+ * its blocks is about to be written outside the journal, so that a replay cannot undo that write. A vdisk made by
+ * init_vdisk_with_journal() may have a larger journal, which takes blocks from the start of the data section.
+ * The last block of the journal holds no transaction data. It is the inode map checkpoint of LOG-STRUCTURED MODE.
+ *
+ * A transaction with more blocks than the journal holds is spilled rather than split: its blocks are copied to
+ * data section blocks which are free both on the disk and in the batch, so that neither the state before the
+ * transaction nor the one after it uses them. Map blocks, also in such free blocks, pair each home block number
+ * with its copy, and a pair whose copy is 0 is unused. The descriptor is marked JOURNAL_SPILLED, lists the map
+ * blocks instead of homes, and commits the transaction with a checksum over the homes and the blocks as before.
+ * The copies may be taken by the next operation, so a spilled transaction is retired as soon as its checkpoint is
+ * done. Only on a vdisk with too few free blocks for the copies is a transaction still written in journal sized
+ * parts.
+ */
+const size_t JOURNAL_OFFSET = 3;
+const size_t JOURNAL_DEFAULT_BLOCKS = 13;
+const size_t JOURNAL_MAX_BLOCKS = 65;
+const size_t SUPERBLOCK_JOURNAL_BLOCKS_OFFSET = 12;
+const unsigned int JOURNAL_MAGIC = 0x4c4e524a;
+const unsigned short JOURNAL_EMPTY = 0;
+const unsigned short JOURNAL_COMMITTED = 1;
+const unsigned short JOURNAL_SPILLED = 2;
+const size_t JOURNAL_SPILL_PAIRS_PER_BLOCK = 128;
+const size_t JOURNAL_BLOCK_LIST_OFFSET = 16;
+
+struct journal_descriptor
 {
-	unsigned char* block_buffer = (unsigned char*)malloc(BYTES_PER_BLOCK);
-	memset(block_buffer,0,BYTES_PER_BLOCK);
-	unsigned short available_block_address = check_fbv_for_available_block(fp);
-	write_block(fp, available_block_address, block_buffer,BYTES_PER_BLOCK);
-	reset_fbv_bit(fp, available_block_address);
-	free(block_buffer);
-	return available_block_address;
-	
+	unsigned int magic;
+	unsigned int sequence;
+	unsigned short state;
+	unsigned short count;
+	unsigned int checksum;
+	//the home block numbers follow, as unsigned shorts from JOURNAL_BLOCK_LIST_OFFSET
+};
+
+struct journal
+{
+	FILE* fp; //the vdisk this describes, NULL until one is loaded
+	unsigned int blocks; //the descriptor and the blocks after it
+	unsigned int sequence;
+	int committed; //the descriptor on the disk holds a committed transaction
+	int count;
+	int block_numbers[64];
+};
 
+struct journal journal = {NULL,0,0,0,0,{0}};
+
+unsigned int journal_checksum(int count, int* block_numbers, char* blocks)
+{
+	unsigned int checksum = 2166136261u;
+	int i;
+	for (i=0;i<count;i++) checksum = (checksum^(unsigned int)block_numbers[i])*16777619u;
+	for (i=0;i<count*BYTES_PER_BLOCK;i++) checksum = (checksum^(unsigned char)blocks[i])*16777619u;
+	return checksum;
 }
 
+//reads the journal's size from the superblock and the last transaction from the descriptor, once per vdisk
+struct journal* get_journal(FILE* fp)
+{
+	if (journal.fp==fp) return &journal;
+	unsigned int journal_blocks;
+	read_block_value(fp,0,(char*)&journal_blocks,SUPERBLOCK_JOURNAL_BLOCKS_OFFSET,4);
+	//older vdisks leave the field 0
+	if (journal_blocks<2 || journal_blocks>JOURNAL_MAX_BLOCKS) journal_blocks = JOURNAL_DEFAULT_BLOCKS;
+	char* descriptor_block = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,JOURNAL_OFFSET,descriptor_block);
+	struct journal_descriptor* descriptor = (struct journal_descriptor*)descriptor_block;
+	unsigned short* block_list = (unsigned short*)(descriptor_block+JOURNAL_BLOCK_LIST_OFFSET);
+	journal.fp = fp;
+	journal.blocks = journal_blocks;
+	journal.sequence = descriptor->magic==JOURNAL_MAGIC ? descriptor->sequence : 0;
+	journal.committed = descriptor->magic==JOURNAL_MAGIC && descriptor->state==JOURNAL_COMMITTED && descriptor->count<journal_blocks;
+	journal.count = journal.committed ? descriptor->count : 0;
+	int i;
+	for (i=0;i<journal.count;i++) journal.block_numbers[i] = block_list[i];
+	free(descriptor_block);
+	return &journal;
+}
 
+//how many blocks one transaction may hold
+unsigned int get_journal_capacity(FILE* fp)
+{
+	//the last block of the journal is kept for the inode map checkpoint of the log-structured mode
+	unsigned int capacity = get_journal(fp)->blocks-2;
+	return capacity<METADATA_BATCH_MAX_BLOCKS ? capacity : METADATA_BATCH_MAX_BLOCKS;
+}
 
+void write_journal_descriptor(FILE* fp, unsigned short state, int count, int* block_numbers, unsigned int checksum)
+{
+	char* descriptor_block = (char*)malloc(BYTES_PER_BLOCK);
+	memset(descriptor_block,0,BYTES_PER_BLOCK);
+	struct journal_descriptor* descriptor = (struct journal_descriptor*)descriptor_block;
+	unsigned short* block_list = (unsigned short*)(descriptor_block+JOURNAL_BLOCK_LIST_OFFSET);
+	descriptor->magic = JOURNAL_MAGIC;
+	descriptor->sequence = journal.sequence;
+	descriptor->state = state;
+	descriptor->count = count;
+	descriptor->checksum = checksum;
+	int i;
+	for (i=0;i<count;i++) block_list[i] = block_numbers[i];
+	write_block_run(fp,JOURNAL_OFFSET,descriptor_block,1);
+	fflush(fp);
+	free(descriptor_block);
+}
 
-//returns the block addre
-unsigned short fill_single_indirection_block(FILE* fp,unsigned short single_indirection_block_num, unsigned short* num_blocks_remaining_to_write, long int size,unsigned short temp_data_block_address, FILE* fpin)
+//commits count blocks, with the given home block numbers, as one transaction
+void append_to_journal(FILE* fp, int count, int* block_numbers, char* blocks)
 {
-					
-//	printf("fill_single_indirection_block: block num %d, blocks remaining %d, \n",single_indirection_block_num,*num_blocks_remaining_to_write);
-	unsigned short* single_indirection_block_buffer = (unsigned short*) malloc(BYTES_PER_BLOCK);
-	read_block(fp,single_indirection_block_num,(char*)single_indirection_block_buffer);
-	
-	
-	int k;
-	for (k=0;k<BYTES_PER_BLOCK/2;k++)
-	{
-		//write another file block and allocate it to the next position in the single indirection block
-		if (*num_blocks_remaining_to_write ==1 && size%BYTES_PER_BLOCK)
-		{
-//			printf("create_file_in_directory: one block left to write\n");
-			temp_data_block_address = create_and_write_data_block_from_file(fp, size%BYTES_PER_BLOCK,fpin);
-		}
-		
-		
-		else
-		{
-//			printf("create_file_in_directory: there are %d blocks left to write\n",*num_blocks_remaining_to_write);
-			temp_data_block_address = create_and_write_data_block_from_file(fp,BYTES_PER_BLOCK,fpin);
-			
-		}
-		
-		single_indirection_block_buffer[k]=temp_data_block_address;
-//		printf("create_file_in_directory: writing in the %d position of the single indirect pointer position, writingthe address %d\n", k,temp_data_block_address);
-		(*num_blocks_remaining_to_write)--;
-//		printf("fill_single_indirection_block: num blocks remaining	 to write %d\n",*num_blocks_remaining_to_write);
-		if (*num_blocks_remaining_to_write == 0)
-		{
-//			printf("create_file_in_directory: assigning the single indirect block to the inode, and writing it out \n");
-			
-			write_block(fp,single_indirection_block_num,single_indirection_block_buffer,BYTES_PER_BLOCK);
-			free(single_indirection_block_buffer);
-			return single_indirection_block_num;
-			//there are no more blocks to write out and we can finish up the function
-		}		
-		
-	}	
-	
-	
+	struct journal* log = get_journal(fp);
+	write_block_run(fp,JOURNAL_OFFSET+1,blocks,count);
+	//the descriptor must not reach the device before the blocks it commits
+	flush_vdisk(fp,metadata_batch.durability);
+	log->sequence++;
+	write_journal_descriptor(fp,JOURNAL_COMMITTED,count,block_numbers,journal_checksum(count,block_numbers,blocks));
+	flush_vdisk(fp,metadata_batch.durability);
+	log->committed = 1;
+	log->count = count;
+	memcpy(log->block_numbers,block_numbers,count*sizeof(int));
 }
 
-void delete_directory_entry(FILE* fp, unsigned char directory_inode_id, char* removal_filename)
+//finds count blocks for the copies of a spilled transaction: free in the free block vector on the disk and in the
+//batch, and not in the batch at all, as a block freed by the batch may still have its home written. returns how many
+//it found
+int find_spill_blocks(FILE* fp, int count, unsigned short* block_addresses)
 {
-	unsigned short directory_inode_address = get_inode_address(fp,directory_inode_id);
-	unsigned short* directory_inode_block = malloc(BYTES_PER_BLOCK);
-	read_block(fp,directory_inode_address,(char*)directory_inode_block);
-	
-	unsigned short directory_data_block_address =directory_inode_block[4];
-	char* directory_data_block_buffer = (char*)malloc(BYTES_PER_BLOCK);
-	read_block(fp,directory_data_block_address,directory_data_block_buffer);
-	
+	unsigned char* free_on_disk = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	unsigned char* free_in_batch = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	unsigned char* batched = (unsigned char*)calloc(BYTES_PER_BLOCK,1);
+	fseek(fp,(off_t)FREE_BLOCK_VECTOR_OFFSET*BYTES_PER_BLOCK,SEEK_SET);
+	if (fread(free_on_disk,BYTES_PER_BLOCK,1,fp)!=1) memset(free_on_disk,0,BYTES_PER_BLOCK);
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,(char*)free_in_batch);
 	int i;
-	for (i=2;i<16;i++)
+	for (i=0;i<metadata_batch.count;i++) batched[metadata_batch.block_numbers[i]/8] |= 1<<(metadata_batch.block_numbers[i]%8);
+	int found = 0;
+	unsigned int block_num;
+	for (block_num=DATA_SECTION_OFFSET;block_num<=MAX_BLOCK_INDEX && found<count;block_num++)
 	{
-//		printf("Looking at directory entry number %d, filename: %s",i,&(directory_data_block_buffer[1+i*32]));
-		if (!strncmp(&(directory_data_block_buffer[1+i*32]),removal_filename,31))
+		if (block_is_free(free_on_disk,block_num) && block_is_free(free_in_batch,block_num) && !block_is_free(batched,block_num))
 		{
-			
-			//found the correct file to remove from the directory block
-			memset(directory_data_block_buffer+i*32,0,32);
-			write_block(fp, directory_data_block_address,directory_data_block_buffer,(i+1)*32);
+			block_addresses[found++] = block_num;
 		}
 	}
-	free(directory_inode_block);
-	free(directory_data_block_buffer); 
+	free(batched);
+	free(free_in_batch);
+	free(free_on_disk);
+	return found;
 }
 
-void delete_filepath(FILE* fp, char* filename)
-{	
-	/**PSEUDO
-	 * use filepath to find inode id for the file specified
-	 * look at inode block & check if it is file or directory
-	 * if file: delete_file
-	 * if dir: delete_directory 
-	 * remove entry from directory filelist where it is found
-	 * 
-	 * 
-	 */
-	
-	
-	
-	unsigned char file_inode_id = find_file_inode_id(fp, filename);
-	unsigned short file_block_address = get_inode_address(fp, file_inode_id);
-	char* file_inode_block = (char*)malloc(BYTES_PER_BLOCK);
-//	printf("deleet_filepath: file_inode_id=%d, file_block_address=%d\n",(int)file_inode_id,file_block_address);
-	
-	//check filetype
-	read_block(fp,file_block_address,file_inode_block);
-	int file_type = ((int*)file_inode_block)[1];
-//	printf("filetype=%c before tokenizing stuff\n",(char)file_type);
-	
-   
-   
-	char* delim = "/";
-   char *filename_token;
-   char *current_parent_filename = (char*)malloc(150);
-   memset(current_parent_filename,0,150);
-   current_parent_filename[0]='/';
-   /* get the first token */
-   char* working_filename = (char*)malloc(150);
-   memset(working_filename,0,150);
-   memcpy(working_filename,filename,strlen(filename));
-   filename_token = strtok(working_filename, delim);
-   
-   char* temp;
-   /* walk through other tokens */
-   while( filename_token != NULL ) {
-//      printf( "token %s\n", filename_token );
-	temp = filename_token;
-      filename_token = strtok(NULL, delim);
-	if (filename_token) {
-		strcat(current_parent_filename,temp);
-		strcat(current_parent_filename,"/");
-		}
-   }
- //  if (current_parent_filename)
-//	printf("parent filename: %s\n",current_parent_filename);
-	unsigned char parent_inode_id;
-	
-	if (!strcmp(current_parent_filename,"/")) parent_inode_id=0;
-	
-	else parent_inode_id = find_file_inode_id(fp, current_parent_filename);
-	
-   delete_directory_entry(fp,parent_inode_id,temp);
-   
-	
-	//now time to delete the entry from this directory
-//	printf("temp= %s\n parent inode id = %d\n",temp, (int)parent_inode_id);
-	
-	
-	
-//	printf("filetype: %c\n",(char)file_type);
-	
-	if ((char)file_type=='d')
+//commits count blocks as one spilled transaction. returns 0, or -1 if there are not enough free blocks for it
+int append_spilled_transaction(FILE* fp, int count, int* block_numbers, char* blocks)
+{
+	struct journal* log = get_journal(fp);
+	int map_count = (count+JOURNAL_SPILL_PAIRS_PER_BLOCK-1)/JOURNAL_SPILL_PAIRS_PER_BLOCK;
+	unsigned short* spill_addresses = (unsigned short*)malloc((count+map_count)*sizeof(unsigned short));
+	if (find_spill_blocks(fp,count+map_count,spill_addresses)<count+map_count)
 	{
-		
-		delete_directory(fp, file_inode_id);
-		
-		}
-	else if((char)file_type=='f')
+		free(spill_addresses);
+		return -1;
+	}
+	int i;
+	int run_start = 0;
+	for (i=1;i<=count;i++)
 	{
-		delete_file(fp,file_inode_id);
-		}
-	else
+		if (i<count && spill_addresses[i]==spill_addresses[i-1]+1) continue;
+		write_block_run(fp,spill_addresses[run_start],blocks+run_start*BYTES_PER_BLOCK,i-run_start);
+		run_start = i;
+	}
+	unsigned short* map_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	int* map_addresses = (int*)malloc(map_count*sizeof(int));
+	int map;
+	for (map=0;map<map_count;map++)
 	{
-		
-		printf("inode corrupted! incorrect inode filetype specifier\n");}
-	//now deleting the filename from the directory it is a part of 
-	//find the parent directory id
-	
-	
-	return;
+		memset(map_block,0,BYTES_PER_BLOCK);
+		for (i=0;i<JOURNAL_SPILL_PAIRS_PER_BLOCK && map*JOURNAL_SPILL_PAIRS_PER_BLOCK+i<count;i++)
+		{
+			map_block[2*i] = block_numbers[map*JOURNAL_SPILL_PAIRS_PER_BLOCK+i];
+			map_block[2*i+1] = spill_addresses[map*JOURNAL_SPILL_PAIRS_PER_BLOCK+i];
+		}
+		map_addresses[map] = spill_addresses[count+map];
+		write_block_run(fp,map_addresses[map],(char*)map_block,1);
+	}
+	//the descriptor must not reach the device before the copies and maps it commits
+	flush_vdisk(fp,metadata_batch.durability);
+	log->sequence++;
+	write_journal_descriptor(fp,JOURNAL_SPILLED,map_count,map_addresses,journal_checksum(count,block_numbers,blocks));
+	flush_vdisk(fp,metadata_batch.durability);
+	//an earlier transaction in the journal was replaced by this one
+	log->committed = 0;
+	log->count = 0;
+	free(map_addresses);
+	free(map_block);
+	free(spill_addresses);
+	return 0;
 }
-void delete_directory(FILE* fp, unsigned char directory_inode_id)
+
+//marks the descriptor of a spilled transaction empty, once its checkpoint is done
+void retire_spilled_transaction(FILE* fp)
 {
-	/*PSEUDO
-	 * check if directory is empty ie: all of the directory entries from 2-15 are empty
-	 * if not: print error message and returfn
-	 * else:
-	 * clear the directory's data block in inode's direct pointer position "0"
-	 * set the directory's data block fbv bit
-	 * set this inodes fbv bit to 1 meaning the block is free for use
-	 * set the inode map address for this inode's id to 00, meaning it is free for use
-	 * clear this inode's data
-	 * return
-	 * */
-	 
-	unsigned char* directory_inode_buffer=malloc(BYTES_PER_BLOCK);
-	memset(directory_inode_buffer,0,BYTES_PER_BLOCK);
-	unsigned short directory_inode_block_address = get_inode_address(fp,directory_inode_id);
-	read_block(fp, get_inode_address(fp,directory_inode_id),(char*)directory_inode_buffer);
-	//checking emptiness
-	unsigned short directory_data_block_address = ((unsigned short*)directory_inode_buffer)[4];
-//	printf("directory data block adress = %d\n",directory_data_block_address);
-	set_fbv_bit(fp,directory_data_block_address);
-	set_fbv_bit(fp,directory_inode_block_address);
-	unsigned char* directory_data_block_buffer = malloc(BYTES_PER_BLOCK);
-	memset(directory_data_block_buffer,0,BYTES_PER_BLOCK);
-	
-	read_block(fp, directory_data_block_address,(char*)directory_data_block_buffer);
+	write_journal_descriptor(fp,JOURNAL_EMPTY,0,NULL,0);
+}
+
+//called before block_num is written outside the journal. if the committed transaction holds the block, it is
+//marked empty first, as replaying it would put back the block's old contents
+void retire_journal_block(FILE* fp, int block_num)
+{
+	if (journal.fp!=fp || !journal.committed) return;
 	int i;
-//	printf("looking at directory in block address %d\n",directory_data_block_address);
-	for(i=2;i<16;i++)
-	{//	printf("slot %d: inode id in slot %d\n",i,(int)directory_data_block_buffer[i*32]);
-		if (directory_data_block_buffer[i*32])
+	for (i=0;i<journal.count;i++)
+	{
+		if (journal.block_numbers[i]!=block_num) continue;
+		write_journal_descriptor(fp,JOURNAL_EMPTY,0,NULL,0);
+		journal.committed = 0;
+		journal.count = 0;
+		return;
+	}
+}
+
+//copies a spilled transaction back from the blocks its map blocks name. returns the number of blocks written back
+int replay_spilled_transaction(FILE* fp, char* descriptor_block)
+{
+	struct journal_descriptor* descriptor = (struct journal_descriptor*)descriptor_block;
+	unsigned short* map_addresses = (unsigned short*)(descriptor_block+JOURNAL_BLOCK_LIST_OFFSET);
+	int map_count = descriptor->count;
+	if (map_count>(BYTES_PER_BLOCK-JOURNAL_BLOCK_LIST_OFFSET)/sizeof(unsigned short)) map_count = 0;
+	int* block_numbers = (int*)malloc((map_count*JOURNAL_SPILL_PAIRS_PER_BLOCK+1)*sizeof(int));
+	char* blocks = (char*)malloc((map_count*JOURNAL_SPILL_PAIRS_PER_BLOCK+1)*BYTES_PER_BLOCK);
+	unsigned short* map_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	int count = 0;
+	int valid = 1;
+	int map,i;
+	for (map=0;map<map_count && valid;map++)
+	{
+		if (map_addresses[map]>MAX_BLOCK_INDEX) valid = 0;
+		else read_block(fp,map_addresses[map],(char*)map_block);
+		for (i=0;i<JOURNAL_SPILL_PAIRS_PER_BLOCK && valid;i++)
 		{
-	//		printf("delete directory: directory of inode id %d not empty, therefore cannot delete directory\n",directory_inode_id);
-			return;
+			if (!map_block[2*i+1]) continue;
+			if (map_block[2*i]>MAX_BLOCK_INDEX || map_block[2*i+1]>MAX_BLOCK_INDEX) valid = 0;
+			else
+			{
+				block_numbers[count] = map_block[2*i];
+				read_block(fp,map_block[2*i+1],blocks+count*BYTES_PER_BLOCK);
+				count++;
 			}
-		
+		}
 	}
-	//made it this far, then the directory is empty and we can clear it
-	unsigned short* inode_map=malloc(BYTES_PER_BLOCK);
-	memset(inode_map,0,BYTES_PER_BLOCK);
-	read_block(fp,2,(char*)inode_map);
-	memset((char*)inode_map+directory_inode_id,0,2);
-	write_block(fp,2,inode_map,(directory_inode_id+1)*2);
-	free(inode_map);
-	
-	memset(directory_data_block_buffer,0,BYTES_PER_BLOCK);
-	write_block(fp, directory_inode_block_address,directory_data_block_buffer,BYTES_PER_BLOCK);
-//	printf("trying to overwrite in data block address %d",(int)directory_data_block_address);
-	write_block(fp, directory_data_block_address, directory_data_block_buffer,100);
-	
-	
-	return;
+	if (!valid || journal_checksum(count,block_numbers,blocks)!=descriptor->checksum)
+	{
+		printf("recover_vdisk: the last journal transaction is incomplete and was not replayed\n");
+		count = 0;
+	}
+	for (i=0;i<count;i++) write_block_run(fp,block_numbers[i],blocks+i*BYTES_PER_BLOCK,1);
+	fflush(fp);
+	free(map_block);
+	free(blocks);
+	free(block_numbers);
+	return count;
 }
-void delete_file(FILE* fp, unsigned char file_inode_id)
+
+//replays a transaction which was committed to the journal but may not have reached its homes, as after a crash.
+//call it after opening a vdisk and before anything else. returns the number of blocks written back
+int recover_vdisk(FILE* fp)
 {
-	/*PSEUDO
-	 *for each direct pointer:
-	 * 	clear the block in the address of the pointer
-	 * 	set the fbv bit for the block
-	 *if single_ind pointer != 00
-	 * 	clear single_ind_block in the address stored
-	 *  set the fbv bit for that address to be free/1\clear data in the single ind block
-	 *if double_ind_pointer !==0:
-	 * load the double indirection block	
-	 * for each pointer!=00:
-	 * 		clear single ind block for each pointer
-	 * 		set the fbv bit for that single ind block
-	 * clear the dbl ind block
-	 * set the fbv bit for double ind block =0
-	 *
-	 * 
-	 *
-	 *set inode fbv bit to 1/free
-	 *set the inode_map[id] = 00
-	 *clear the file's inode block
-	 */
-	 char* empty_block_buffer = malloc(BYTES_PER_BLOCK);
-	 memset(empty_block_buffer,0,BYTES_PER_BLOCK);
-	 unsigned short file_inode_block_address = get_inode_address(fp,file_inode_id);
-//	 printf("file inode block adddress = %d\n",file_inode_block_address);
-	 unsigned short* file_inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
-	 read_block(fp,file_inode_block_address,(char*)file_inode_buffer);
-	 //now we need to start clearing the blocks in the direct pointers
-	 int i;
-	 for(i=4;i<14;i++)
-	 {//each one of these is a direct pointer to potentiall an occupied space in memory
-//		printf("checking the %d direct pointer spot in the inode id = %d\n",i-4,file_inode_id);
-		
-		if (!file_inode_buffer[i])
-		 {//no remaining blocks to wipe
-//			printf("no remainging to wipe\n");
-			 break;	 
-		}
-		 write_block(fp,file_inode_buffer[i],empty_block_buffer,BYTES_PER_BLOCK);
-		 set_fbv_bit(fp,file_inode_buffer[i]);
-		 
-		 
-	  }
-	
-	
-	if (file_inode_buffer[14])
-	{//then there is a single indirection block we need to clear!
-		clear_single_indirection_block(fp,file_inode_buffer[14]);
-		set_fbv_bit(fp,file_inode_buffer[14]);
-		write_block(fp,file_inode_buffer[14],(char*)empty_block_buffer,BYTES_PER_BLOCK);
-		
-		
+	drop_vdisk_caches(fp);
+	journal.fp = NULL;
+	struct journal* log = get_journal(fp);
+	char* descriptor_block = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,JOURNAL_OFFSET,descriptor_block);
+	struct journal_descriptor* descriptor = (struct journal_descriptor*)descriptor_block;
+	if (descriptor->magic==JOURNAL_MAGIC && descriptor->state==JOURNAL_SPILLED)
+	{
+		int replayed = replay_spilled_transaction(fp,descriptor_block);
+		free(descriptor_block);
+		write_journal_descriptor(fp,JOURNAL_EMPTY,0,NULL,0);
+		recover_log_inode_map(fp);
+		return replayed;
 	}
-	
-	
-//	printf("now setting the inode_map[%d] to be 0",file_inode_id);
-	unsigned short* inode_map=malloc(BYTES_PER_BLOCK);
+	unsigned int checksum = descriptor->checksum;
+	free(descriptor_block);
+	if (!log->committed)
+	{
+		recover_log_inode_map(fp);
+		return 0;
+	}
+	int count = log->count;
+	char* blocks = (char*)malloc(count*BYTES_PER_BLOCK);
+	fseek(fp,(off_t)(JOURNAL_OFFSET+1)*BYTES_PER_BLOCK,SEEK_SET);
+	if (fread(blocks,BYTES_PER_BLOCK,count,fp)!=count || journal_checksum(count,log->block_numbers,blocks)!=checksum)
+	{
+		printf("recover_vdisk: the last journal transaction is incomplete and was not replayed\n");
+		count = 0;
+	}
+	int i;
+	for (i=0;i<count;i++) write_block_run(fp,log->block_numbers[i],blocks+i*BYTES_PER_BLOCK,1);
+	fflush(fp);
+	free(blocks);
+	write_journal_descriptor(fp,JOURNAL_EMPTY,0,NULL,0);
+	log->committed = 0;
+	log->count = 0;
+	recover_log_inode_map(fp);
+	return count;
+}
+
+//////////////LOG-STRUCTURED MODE
+/*
+ * mount_log_structured() switches a vdisk to log-structured writes until unmount_log_structured(). The data section
+ * is split into segments of SEGMENT_BLOCKS blocks. Every block allocated while mounted, for data, pointers,
+ * directories and inodes alike, is taken at the log head. The head runs through the free blocks of its segment,
+ * then moves on to the next segment which is entirely free, so writes land one after another. Only when no clean
+ * segment is left does the log fall back to filling holes wherever they are.
+ * The inode map is a table in memory. It is never rewritten in block 2. Inodes are relocated instead of updated in
+ * place: when a batch commits, every inode it changed is moved to the log head and the table is pointed at the new
+ * copy. At each commit the table is checkpointed to the last block of the checkpoint region, inside the same
+ * journal transaction as the blocks it points to. Unmounting writes the table back to block 2, so the vdisk can
+ * be used without the log again. Blocks which are already allocated, such as a directory's blocks or the free
+ * block vector, are still updated in place. Only the inode map refers to an inode's address, but any other block is
+ * named by a pointer in its owner, and the disk keeps no record of which block that owner is.
+ */
+const size_t SEGMENT_BLOCKS = 16;
+const size_t SEGMENT_COUNT = 255;
+//kept in inode map slot 255, which no inode uses, to mark a valid checkpoint
+const unsigned short LOG_CHECKPOINT_MARK = 0x4c47;
+
+int is_log_structured(FILE* fp)
+{
+	return log_state.fp && log_state.fp==fp;
+}
+
+//an inode is never overwritten while mounted. written outside a batch, it becomes a batch of its own, so that it is
+//moved when the batch commits. returns 1 if the block was written that way
+int write_log_inode_block(FILE* fp, unsigned int block_num, void* data, int size_of_data_in_bytes)
+{
+	if (!is_log_structured(fp) || (metadata_batch.depth && metadata_batch.fp==fp)) return 0;
+	int inode_id;
+	for (inode_id=0;inode_id<INODE_MAX_NUM-1 && log_state.inode_map[inode_id]!=block_num;inode_id++);
+	if (inode_id==INODE_MAX_NUM-1) return 0;
+	begin_metadata_batch(fp);
+	write_block(fp,block_num,data,size_of_data_in_bytes);
+	commit_metadata_batch(fp);
+	return 1;
+}
+
+unsigned short get_log_checkpoint_block(FILE* fp)
+{
+	return JOURNAL_OFFSET+get_journal(fp)->blocks-1;
+}
+
+int block_is_free(unsigned char* free_block_vector, unsigned int block_num)
+{
+	return (free_block_vector[block_num/8]>>(block_num%8))&1;
+}
+
+unsigned int get_segment_start(unsigned int segment)
+{
+	return DATA_SECTION_OFFSET+segment*SEGMENT_BLOCKS;
+}
+
+int segment_is_clean(unsigned char* free_block_vector, unsigned int segment)
+{
+	unsigned int block_num;
+	for (block_num=get_segment_start(segment);block_num<get_segment_start(segment+1);block_num++)
+	{
+		if (!block_is_free(free_block_vector,block_num)) return 0;
+	}
+	return 1;
+}
+
+unsigned int get_block_segment(unsigned int block_num)
+{
+	return (block_num-DATA_SECTION_OFFSET)/SEGMENT_BLOCKS;
+}
+
+unsigned short move_log_head(unsigned int block_num)
+{
+	log_state.segment_written[get_block_segment(block_num)] = log_state.clock;
+	return log_state.head = block_num;
+}
+
+//returns the free block at the log head and moves the head there, or 0 if the vdisk is full. the caller marks the
+//block used in free_block_vector
+unsigned short next_log_block(FILE* fp, unsigned char* free_block_vector)
+{
+	unsigned int block_num = log_state.head;
+	unsigned int segment = get_block_segment(block_num);
+	for (;block_num<get_segment_start(segment+1);block_num++)
+	{
+		if (block_is_free(free_block_vector,block_num)) return move_log_head(block_num);
+	}
+	unsigned int i;
+	for (i=1;i<=SEGMENT_COUNT;i++)
+	{
+		unsigned int next_segment = (segment+i)%SEGMENT_COUNT;
+		if (segment_is_clean(free_block_vector,next_segment)) return move_log_head(get_segment_start(next_segment));
+	}
+	//no segment is clean, so the log fills holes
+	unsigned int section_blocks = MAX_BLOCK_INDEX+1-DATA_SECTION_OFFSET;
+	for (i=0;i<section_blocks;i++)
+	{
+		block_num = DATA_SECTION_OFFSET+(log_state.head-DATA_SECTION_OFFSET+i)%section_blocks;
+		if (block_is_free(free_block_vector,block_num)) return move_log_head(block_num);
+	}
+	return 0;
+}
+
+//moves every inode which the batch changed to the log head, and checkpoints the inode map with the batch
+void commit_log_structured(FILE* fp)
+{
+	//with the free block vector in the batch, the moves below add no blocks to it, so none of it is flushed early
+	get_batched_block(fp,FREE_BLOCK_VECTOR_OFFSET,1);
+	log_state.clock++;
+	int inode_id;
+	for (inode_id=0;inode_id<INODE_MAX_NUM-1;inode_id++)
+	{
+		unsigned short old_address = log_state.inode_map[inode_id];
+		if (!old_address || !find_batched_block(fp,old_address)) continue;
+		unsigned short new_address = check_fbv_for_available_block(fp);
+		if (!new_address) break;
+		reset_fbv_bit(fp,new_address);
+		set_fbv_bit(fp,old_address);
+		//a block freed earlier in the batch may still have its last contents there
+		drop_batched_block(fp,new_address);
+		char* batched_inode = find_batched_block(fp,old_address);
+		metadata_batch.block_numbers[(batched_inode-metadata_batch.blocks)/BYTES_PER_BLOCK] = new_address;
+		log_state.inode_map[inode_id] = new_address;
+		log_state.inode_map_dirty = 1;
+	}
+	if (!log_state.inode_map_dirty) return;
+	unsigned short* checkpoint = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	memcpy(checkpoint,log_state.inode_map,BYTES_PER_BLOCK);
+	checkpoint[INODE_MAX_NUM-1] = LOG_CHECKPOINT_MARK;
+	write_block(fp,get_log_checkpoint_block(fp),checkpoint,BYTES_PER_BLOCK);
+	free(checkpoint);
+	log_state.inode_map_dirty = 0;
+}
+
+//reads the inode map from the checkpoint if the vdisk was last mounted log-structured, otherwise from block 2
+void load_log_inode_map(FILE* fp)
+{
+	read_block(fp,get_log_checkpoint_block(fp),(char*)log_state.inode_map);
+	if (log_state.inode_map[INODE_MAX_NUM-1]!=LOG_CHECKPOINT_MARK) read_block(fp,INODE_MAP_OFFSET,(char*)log_state.inode_map);
+	log_state.inode_map[INODE_MAX_NUM-1] = 0;
+}
+
+//returns 0, or -1 if another vdisk is mounted log-structured already
+int mount_log_structured(FILE* fp)
+{
+	if (log_state.fp)
+	{
+		if (log_state.fp==fp) return 0;
+		printf("mount_log_structured: another vdisk is mounted log-structured\n");
+		return -1;
+	}
+	fflush(fp);
+	load_log_inode_map(fp);
+	log_state.head = DATA_SECTION_OFFSET;
+	log_state.inode_map_dirty = 0;
+	log_state.clock = 0;
+	memset(log_state.segment_written,0,sizeof(log_state.segment_written));
+	log_state.cleaning = 0;
+	log_state.cleaner_budget = -1;
+	log_state.fp = fp;
+	return 0;
+}
+
+//writes the inode map in log_state back to block 2 and clears the checkpoint. the vdisk must not be mounted
+void write_back_log_inode_map(FILE* fp)
+{
+	unsigned short* inode_map = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	memcpy(inode_map,log_state.inode_map,BYTES_PER_BLOCK);
+	//the map and the cleared checkpoint go together, so a crash leaves one of the two in use
+	begin_metadata_batch(fp);
+	write_block(fp,INODE_MAP_OFFSET,inode_map,BYTES_PER_BLOCK);
 	memset(inode_map,0,BYTES_PER_BLOCK);
-	read_block(fp,2,(char*)inode_map);
-	//memset(((char*)inode_map)+file_inode_id,0,2);
-	inode_map[file_inode_id]=0;
-	
-	write_block(fp,2,inode_map,BYTES_PER_BLOCK);
+	write_block(fp,get_log_checkpoint_block(fp),inode_map,BYTES_PER_BLOCK);
+	commit_metadata_batch(fp);
 	free(inode_map);
-	
-	write_block(fp,file_inode_block_address,empty_block_buffer,BYTES_PER_BLOCK);
-	free(empty_block_buffer);
-	set_fbv_bit(fp, file_inode_block_address);
-	return;
-	
 }
-void clear_single_indirection_block(FILE* fp, unsigned short indirection_block_address)
-{	
-	unsigned char* empty_block_buffer = malloc(BYTES_PER_BLOCK);
-	memset(empty_block_buffer,0,BYTES_PER_BLOCK);
-//	printf("clearing indirection block\n");
-	unsigned short* indirection_block_buffer = malloc(BYTES_PER_BLOCK);
-	unsigned short i;
-	read_block(fp,indirection_block_address,(char*)indirection_block_buffer);
-	for(i=0;i<256;i++)
-	{//for each pointer in the single indirection block
-		if(indirection_block_buffer[i])
-		{
-//		printf("clear_single_indirection_block: clearing the data block %d  ",i);
-		write_block(fp,indirection_block_buffer[i],empty_block_buffer,BYTES_PER_BLOCK);
-		set_fbv_bit(fp,indirection_block_buffer[i]);
-		}
+
+void unmount_log_structured(FILE* fp)
+{
+	if (!is_log_structured(fp)) return;
+	if (metadata_batch.depth && metadata_batch.fp==fp)
+	{
+		printf("unmount_log_structured: a metadata batch is still open\n");
+		return;
 	}
-	
-	
-	return;
+	write_deferred_metadata_batch(fp);
+	log_state.fp = NULL;
+	write_back_log_inode_map(fp);
 }
 
-//RETURNS the inode id which belongs to this new files inode 
+//a crash while the vdisk was mounted log-structured leaves block 2 behind the checkpoint, which is copied there
+void recover_log_inode_map(FILE* fp)
+{
+	if (is_log_structured(fp)) return;
+	unsigned short* checkpoint = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_log_checkpoint_block(fp),(char*)checkpoint);
+	if (checkpoint[INODE_MAX_NUM-1]==LOG_CHECKPOINT_MARK)
+	{
+		load_log_inode_map(fp);
+		write_back_log_inode_map(fp);
+	}
+	free(checkpoint);
+}
+
+//////////////SEGMENT CLEANER
+/*
+ * Without cleaning, a vdisk mounted log-structured runs out of clean segments after one pass over the disk, and
+ * from then on the log only fills holes. The cleaner empties segments by copying their live blocks to the log head.
+ * A segment's live blocks are the blocks the free block vector marks used. Its age is the clock of the last block
+ * the log took in it, kept in memory since the vdisk was mounted. Victims are chosen by the cost-benefit policy of
+ * LFS: the free space cleaning wins, 1-u for a segment a fraction u of which is live, times its age, over the cost
+ * of reading the segment and writing its live blocks back, 1+u. Old, mostly empty segments go first, and segments
+ * which are still changing are left to empty themselves.
+ * The disk has no back pointers, so the cleaner first finds the referrer of every block by walking the inodes in the
+ * inode map and their pointer blocks. A block is copied to the log head, its referrer is pointed at the copy, and
+ * the old block is freed. The referrer is an inode or a pointer block, and for an inode it is the inode map. File
+ * data is written straight to its new block. Every other block, and the pointer and free block vector updates,
+ * go through a metadata batch, one per segment. The batch rewrites the segment's inodes in place at the end, and
+ * its commit moves them to the log head like any other changed inode.
+ * A block in the deduplication index may have any number of referrers, so it stays where it is.
+ * The cleaner has no thread of its own. The library keeps its batch, caches and log state without a lock, so the
+ * cleaner runs inline, in the thread which commits: after each commit, while fewer than CLEANER_LOW_SEGMENTS
+ * segments are clean, it moves at most CLEANER_BLOCKS_PER_COMMIT blocks before the operation returns. That is the
+ * most any foreground operation waits on it. set_cleaner_budget() changes that share, and with 0 the cleaner only
+ * runs when clean_segments() is called, for instance while the vdisk is idle.
+ */
+const size_t CLEANER_LOW_SEGMENTS = 8;
+const size_t CLEANER_BLOCKS_PER_COMMIT = 32;
+//a segment with more live blocks than this wins too little for its copy
+const size_t CLEANER_MAX_LIVE_BLOCKS = 12;
 
+//where the pointer to a block is kept: position, counted in pointers, of block owner, an inode or a pointer block.
+//the referrer of an inode is its slot in the inode map, INODE_MAP_OFFSET. owner is 0 for a block nothing refers to
+struct block_referrer
+{
+	unsigned short owner;
+	unsigned short position;
+	unsigned char inode_id;
+	char data_block; //set for the data blocks of a regular file
+};
 
-unsigned char upload_file(FILE* fp, char* path_to_parent_dir, char* file_name, FILE* fpin)
+void add_block_referrer(struct block_referrer* referrers, unsigned short block_num, unsigned short owner, unsigned short position, unsigned char inode_id, char data_block)
 {
-	fseek(fp,0,SEEK_SET);
-	unsigned char parent_inode_id = find_file_inode_id(fp,path_to_parent_dir);
-	create_file_in_directory(fp,parent_inode_id,file_name,fpin);
-	
-	
+	if (block_num>MAX_BLOCK_INDEX) return;
+	referrers[block_num].owner = owner;
+	referrers[block_num].position = position;
+	referrers[block_num].inode_id = inode_id;
+	referrers[block_num].data_block = data_block;
 }
 
-unsigned char create_file_in_directory(FILE* fp, unsigned char parent_inode_id, char* file_name, FILE* fpin)
+//levels is the number of pointer blocks from this one down to the blocks of the file, itself included
+void find_pointer_block_referrers(FILE* fp, struct block_referrer* referrers, unsigned short pointer_block_address, int levels, unsigned char inode_id, char data_file)
 {
-//	printf("create_file_in_directory: starting file creation\n");
-	//find out size of file
-	long int size = 0;
-	fseek(fpin,0,SEEK_END);
-	size=ftell(fpin);
-//	printf("create_file_in_directory: size = %ld bytes\n",size);
-	
-	
-	//reposition the fp to the beginnign of the file
-	fseek(fpin, 0,SEEK_SET);
-	
-	
-	
-	unsigned char inode_num = find_next_free_inode_id(fp);
-//	printf("create_file_in_directory: next free inode %d\n",(int)inode_num);
-	
-	unsigned short num_blocks_remaining_to_write = size/BYTES_PER_BLOCK;
-//	printf("create_file_in_directory: total num of blocks needed= %d\n",num_blocks_remaining_to_write);
-	if (size%BYTES_PER_BLOCK) num_blocks_remaining_to_write++;
-//	 printf("create_file_in_directory: num blocks to write %d\n",(int)num_blocks_remaining_to_write);
-	//create inode with file type and size
-	unsigned short inode_data_block_address = create_empty_inode(fp, inode_num,size,'f');
-//	printf("create_file_in_directory: inode data block address = %d\n", (int)inode_data_block_address);
+	unsigned short* pointer_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,pointer_block_address,(char*)pointer_block);
+	int i;
+	for (i=0;i<POINTERS_PER_BLOCK;i++)
+	{
+		if (!pointer_block[i]) continue;
+		add_block_referrer(referrers,pointer_block[i],pointer_block_address,i,inode_id,levels==1 && data_file);
+		if (levels>1) find_pointer_block_referrers(fp,referrers,pointer_block[i],levels-1,inode_id,data_file);
+	}
+	free(pointer_block);
+}
+
+//returns a table of the referrers of all blocks, by block number, for the caller to free
+struct block_referrer* find_block_referrers(FILE* fp)
+{
+	struct block_referrer* referrers = (struct block_referrer*)calloc(MAX_BLOCK_INDEX+1,sizeof(struct block_referrer));
+	unsigned short* inode_map = (unsigned short*)malloc(BYTES_PER_BLOCK);
 	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
-	
-	read_block(fp,inode_data_block_address,(char*)inode_buffer);
-	assign_location_to_inode_map(fp, inode_data_block_address, inode_num);
-	unsigned short temp_data_block_address;
-	int i =0;
-	//the first 10 blocks will be written to direct pointers
-	for (i=0;i<10;i++)
-	{	
-		if (num_blocks_remaining_to_write ==1 && size%BYTES_PER_BLOCK)
+	read_block(fp,INODE_MAP_OFFSET,(char*)inode_map);
+	int inode_id;
+	for (inode_id=0;inode_id<INODE_MAX_NUM-1;inode_id++)
+	{
+		unsigned short inode_address = inode_map[inode_id];
+		if (!inode_address) continue;
+		add_block_referrer(referrers,inode_address,INODE_MAP_OFFSET,inode_id,inode_id,0);
+		read_block(fp,inode_address,(char*)inode_buffer);
+		char data_file = (char)((int*)inode_buffer)[1]=='f';
+		int i;
+		for (i=0;i<DIRECT_POINTER_COUNT;i++)
 		{
-//			printf("create_file_in_directory: one block left to write\n");
-			temp_data_block_address = create_and_write_data_block_from_file(fp, size%BYTES_PER_BLOCK,fpin);
+			unsigned short position = INODE_DIRECT_OFFSET/2+i;
+			if (inode_buffer[position]) add_block_referrer(referrers,inode_buffer[position],inode_address,position,inode_id,data_file);
 		}
-		
-		
-		else
-		{
-//			printf("create_file_in_directory: there are %d blocks left to write\n",num_blocks_remaining_to_write);
-			temp_data_block_address = create_and_write_data_block_from_file(fp,BYTES_PER_BLOCK,fpin);
-			
-		}	
-		
-		inode_buffer[INODE_DIRECT_OFFSET/2+i]=temp_data_block_address;
-//		printf("create_file_in_directory: writing in the %d position of the inode direct pointers\n", i);
-		num_blocks_remaining_to_write--;
-		if (num_blocks_remaining_to_write == 0)
+		int depth;
+		for (depth=1;depth<=MAX_INDIRECTION_DEPTH;depth++)
 		{
-//			printf("create_file_in_directory: adding the element to the parent directory\n");
-			add_element_to_directory(fp,parent_inode_id,inode_num,file_name);
-			
-			write_block(fp,inode_data_block_address,inode_buffer,INODE_BYTES);
-			return inode_num;
-			//there are no more blocks to write out and we can finish up the function
+			unsigned short position = INODE_INDIRECTION_OFFSETS[depth-1]/2;
+			if (!inode_buffer[position]) continue;
+			add_block_referrer(referrers,inode_buffer[position],inode_address,position,inode_id,0);
+			find_pointer_block_referrers(fp,referrers,inode_buffer[position],depth,inode_id,data_file);
 		}
 	}
-	
-	//if execution has made it this far, then there are blocks to be written which have not been written out yet
-	unsigned short single_indirection_block_num = create_indirection_block(fp,parent_inode_id);
-	fill_single_indirection_block(fp,single_indirection_block_num,&num_blocks_remaining_to_write, size,temp_data_block_address,fpin);
-	inode_buffer[14]=single_indirection_block_num;
-	
-	int k;
-	if (num_blocks_remaining_to_write!=0)
+	free(inode_buffer);
+	free(inode_map);
+	forget_shared_blocks(fp,referrers);
+	return referrers;
+}
+
+unsigned int count_live_blocks(unsigned char* free_block_vector, unsigned int segment)
+{
+	unsigned int live = 0;
+	unsigned int block_num;
+	for (block_num=get_segment_start(segment);block_num<get_segment_start(segment+1);block_num++)
 	{
-		unsigned short double_indirection_block_num = create_indirection_block(fp,parent_inode_id);
-		unsigned short* double_indirection_block_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
-		read_block(fp,double_indirection_block_num, (char*)double_indirection_block_buffer);
-		memset(double_indirection_block_buffer,0,BYTES_PER_BLOCK);
-//		printf("creating double indirection block. to be stored in block space %d\n",double_indirection_block_num);
-		for (k=0;k<256;k++)
-		{
-//			printf("creating a new single indirection block within the dbl , number %d",k);
-			single_indirection_block_num = create_indirection_block(fp,parent_inode_id);
-			fill_single_indirection_block(fp,single_indirection_block_num,&num_blocks_remaining_to_write, size,temp_data_block_address,fpin);
-			double_indirection_block_buffer[k]=single_indirection_block_num;
-			if (num_blocks_remaining_to_write==0)
-			{
-				//finished writing out the file
-				inode_buffer[15]=double_indirection_block_num;
-				break;
-			}
-		
-			
-		
-		
-		}
-	}	
-	add_element_to_directory(fp,parent_inode_id,inode_num,file_name);
-			
-	write_block(fp,inode_data_block_address,inode_buffer, INODE_BYTES);
-	return inode_num;
-	//update the single indirection pointer in the inode
-	
-	
+		if (!block_is_free(free_block_vector,block_num)) live++;
+	}
+	return live;
 }
-//returns the blocks remaining to write
-unsigned short read_from_single_indirection_block(FILE* fp, unsigned short single_indirection_block_num, 
-										unsigned short num_blocks_remaining_to_read,long int size,
-										FILE* fpout)
+
+//returns the segment worth cleaning most, or SEGMENT_COUNT if none is. the segment of the log head is never picked,
+//nor a segment whose live blocks cannot be moved, as nothing refers to them, nor one set in cleaned
+unsigned int pick_victim_segment(unsigned char* free_block_vector, struct block_referrer* referrers, char* cleaned)
 {
-	/*
-	 * if num==1&&&&remainder
-	 * 	read block into buff
-	 * 
-	 * 	write block out 
-	 * 
-	 * else
-	 * 	do same
-	 * dec num remaining
-	 * 
-	 * 
-	 * */
-//	 printf("read_from_single_ind_block: num blocks to read = %d\n",num_blocks_remaining_to_read);
-	char* temp_block = (char*)malloc(BYTES_PER_BLOCK);
-	unsigned short * indirection_block_buff = (unsigned short*)malloc(BYTES_PER_BLOCK);
-	memset(indirection_block_buff,0,BYTES_PER_BLOCK);
-	read_block(fp, single_indirection_block_num, (char*)indirection_block_buff);
-	int i;
-	
-	for (i=0; i< BYTES_PER_BLOCK/2; i++)
+	unsigned int victim = SEGMENT_COUNT;
+	unsigned long long best_score = 0;
+	unsigned int segment;
+	for (segment=0;segment<SEGMENT_COUNT;segment++)
 	{
-//		printf("writin to block %d in newfile from address number %d in indirection block. block addres stord is %d\n",10+i,i,indirection_block_buff[i]);
-		if (num_blocks_remaining_to_read==1)
-		{
-//			printf("reading the last block which is number %d in the indirection block and contains block address: %d\n",i,indirection_block_buff[i]);
-			read_block(fp, indirection_block_buff[i],(char*)temp_block);
-			write_block(fpout, 10+i,temp_block, size%BYTES_PER_BLOCK);
-//			printf("temp_block: %s\n",(char*)temp_block);
-			
-			
-		}
-		else
+		if (segment==get_block_segment(log_state.head) || cleaned[segment]) continue;
+		unsigned int live = count_live_blocks(free_block_vector,segment);
+		if (!live || live>CLEANER_MAX_LIVE_BLOCKS) continue;
+		unsigned int block_num;
+		for (block_num=get_segment_start(segment);block_num<get_segment_start(segment+1);block_num++)
 		{
-//			printf("reading another block\n");
-			read_block(fp, indirection_block_buff[i],temp_block);
-			write_block(fpout, 10+i, temp_block,BYTES_PER_BLOCK);
-			
-			
+			if (!block_is_free(free_block_vector,block_num) && referrers[block_num].owner) break;
 		}
-		num_blocks_remaining_to_read--;
-		if (num_blocks_remaining_to_read==0)
+		if (block_num==get_segment_start(segment+1)) continue;
+		unsigned long long age = log_state.clock-log_state.segment_written[segment]+1;
+		//(1-u)*age/(1+u), scaled by 1024 to stay in integers
+		unsigned long long score = (SEGMENT_BLOCKS-live)*age*1024/(SEGMENT_BLOCKS+live);
+		if (score>best_score)
 		{
-//			printf("block remaining counter is 0 so exiting loop\n");
-			break;
+			best_score = score;
+			victim = segment;
 		}
 	}
-	free(indirection_block_buff);
-	free(temp_block);
-	return num_blocks_remaining_to_read;
-	
-	
+	return victim;
 }
-///////////////////////////////////////////////////////////////////////////////////////////Dirctly copied from above. need to use the same principles to read from an inode id
-FILE* download_file_from_inode_id(FILE* fp, unsigned char inode_id, char* new_filename)
+
+//copies a block which is not an inode to the log head and points its referrer at the copy. returns 0, or -1 when
+//the log has no free block left outside the victim segment
+int relocate_block(FILE* fp, struct block_referrer* referrers, unsigned short block_num, unsigned int victim)
 {
-//	printf("create_file_in_directory: starting file creation\n");
-	//find out size of file
-	unsigned int size = 0;
-	
-	unsigned short* inode_map = (unsigned short*)malloc(BYTES_PER_BLOCK);
-	memset(inode_map,0,BYTES_PER_BLOCK);
-	read_block(fp,2,(char*)inode_map);
-	
+	struct block_referrer* referrer = &referrers[block_num];
+	unsigned short new_address = check_fbv_for_available_block(fp);
+	if (!new_address || get_block_segment(new_address)==victim) return -1;
+	reset_fbv_bit(fp,new_address);
+	char* block = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,block_num,block);
+	if (referrer->data_block)
+	{
+		drop_batched_block(fp,new_address);
+		retire_journal_block(fp,new_address);
+		write_block_run(fp,new_address,block,1);
+	}
+	else write_block(fp,new_address,block,BYTES_PER_BLOCK);
 	
-	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	unsigned short* owner_block = (unsigned short*)block;
+	read_block(fp,referrer->owner,block);
+	owner_block[referrer->position] = new_address;
+	write_block(fp,referrer->owner,block,BYTES_PER_BLOCK);
+	free(block);
 	
-	read_block(fp,inode_map[inode_id],(char*)inode_buffer);
-	
-	size = (int)inode_buffer[0];
-	
-	
-	
-	FILE* outfile = fopen(new_filename,"wb");
-	
-	unsigned short num_blocks_needed_in_total = size/BYTES_PER_BLOCK;
-	if (size%BYTES_PER_BLOCK) num_blocks_needed_in_total++;
-	unsigned short num_blocks_remaining_to_write = size/BYTES_PER_BLOCK;
-	if (size%BYTES_PER_BLOCK) num_blocks_remaining_to_write++;
-//	 printf("create_file_in_directory: num blocks to write %d\n",(int)num_blocks_remaining_to_write);
-	//create inode with file type and size
-	unsigned short temp_data_block_address;
-	int i =0;
-	
-	unsigned char* temp_data_block_buffer = malloc(BYTES_PER_BLOCK);
-	//the first 10 blocks will be written to direct pointers
-	for (i=0;i<10;i++)
-	{	//triggered if there is one block left to write out which does not have enough characters to fill a whole block
-		if (num_blocks_remaining_to_write ==1 && size%BYTES_PER_BLOCK)
-		{	
-			read_block(fp, inode_buffer[4+i],(char*)temp_data_block_buffer);
-//				printf("create_file_in_directory: one block left to write\n");
-			write_block(outfile,i,temp_data_block_buffer, size%BYTES_PER_BLOCK);
-//			printf("last block: %s\n",temp_data_block_buffer);
+	drop_batched_block(fp,block_num);
+	set_fbv_bit(fp,block_num);
+	invalidate_block_map_cache(fp,referrer->inode_id);
+	//the blocks this one points to are now referred to from the copy
+	int i;
+	if (!referrer->data_block)
+	{
+		for (i=0;i<=MAX_BLOCK_INDEX;i++)
+		{
+			if (referrers[i].owner==block_num) referrers[i].owner = new_address;
+		}
+	}
+	referrers[new_address] = *referrer;
+	memset(referrer,0,sizeof(struct block_referrer));
+	return 0;
+}
+
+//moves at most budget live blocks out of the victim segment, in one metadata batch. returns how many were moved,
+//or -1 if the log ran out of room
+int clean_segment(FILE* fp, struct block_referrer* referrers, unsigned int victim, int budget)
+{
+	int moved = 0;
+	int result = 0;
+	begin_metadata_batch(fp);
+	unsigned char* free_block_vector = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,(char*)free_block_vector);
+	unsigned int block_num;
+	for (block_num=get_segment_start(victim);block_num<get_segment_start(victim+1) && moved<budget;block_num++)
+	{
+		struct block_referrer* referrer = &referrers[block_num];
+		if (block_is_free(free_block_vector,block_num) || !referrer->owner || referrer->owner==INODE_MAP_OFFSET) continue;
+		if (relocate_block(fp,referrers,block_num,victim))
+		{
+			result = -1;
+			break;
 		}
+		moved++;
+	}
+	//inodes last, so that they carry the pointers changed above when the commit moves them
+	char* inode_block = (char*)malloc(BYTES_PER_BLOCK);
+	for (block_num=get_segment_start(victim);!result && block_num<get_segment_start(victim+1) && moved<budget;block_num++)
+	{
+		if (block_is_free(free_block_vector,block_num) || referrers[block_num].owner!=INODE_MAP_OFFSET) continue;
+		read_block(fp,block_num,inode_block);
+		write_block(fp,block_num,inode_block,BYTES_PER_BLOCK);
+		moved++;
+	}
+	free(inode_block);
+	free(free_block_vector);
+	commit_metadata_batch(fp);
+	return result ? result : moved;
+}
+
+unsigned int count_clean_segments(FILE* fp)
+{
+	unsigned char* free_block_vector = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,(char*)free_block_vector);
+	unsigned int clean_segment_count = 0;
+	unsigned int segment;
+	for (segment=0;segment<SEGMENT_COUNT;segment++) clean_segment_count += segment_is_clean(free_block_vector,segment);
+	free(free_block_vector);
+	return clean_segment_count;
+}
+
+//cleans segments by cost-benefit until budget live blocks have been moved or no segment is worth cleaning. each
+//segment is cleaned once at most, so that the blocks just moved into a segment are not moved again. the vdisk must
+//be mounted log-structured. returns the number of blocks moved
+int clean_segments(FILE* fp, int budget)
+{
+	if (!is_log_structured(fp) || log_state.cleaning) return 0;
+	log_state.cleaning = 1;
+	int moved = 0;
+	char cleaned[255] = {0};
+	unsigned char* free_block_vector = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	while (moved<budget)
+	{
+		//found again for every segment, as the commit of the last one moved its inodes
+		struct block_referrer* referrers = find_block_referrers(fp);
+		read_block(fp,FREE_BLOCK_VECTOR_OFFSET,(char*)free_block_vector);
+		unsigned int victim = pick_victim_segment(free_block_vector,referrers,cleaned);
+		int segment_moved = victim==SEGMENT_COUNT ? -1 : clean_segment(fp,referrers,victim,budget-moved);
+		free(referrers);
+		if (segment_moved<=0) break;
+		moved += segment_moved;
+		cleaned[victim] = 1;
+	}
+	free(free_block_vector);
+	log_state.cleaning = 0;
+	return moved;
+}
+
+//the cleaner's share of a commit: a few blocks, and only when clean segments run low
+void clean_segments_when_low(FILE* fp)
+{
+	if (log_state.cleaning || !log_state.cleaner_budget) return;
+	int budget = log_state.cleaner_budget<0 ? CLEANER_BLOCKS_PER_COMMIT : log_state.cleaner_budget;
+	if (count_clean_segments(fp)<CLEANER_LOW_SEGMENTS) clean_segments(fp,budget);
+}
+
+//returns 0, or -1 if the vdisk is not mounted log-structured. the budget goes back to CLEANER_BLOCKS_PER_COMMIT
+//when the vdisk is mounted again
+int set_cleaner_budget(FILE* fp, int budget)
+{
+	if (!is_log_structured(fp) || budget<0)
+	{
+		printf("set_cleaner_budget: the vdisk is not mounted log-structured, or the budget is negative\n");
+		return -1;
+	}
+	log_state.cleaner_budget = budget;
+	return 0;
+}
+
+//////////////////////////// BLOCK DATA MANIPULATION
+
+void read_block_value(FILE*  fp, int block_num, char* buffer, int byte_offset, size_t length_of_value)
+{
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp, block_num, block_buffer);
+//	printf("read_block :%s\n", (char*)block_buffer);
+	//not check within that buffer to get the values we wanted
+	int index;
+	for(index=0; index<length_of_value;index++)
+	{
+		buffer[index] = block_buffer[index+byte_offset];
 		
+	}
+	
+	free(block_buffer);
+	return;
+}
+unsigned short get_inode_address(FILE* fp, unsigned char directory_inode_id){
+
+	unsigned short address;
+	read_block_value(fp, 2,(char*)&address,directory_inode_id*2,2);
+	return address;
+}
+
+//the size is split into a low word at byte 0 (the original 4 byte field) and a high word at byte 36
+//returns 'f' or 'd'
+char get_inode_type(FILE* fp, unsigned char inode_id)
+{
+	char* inode_block = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_inode_address(fp,inode_id),inode_block);
+	char file_type = (char)((int*)inode_block)[1];
+	free(inode_block);
+	return file_type;
+}
+
+unsigned long long get_inode_size(unsigned short* inode_buffer)
+{
+	unsigned int* words = (unsigned int*)inode_buffer;
+	return ((unsigned long long)words[INODE_SIZE_HIGH_OFFSET/4]<<32) | words[INODE_SIZE_OFFSET/4];
+}
+
+void set_inode_size(unsigned short* inode_buffer, unsigned long long size)
+{
+	unsigned int* words = (unsigned int*)inode_buffer;
+	words[INODE_SIZE_OFFSET/4] = (unsigned int)size;
+	words[INODE_SIZE_HIGH_OFFSET/4] = (unsigned int)(size>>32);
+}
+////////////////////////////PRIVATE FILE SYSTEM FUNCTIONS
+//note type=1 when the inode is a directory file, 2 when anything other type of file
+//block_type_needed can be either 'i' for index or 'd' for data. This will determine where in the free block vector to begin searching
+unsigned short check_fbv_for_available_block(FILE* fp)
+{
+	
 		
-		else
+	char* free_block_vector = (char*) malloc(BITS_PER_BLOCK);
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,free_block_vector);
+	if (is_log_structured(fp))
+	{
+		unsigned short log_block = next_log_block(fp,(unsigned char*)free_block_vector);
+		free(free_block_vector);
+		if (!log_block) printf("no blocks are free!\n");
+		return log_block;
+	}
+	unsigned int tester = 1;
+	unsigned short i;
+	unsigned short byte_pos= 2;
+	for(byte_pos; byte_pos<BYTES_PER_BLOCK; byte_pos++)
+	{
+		for( i =0; i< 8;i++)
 		{
-//			printf("create_file_in_directory: there are %d blocks left to write\n",num_blocks_remaining_to_write);
-			read_block(fp, inode_buffer[4+i],(char*)temp_data_block_buffer);
-//			printf("create_file_in_directory: one block left to write\n");
-			write_block(outfile,i,temp_data_block_buffer, BYTES_PER_BLOCK);
+			//printf("%u\n",tester);
 			
-		}	
-		
-		num_blocks_remaining_to_write--;
-		if (num_blocks_remaining_to_write == 0)
-		{
-//			printf("create_file_in_directory: adding the element to the parent directory\n");
+			if (tester & free_block_vector[byte_pos])
+			{
+//	printf("check_fbv_for_available_block: found an available block to write in at bit %u in byte %u \n",i, byte_pos);
+				free(free_block_vector);
+				return(byte_pos*8 + i);
 			
-			return outfile;
-			//there are no more blocks to write out and we can finish up the function
+			}
+			tester=tester<<1;
 		}
+		tester = 1;
 	}
+
 	
-	//if execution has made it this far, then there are blocks to be written which have not been written out yet
-	if (num_blocks_remaining_to_write!=0)
-		
-		
-		num_blocks_remaining_to_write = read_from_single_indirection_block(fp,inode_buffer[14],num_blocks_remaining_to_write,size,outfile);
+	printf("no blocks are free!\n");
+	free(free_block_vector);
+	return 0;
+}
+
+void set_fbv_bit(FILE* fp, unsigned short block_number)
+{
+	char* vector = malloc(BITS_PER_BLOCK); 
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector);
+	int byte_num = block_number / 8;
+	int bit_pos = block_number%8;
+	char target = 1;
+	int i;
+	for (i=0;i<bit_pos;i++)
+	{
+		target = target<<1;
 		
+	}
+
+	vector[byte_num] = vector[byte_num]|target;
+	write_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector,BYTES_PER_BLOCK);
+	return;
 	
-	int k;
-	if (num_blocks_remaining_to_write!=0)
+}
+
+//void  reset_fbv_bit
+void reset_fbv_bit(FILE* fp, unsigned int block_number)
+{
+	char* vector = malloc(BYTES_PER_BLOCK); 
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector);
+	int byte_num = block_number / 8;
+	int bit_pos = block_number%8;
+	char target = 1;
+	int i;
+	for (i=0;i<bit_pos;i++)
 	{
-		int i=1;
+		target = target<<1;
+		
 	}
-//	fputc('\n',outfile);
-	return outfile;
-	//update the single indirection pointer in the inode
+	vector[byte_num] = vector[byte_num]^target;
+//	printf("reset_fbv_bit: reset bit in position %d, in block number %d\n", (int)i,(int)block_number);
+	write_block(fp,FREE_BLOCK_VECTOR_OFFSET,vector,BYTES_PER_BLOCK);
+	free(vector);
+	return;
 	
+}
+unsigned char find_next_free_inode_id(FILE* fp){
 	
+	unsigned short* inode_map = (unsigned short*) malloc(BYTES_PER_BLOCK);
+	read_block(fp, INODE_MAP_OFFSET,(char*)inode_map);
+	int i ;
+	for ( i=0; i< INODE_MAX_NUM-1; i++)
+	{// checking through the inode map block to determine which has a free address we can use
+		if (inode_map[i]==0)
+		{
+//			printf("find_next_free_inode_id: found an empty inode space in inode id %d\n",(unsigned short)i);
+			free(inode_map);
+			return (unsigned char)i;
+			
+		}
+		
+	}
+	fprintf(stderr,"no available inodes left");
+	exit(1);
+	return -1;
 }
 
-FILE* download_file(FILE* fp, char* target_filename, char* new_filename)
+
+// TWO FILE TYPES: "f" and "d" for file and directory file, respectively
+unsigned short create_empty_inode(FILE* fp, int inode_number, int size, int type)
 {
 	
-	unsigned char inode_id = find_file_inode_id(fp,target_filename);
-	FILE* fpout =download_file_from_inode_id(fp,inode_id,new_filename);
-	fclose(fpout);
+	void* inode_block = malloc(INODE_BYTES);
+	memset(inode_block,0,INODE_BYTES);
+	((unsigned int*)inode_block)[0] = (unsigned int)size;
+	((unsigned int*)inode_block)[1] = (unsigned int)type;
+	((char*)inode_block)[32] = inode_number;
+//	printf("Create_empty_inode: looking for empty block for inode id %d\n",(int)inode_number);
+	unsigned short available_block = check_fbv_for_available_block(fp);
+	write_block(fp, available_block, inode_block,INODE_BYTES);
+//	printf("Create_empty_inode: writing  inode block to  location  %d\n", (short)available_block);
 	
+	reset_fbv_bit(fp,available_block);
+	free(inode_block);
+	//returns the absolute block address where the empty inode was created
+	return available_block;
+}
+//claims a free block, writes zeros to it, and returns its address, or 0 if the vdisk is full
+unsigned short allocate_empty_block(FILE* fp)
+{
+	unsigned short available_block_address = check_fbv_for_available_block(fp);
+	if (!available_block_address) return 0;
+	unsigned char* block_buffer = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	memset(block_buffer,0,BYTES_PER_BLOCK);
+	write_block(fp, available_block_address, block_buffer,BYTES_PER_BLOCK);
+	reset_fbv_bit(fp, available_block_address);
+	free(block_buffer);
+	return available_block_address;
 }
 
-//will return the free block number to which this directory was written to
-unsigned short create_directory_block(FILE* fp, unsigned char parent_inode_id, unsigned char inode_id){
-	unsigned short data_block_num = check_fbv_for_available_block(fp);
-	
-	//16 entries * 32 bytes each
-	//1st byte is the inode id
-	char* this_directory_name = ".";
-	char* parent_directory_name = "..";
-	
-	char* directory_block = (char*)malloc(BYTES_PER_BLOCK);
-	memset(directory_block,0,BYTES_PER_BLOCK);
-	directory_block[32] = (char)parent_inode_id;
-	
-	memcpy((directory_block+1),this_directory_name,1);
-	memcpy((directory_block+33),parent_directory_name,2);
+void delete_filepath(FILE* fp, char* filename)
+{	
+	/**PSEUDO
+	 * use filepath to find inode id for the file specified
+	 * look at inode block & check if it is file or directory
+	 * if file: delete_file
+	 * if dir: delete_directory 
+	 * remove entry from directory filelist where it is found
+	 * 
+	 * 
+	 */
 	
-	directory_block[0]=(char)inode_id;
 	
-	write_block(fp, data_block_num, (char *)directory_block, DIRECTORY_BYTES);
-	free(directory_block);
-	//reset_fbv_bit(fp, data_block_num);
 	
-//	printf("create_directory_block: creating directory data block  in %u\n",data_block_num);
+	//one walk finds the file, the directory holding it and its name there
+	unsigned char parent_inode_id;
+	char name[31];
+	unsigned char file_inode_id = resolve_path(fp,filename,&parent_inode_id,name);
+	if (file_inode_id==INODE_NOT_FOUND)
+	{
+		printf("delete_filepath: %s was not found\n",filename);
+		return;
+	}
+	if (file_inode_id==0)
+	{
+		printf("delete_filepath: the root directory cannot be deleted\n");
+		return;
+	}
+	delete_element_from_directory(fp,parent_inode_id,name,file_inode_id);
+	return;
+}
+
+//deletes the file or empty directory file_inode_id, which is named name in the directory parent_inode_id.
+//returns 0 once both the file and its entry are gone, -1 if nothing was deleted
+int delete_element_from_directory(FILE* fp, unsigned char parent_inode_id, char* name, unsigned char file_inode_id)
+{
+	begin_metadata_batch(fp);
+	int result = delete_element_with_entry(fp,parent_inode_id,name,file_inode_id);
+	commit_metadata_batch(fp);
+	return result;
+}
+
+int delete_element_with_entry(FILE* fp, unsigned char parent_inode_id, char* name, unsigned char file_inode_id)
+{
+	unsigned short file_block_address = get_inode_address(fp, file_inode_id);
+	char* file_inode_block = (char*)malloc(BYTES_PER_BLOCK);
 	
-	/*
-	((unsigned char*)directory_block)[DIRECTORY_INODE_OFFSET]=(unsigned char)id;
-	strncpy(((char**)directory_block)[DIRECTORY_ENTRY_OFFSET], this_directory_name, 1);
-	((unsigned char*)directory_block)[DIRECTORY_ELEMENT_SIZE+DIRECTORY_INODE_OFFSET] = (unsigned char)parent_id;
+	//check filetype
+	read_block(fp,file_block_address,file_inode_block);
+	int file_type = ((int*)file_inode_block)[1];
+	free(file_inode_block);
 	
-	strncpy(((char**)directory_block)[DIRECTORY_ENTRY_OFFSET+DIRECTORY_ELEMENT_SIZE], parent_directory_name, 2);
-	write_block(fp, block_num,directory_block,BYTES_PER_BLOCK);
-	*/
-	return data_block_num;
+	if ((char)file_type=='d')
+	{
+		//a directory which still has entries is left in place, listing and all
+		if (delete_directory(fp, file_inode_id)) return -1;
+		
+		}
+	else if((char)file_type=='f')
+	{
+		delete_file(fp,file_inode_id);
+		}
+	else
+	{
+		
+		printf("inode corrupted! incorrect inode filetype specifier\n");
+		return -1;}
+	//now deleting the filename from the directory it is a part of 
+	delete_directory_entry(fp,parent_inode_id,name);
+	return 0;
+}
+//returns 0 once the directory is deleted, -1 if it still has entries
+int delete_directory(FILE* fp, unsigned char directory_inode_id)
+{
+	/*PSEUDO
+	 * check if directory is empty ie: every slot after "." and ".." in every block is empty
+	 * if not: print error message and return
+	 * else:
+	 * the directory's blocks are freed exactly like a file's: every data block and indirection block
+	 * is cleared and its fbv bit set, the inode map entry is cleared and the inode block freed
+	 * */
+	if (!directory_is_empty(fp,directory_inode_id))
+	{
+		printf("delete_directory: directory of inode id %d not empty, therefore cannot delete directory\n",(int)directory_inode_id);
+		return -1;
+	}
+	drop_name_filter(fp,directory_inode_id);
+	retire_directory_handles(fp,directory_inode_id);
+	delete_file(fp,directory_inode_id);
+	return 0;
+}
+void delete_file(FILE* fp, unsigned char file_inode_id)
+{
+	/*PSEUDO
+	 *for each direct pointer:
+	 * 	clear the block in the address of the pointer
+	 * 	set the fbv bit for the block
+	 *if single_ind pointer != 00
+	 * 	clear single_ind_block in the address stored
+	 *  set the fbv bit for that address to be free/1\clear data in the single ind block
+	 *if double_ind_pointer !==0:
+	 * load the double indirection block	
+	 * for each pointer!=00:
+	 * 		clear single ind block for each pointer
+	 * 		set the fbv bit for that single ind block
+	 * clear the dbl ind block
+	 * set the fbv bit for double ind block =0
+	 *
+	 * 
+	 *
+	 *set inode fbv bit to 1/free
+	 *set the inode_map[id] = 00
+	 *clear the file's inode block
+	 */
+	 char* empty_block_buffer = malloc(BYTES_PER_BLOCK);
+	 memset(empty_block_buffer,0,BYTES_PER_BLOCK);
+	 unsigned short file_inode_block_address = get_inode_address(fp,file_inode_id);
+	 invalidate_block_map_cache(fp,file_inode_id);
+	 //every block freed below clears a bit of the free block vector, which is written once at the commit
+	 begin_metadata_batch(fp);
+//	 printf("file inode block adddress = %d\n",file_inode_block_address);
+	 unsigned short* file_inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	 read_block(fp,file_inode_block_address,(char*)file_inode_buffer);
+	 //now we need to start clearing the blocks in the direct pointers
+	 int i;
+	 for(i=4;i<14;i++)
+	 {//each one of these is a direct pointer to potentiall an occupied space in memory
+//		printf("checking the %d direct pointer spot in the inode id = %d\n",i-4,file_inode_id);
+		
+		if (!file_inode_buffer[i])
+		 {//no remaining blocks to wipe
+//			printf("no remainging to wipe\n");
+			 break;	 
+		}
+		 if (!release_data_block(fp,file_inode_buffer[i])) continue;
+		 wipe_block(fp,file_inode_buffer[i],empty_block_buffer);
+		 set_fbv_bit(fp,file_inode_buffer[i]);
+		 
+		 
+	  }
+	
+	
+	int depth;
+	for (depth=1;depth<=MAX_INDIRECTION_DEPTH;depth++)
+	{//then there is an indirection block we need to clear!
+		unsigned short indirection_block_address = file_inode_buffer[INODE_INDIRECTION_OFFSETS[depth-1]/2];
+		if (!indirection_block_address) continue;
+		clear_indirection_block(fp,depth,indirection_block_address);
+		set_fbv_bit(fp,indirection_block_address);
+		write_block(fp,indirection_block_address,(char*)empty_block_buffer,BYTES_PER_BLOCK);
+	}
+	
+	
+//	printf("now setting the inode_map[%d] to be 0",file_inode_id);
+	unsigned short* inode_map=malloc(BYTES_PER_BLOCK);
+	memset(inode_map,0,BYTES_PER_BLOCK);
+	read_block(fp,2,(char*)inode_map);
+	//memset(((char*)inode_map)+file_inode_id,0,2);
+	inode_map[file_inode_id]=0;
+	
+	write_block(fp,2,inode_map,BYTES_PER_BLOCK);
+	free(inode_map);
+	
+	write_block(fp,file_inode_block_address,empty_block_buffer,BYTES_PER_BLOCK);
+	free(empty_block_buffer);
+	set_fbv_bit(fp, file_inode_block_address);
+	commit_metadata_batch(fp);
+	return;
+	
+}
+//zeros a freed data block straight on the disk. data is not journaled, so a batch would only hold it up
+void wipe_block(FILE* fp, unsigned short block_address, char* empty_block_buffer)
+{
+	drop_batched_block(fp,block_address);
+	retire_journal_block(fp,block_address);
+	write_block_run(fp,block_address,empty_block_buffer,1);
+}
+
+void clear_single_indirection_block(FILE* fp, unsigned short indirection_block_address)
+{	
+	unsigned char* empty_block_buffer = malloc(BYTES_PER_BLOCK);
+	memset(empty_block_buffer,0,BYTES_PER_BLOCK);
+//	printf("clearing indirection block\n");
+	unsigned short* indirection_block_buffer = malloc(BYTES_PER_BLOCK);
+	unsigned short i;
+	read_block(fp,indirection_block_address,(char*)indirection_block_buffer);
+	for(i=0;i<256;i++)
+	{//for each pointer in the single indirection block
+		if(indirection_block_buffer[i] && release_data_block(fp,indirection_block_buffer[i]))
+		{
+//		printf("clear_single_indirection_block: clearing the data block %d  ",i);
+		wipe_block(fp,indirection_block_buffer[i],(char*)empty_block_buffer);
+		set_fbv_bit(fp,indirection_block_buffer[i]);
+		}
+	}
+	
+	free(indirection_block_buffer);
+	free(empty_block_buffer);
+	return;
+}
+
+//clears everything below an indirection block of the given depth. the indirection block itself is left to the caller
+void clear_indirection_block(FILE* fp, int depth, unsigned short indirection_block_address)
+{
+	if (depth==1)
+	{
+		clear_single_indirection_block(fp,indirection_block_address);
+		return;
+	}
+	unsigned char* empty_block_buffer = malloc(BYTES_PER_BLOCK);
+	memset(empty_block_buffer,0,BYTES_PER_BLOCK);
+	unsigned short* indirection_block_buffer = malloc(BYTES_PER_BLOCK);
+	read_block(fp,indirection_block_address,(char*)indirection_block_buffer);
+	int i;
+	for (i=0;i<POINTERS_PER_BLOCK;i++)
+	{
+		if (!indirection_block_buffer[i]) continue;
+		clear_indirection_block(fp,depth-1,indirection_block_buffer[i]);
+		write_block(fp,indirection_block_buffer[i],empty_block_buffer,BYTES_PER_BLOCK);
+		set_fbv_bit(fp,indirection_block_buffer[i]);
+	}
+	free(indirection_block_buffer);
+	free(empty_block_buffer);
+}
+
+//RETURNS the inode id which belongs to this new files inode 
+
+
+//////////////UPLOAD PIPELINE
+/*
+ * Every upload goes through a file_writer, which takes the file's data in pieces of any length: chunks of
+ * UPLOAD_CHUNK_BYTES read from a host file or a stream, or the caller's own buffers. For each piece, the writer
+ * plans the whole mapping before any data moves. It claims the piece's blocks with one read and one write of the
+ * free block vector, writes each run of consecutive block addresses with one fwrite straight from the piece, and
+ * then maps the blocks with map_file_blocks(), which touches the inode and each pointer block once per piece.
+ * Only a block which straddles two pieces, and the partial last block, pass through the writer's one block
+ * buffer. Pointer blocks, the inode and the free block vector are kept in the writer's metadata batch.
+ */
+const size_t UPLOAD_CHUNK_BYTES = 1<<20;
+
+struct file_writer
+{
+	FILE* fp;
+	unsigned char inode_id;
+	unsigned short inode_address;
+	unsigned long long block_count; //logical blocks mapped so far
+	unsigned long long size;
+	int full; //set once the vdisk has run out of blocks
+	char* tail_block; //a block which is not full yet
+	size_t tail_length;
+	pthread_mutex_t* vdisk_lock; //when set, held by the writer's thread except while it writes data blocks
+	char* extent; //for a compressed file, the blocks of the extent being collected, otherwise NULL
+	unsigned int extent_blocks;
+	char* packed;
+};
+
+//claims up to count free blocks in address order with one pass over the free block vector. returns how many it
+//found, which is less than count only when the vdisk is full
+unsigned int claim_free_blocks(FILE* fp, unsigned int count, unsigned short* block_addresses)
+{
+	unsigned char* free_block_vector = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,(char*)free_block_vector);
+	unsigned int claimed = 0;
+	unsigned int block_num;
+	while (is_log_structured(fp) && claimed<count && (block_num = next_log_block(fp,free_block_vector)))
+	{
+		free_block_vector[block_num/8] ^= 1<<(block_num%8);
+		block_addresses[claimed++] = block_num;
+	}
+	for (block_num=DATA_SECTION_OFFSET;!is_log_structured(fp) && block_num<=MAX_BLOCK_INDEX && claimed<count;block_num++)
+	{
+		unsigned char bit = 1<<(block_num%8);
+		if (!(free_block_vector[block_num/8]&bit)) continue;
+		free_block_vector[block_num/8] ^= bit;
+		block_addresses[claimed++] = block_num;
+	}
+	if (claimed) write_block(fp,FREE_BLOCK_VECTOR_OFFSET,free_block_vector,BYTES_PER_BLOCK);
+	free(free_block_vector);
+	return claimed;
+}
+
+//claims addresses for count blocks of data as claim_free_blocks() does. on a vdisk which deduplicates, a block whose
+//bytes are on the disk already, or are an earlier block of data, takes a reference to that copy instead, and shared
+//is set for it. each new block is indexed as soon as it is claimed, and until the caller writes data out, matches
+//against it are checked against data rather than the disk
+unsigned int claim_data_blocks(FILE* fp, const char* data, unsigned int count, unsigned short* block_addresses, char* shared)
+{
+	memset(shared,0,count);
+	if (!get_dedup_inode(fp)) return claim_free_blocks(fp,count,block_addresses);
+	unsigned int i;
+	for (i=0;i<count;i++)
+	{
+		const char* block = data+(size_t)i*BYTES_PER_BLOCK;
+		if ((block_addresses[i] = share_duplicate_block(fp,block,block_addresses,data,i)))
+		{
+			shared[i] = 1;
+			continue;
+		}
+		if (!claim_free_blocks(fp,1,&block_addresses[i])) return i;
+		index_data_block(fp,block_addresses[i],block);
+	}
+	return count;
+}
+
+//writes block_count consecutive blocks starting at first_block_num from data, with one seek and one write
+void write_block_run(FILE* fp, unsigned short first_block_num, const char* data, unsigned int block_count)
+{
+	fseek(fp,(off_t)first_block_num*BYTES_PER_BLOCK,SEEK_SET);
+	fwrite(data,BYTES_PER_BLOCK,block_count,fp);
+}
+
+//the same with pwrite on the vdisk's descriptor, which other threads may use meanwhile for other blocks
+void write_block_run_unlocked(FILE* fp, unsigned short first_block_num, const char* data, unsigned int block_count)
+{
+	size_t length = (size_t)block_count*BYTES_PER_BLOCK;
+	off_t offset = (off_t)first_block_num*BYTES_PER_BLOCK;
+	while (length)
+	{
+		ssize_t bytes_written = pwrite(fileno(fp),data,length,offset);
+		if (bytes_written<0 && errno==EINTR) continue;
+		if (bytes_written<=0)
+		{
+			printf("write_block_run_unlocked: could not write block %u\n",(unsigned int)(offset/BYTES_PER_BLOCK));
+			return;
+		}
+		data += bytes_written;
+		offset += bytes_written;
+		length -= bytes_written;
+	}
+}
+
+//takes the lock on a vdisk shared between threads. the stdio buffer is dropped, as it may hold blocks which
+//another thread has since written through the descriptor
+void lock_vdisk(FILE* fp, pthread_mutex_t* vdisk_lock)
+{
+	pthread_mutex_lock(vdisk_lock);
+	fflush(fp);
+}
+
+//releases it, with every write made under it on the disk first
+void unlock_vdisk(FILE* fp, pthread_mutex_t* vdisk_lock)
+{
+	fflush(fp);
+	pthread_mutex_unlock(vdisk_lock);
+}
+
+//opens a metadata batch and creates an empty file inode which is not in any directory yet
+void begin_file_writer(struct file_writer* writer, FILE* fp)
+{
+	begin_metadata_batch(fp);
+	writer->fp = fp;
+	writer->inode_id = find_next_free_inode_id(fp);
+	writer->inode_address = create_empty_inode(fp,writer->inode_id,0,'f');
+	assign_location_to_inode_map(fp,writer->inode_address,writer->inode_id);
+	writer->block_count = 0;
+	writer->size = 0;
+	writer->full = 0;
+	writer->tail_block = (char*)malloc(BYTES_PER_BLOCK);
+	writer->tail_length = 0;
+	writer->vdisk_lock = NULL;
+	writer->extent = NULL;
+	writer->extent_blocks = 0;
+	if (get_vdisk_compression(fp))
+	{
+		set_file_format(fp,writer->inode_id,writer->inode_address,FILE_FORMAT_COMPRESSED);
+		writer->extent = (char*)malloc(COMPRESSION_EXTENT_BLOCKS*BYTES_PER_BLOCK);
+		writer->packed = (char*)malloc(COMPRESSION_EXTENT_BLOCKS*BYTES_PER_BLOCK);
+	}
+}
+
+//compresses and stores the extent collected so far
+void write_writer_extent(struct file_writer* writer)
+{
+	if (!writer->extent_blocks) return;
+	//the extent is the writer's own, so other threads may go on with the vdisk while it is compressed
+	if (writer->vdisk_lock) unlock_vdisk(writer->fp,writer->vdisk_lock);
+	unsigned int stored_blocks = pack_extent(writer->extent,writer->extent_blocks,writer->packed);
+	if (writer->vdisk_lock) lock_vdisk(writer->fp,writer->vdisk_lock);
+	const char* source = stored_blocks<writer->extent_blocks ? writer->packed : writer->extent;
+	if (store_extent(writer->fp,writer->inode_id,writer->block_count,source,stored_blocks,0)) writer->full = 1;
+	else writer->block_count += writer->extent_blocks;
+	writer->extent_blocks = 0;
+}
+
+//write_whole_blocks() for a compressed file, which collects the blocks into extents and writes each once it is whole
+unsigned int collect_extent_blocks(struct file_writer* writer, const char* data, unsigned int block_count)
+{
+	unsigned int collected = 0;
+	while (collected<block_count && !writer->full)
+	{
+		unsigned int copy_blocks = COMPRESSION_EXTENT_BLOCKS-writer->extent_blocks;
+		if (copy_blocks>block_count-collected) copy_blocks = block_count-collected;
+		memcpy(writer->extent+writer->extent_blocks*BYTES_PER_BLOCK,data+collected*BYTES_PER_BLOCK,copy_blocks*BYTES_PER_BLOCK);
+		writer->extent_blocks += copy_blocks;
+		collected += copy_blocks;
+		if (writer->extent_blocks==COMPRESSION_EXTENT_BLOCKS) write_writer_extent(writer);
+	}
+	return collected;
+}
+
+//appends block_count whole blocks from data to the file. returns how many were written
+unsigned int write_whole_blocks(struct file_writer* writer, const char* data, unsigned int block_count)
+{
+	if (writer->full || !block_count) return 0;
+	if (writer->extent) return collect_extent_blocks(writer,data,block_count);
+	//the pointer blocks come first, so the data blocks claimed below can always be mapped
+	unsigned int mappable = reserve_file_pointer_blocks(writer->fp,writer->inode_id,writer->block_count,block_count);
+	unsigned short* block_addresses = (unsigned short*)malloc(block_count*sizeof(unsigned short));
+	char* shared = (char*)malloc(block_count);
+	unsigned int claimed = claim_data_blocks(writer->fp,data,mappable,block_addresses,shared);
+	if (claimed<block_count) writer->full = 1;
+	unsigned int run_start = 0;
+	unsigned int i;
+	//a batched copy of one of these blocks would overwrite the new data when the batch is flushed
+	for (i=0;i<claimed;i++)
+	{
+		if (shared[i]) continue;
+		drop_batched_block(writer->fp,block_addresses[i]);
+		retire_journal_block(writer->fp,block_addresses[i]);
+	}
+	if (writer->vdisk_lock)
+	{
+		//the blocks are ours alone now, so other threads may go on with the vdisk while they are written
+		unlock_vdisk(writer->fp,writer->vdisk_lock);
+	}
+	//a shared block is already on the disk, and is a run of its own which is not written
+	for (i=1;i<=claimed;i++)
+	{
+		if (i<claimed && !shared[i] && !shared[i-1] && block_addresses[i]==block_addresses[i-1]+1) continue;
+		if (shared[run_start]);
+		else if (writer->vdisk_lock) write_block_run_unlocked(writer->fp,block_addresses[run_start],data+run_start*BYTES_PER_BLOCK,i-run_start);
+		else write_block_run(writer->fp,block_addresses[run_start],data+run_start*BYTES_PER_BLOCK,i-run_start);
+		run_start = i;
+	}
+	if (writer->vdisk_lock) lock_vdisk(writer->fp,writer->vdisk_lock);
+	map_file_blocks(writer->fp,writer->inode_id,writer->block_count,block_addresses,claimed);
+	writer->block_count += claimed;
+	free(shared);
+	free(block_addresses);
+	return claimed;
+}
+
+void write_to_file_writer(struct file_writer* writer, const char* data, size_t length)
+{
+	if (writer->tail_length)
+	{
+		size_t copy_length = BYTES_PER_BLOCK-writer->tail_length;
+		if (copy_length>length) copy_length = length;
+		memcpy(writer->tail_block+writer->tail_length,data,copy_length);
+		writer->tail_length += copy_length;
+		data += copy_length;
+		length -= copy_length;
+		if (writer->tail_length<BYTES_PER_BLOCK) return;
+		writer->size += write_whole_blocks(writer,writer->tail_block,1)*BYTES_PER_BLOCK;
+		writer->tail_length = 0;
+	}
+	//whole blocks at a time, so the claimed address list stays within one free block vector's worth
+	while (length>=BYTES_PER_BLOCK && !writer->full)
+	{
+		size_t block_count = length/BYTES_PER_BLOCK;
+		if (block_count>BITS_PER_BLOCK) block_count = BITS_PER_BLOCK;
+		unsigned int written = write_whole_blocks(writer,data,block_count);
+		writer->size += (unsigned long long)written*BYTES_PER_BLOCK;
+		data += block_count*BYTES_PER_BLOCK;
+		length -= block_count*BYTES_PER_BLOCK;
+	}
+	if (length<BYTES_PER_BLOCK && !writer->full)
+	{
+		memcpy(writer->tail_block,data,length);
+		writer->tail_length = length;
+	}
+}
+
+//checked before a writer claims anything, since a name that cannot go in a directory would leave the file unlinked
+int file_name_fits(char* file_name, char* caller)
+{
+	if (strlen(file_name)<=DIRECTORY_NAME_MAX) return 1;
+	printf("%s: file name %s is longer than %d characters\n",caller,file_name,(int)DIRECTORY_NAME_MAX);
+	return 0;
+}
+
+//writes the partial last block and the size, then adds the file to its directory and commits the batch. returns
+//the new inode id, or INODE_NOT_FOUND if the directory could not take the file, which is then deleted again
+unsigned char finish_file_writer(struct file_writer* writer, unsigned char parent_inode_id, char* file_name)
+{
+	FILE* fp = writer->fp;
+	if (writer->tail_length)
+	{
+		memset(writer->tail_block+writer->tail_length,0,BYTES_PER_BLOCK-writer->tail_length);
+		if (write_whole_blocks(writer,writer->tail_block,1)) writer->size += writer->tail_length;
+	}
+	if (writer->extent)
+	{
+		write_writer_extent(writer);
+		free(writer->extent);
+		free(writer->packed);
+	}
+	//blocks collected for an extent which could not be stored were counted, but are not in the file
+	if (writer->size>writer->block_count*BYTES_PER_BLOCK) writer->size = writer->block_count*BYTES_PER_BLOCK;
+	if (writer->full) printf("finish_file_writer: the vdisk is full, %s was cut short at %llu bytes\n",file_name,writer->size);
+	free(writer->tail_block);
+	
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,writer->inode_address,(char*)inode_buffer);
+	set_inode_size(inode_buffer,writer->size);
+	write_block(fp,writer->inode_address,inode_buffer,INODE_BYTES);
+	free(inode_buffer);
+	invalidate_block_map_cache(fp,writer->inode_id);
+	if (add_element_to_directory(fp,parent_inode_id,writer->inode_id,file_name))
+	{
+		printf("finish_file_writer: %s could not be added to its directory\n",file_name);
+		delete_file(fp,writer->inode_id);
+		commit_metadata_batch(fp);
+		return INODE_NOT_FOUND;
+	}
+	commit_metadata_batch(fp);
+	return writer->inode_id;
+}
+
+unsigned char upload_file(FILE* fp, char* path_to_parent_dir, char* file_name, FILE* fpin)
+{
+	fseek(fp,0,SEEK_SET);
+	unsigned char parent_inode_id = find_directory_inode_id(fp,path_to_parent_dir,"upload_file");
+	if (parent_inode_id==INODE_NOT_FOUND) return INODE_NOT_FOUND;
+	return create_file_in_directory(fp,parent_inode_id,file_name,fpin);
+}
+
+unsigned char create_file_in_directory(FILE* fp, unsigned char parent_inode_id, char* file_name, FILE* fpin)
+{
+	if (!file_name_fits(file_name,"create_file_in_directory")) return INODE_NOT_FOUND;
+	fseek(fpin,0,SEEK_SET);
+	struct file_writer writer;
+	begin_file_writer(&writer,fp);
+	char* chunk = (char*)malloc(UPLOAD_CHUNK_BYTES);
+	size_t chunk_length;
+	while ((chunk_length = fread(chunk,1,UPLOAD_CHUNK_BYTES,fpin))) write_to_file_writer(&writer,chunk,chunk_length);
+	free(chunk);
+	return finish_file_writer(&writer,parent_inode_id,file_name);
+}
+//////////////STREAMING UPLOADS
+/*
+ * Uploads from sources whose length is not known in advance, such as a pipe or a read callback, so nothing has to
+ * seek. The source is read a chunk at a time into the file writer, which claims blocks as the data arrives, and
+ * the size is written into the inode once the source runs dry.
+ */
+
+//reads until length bytes are in buffer or the source runs dry. returns the number of bytes read
+size_t fill_chunk_from_source(upload_read_function read_function, void* context, char* buffer, size_t length)
+{
+	size_t filled = 0;
+	while (filled<length)
+	{
+		size_t bytes_read = read_function(context,buffer+filled,length-filled);
+		if (!bytes_read) break;
+		filled += bytes_read;
+	}
+	return filled;
+}
+
+unsigned char create_file_from_source(FILE* fp, unsigned char parent_inode_id, char* file_name, upload_read_function read_function, void* context)
+{
+	if (!file_name_fits(file_name,"upload_stream")) return INODE_NOT_FOUND;
+	struct file_writer writer;
+	begin_file_writer(&writer,fp);
+	char* chunk = (char*)malloc(UPLOAD_CHUNK_BYTES);
+	size_t chunk_length;
+	while ((chunk_length = fill_chunk_from_source(read_function,context,chunk,UPLOAD_CHUNK_BYTES)))
+	{
+		write_to_file_writer(&writer,chunk,chunk_length);
+		if (chunk_length<UPLOAD_CHUNK_BYTES || writer.full) break;
+	}
+	free(chunk);
+	return finish_file_writer(&writer,parent_inode_id,file_name);
+}
+
+//uploads everything read_function returns until it returns 0, as a file named file_name in path_to_parent_dir
+unsigned char upload_stream(FILE* fp, char* path_to_parent_dir, char* file_name, upload_read_function read_function, void* context)
+{
+	unsigned char parent_inode_id = find_directory_inode_id(fp,path_to_parent_dir,"upload_stream");
+	if (parent_inode_id==INODE_NOT_FOUND) return INODE_NOT_FOUND;
+	return create_file_from_source(fp,parent_inode_id,file_name,read_function,context);
+}
+
+size_t read_from_fd(void* context, char* buffer, size_t length)
+{
+	int fd = *(int*)context;
+	ssize_t bytes_read;
+	do bytes_read = read(fd,buffer,length);
+	while (bytes_read<0 && errno==EINTR);
+	return bytes_read>0 ? (size_t)bytes_read : 0;
+}
+
+//uploads everything that can be read from fd, which may be a pipe or socket, until end of file
+unsigned char upload_fd(FILE* fp, char* path_to_parent_dir, char* file_name, int fd)
+{
+	return upload_stream(fp,path_to_parent_dir,file_name,read_from_fd,&fd);
+}
+//////////////BUFFER UPLOADS
+/*
+ * Uploads straight from the caller's memory, one buffer or an iovec array, without a temporary file. Each buffer
+ * goes to the file writer as one piece, so its whole blocks are written from the caller's memory and never copied.
+ */
+
+//uploads the iovcnt buffers in iov, one after another, as a file named file_name in path_to_parent_dir
+unsigned char upload_iovec(FILE* fp, char* path_to_parent_dir, char* file_name, const struct iovec* iov, int iovcnt)
+{
+	unsigned char parent_inode_id = find_directory_inode_id(fp,path_to_parent_dir,"upload_iovec");
+	if (parent_inode_id==INODE_NOT_FOUND) return INODE_NOT_FOUND;
+	if (!file_name_fits(file_name,"upload_iovec")) return INODE_NOT_FOUND;
+	struct file_writer writer;
+	begin_file_writer(&writer,fp);
+	int i;
+	for (i=0;i<iovcnt;i++) write_to_file_writer(&writer,(const char*)iov[i].iov_base,iov[i].iov_len);
+	return finish_file_writer(&writer,parent_inode_id,file_name);
+}
+
+unsigned char upload_buffer(FILE* fp, char* path_to_parent_dir, char* file_name, const void* data, size_t length)
+{
+	struct iovec buffer = {(void*)data,length};
+	return upload_iovec(fp,path_to_parent_dir,file_name,&buffer,1);
+}
+//////////////BULK UPLOADS
+/*
+ * Uploads many host files at once on a pool of worker threads. Everything which touches the vdisk's metadata, the
+ * free block vector, the inode map, inodes, directories and the caches in this file, runs under one vdisk lock.
+ * A worker holds it only briefly: it reads each chunk of its host file without the lock, and it writes the chunk's
+ * data blocks without the lock, after claiming them under the lock as its own reservation. So reading the host
+ * files and writing file data, which is most of the work, goes on in parallel. The workers share one metadata
+ * batch, which is written out when the last of them commits.
+ */
+
+struct bulk_upload_pool
+{
+	FILE* fp;
+	struct bulk_upload_item* items;
+	int item_count;
+	int next_item;
+	pthread_mutex_t queue_lock;
+	pthread_mutex_t vdisk_lock;
+};
+
+//uploads one item with the vdisk lock held only for metadata. returns the new inode id or INODE_NOT_FOUND
+unsigned char upload_bulk_item(struct bulk_upload_pool* pool, struct bulk_upload_item* item, char* chunk)
+{
+	FILE* fp = pool->fp;
+	if (!file_name_fits(item->name,"bulk_upload")) return INODE_NOT_FOUND;
+	FILE* fpin = fopen(item->host_path,"rb");
+	if (!fpin)
+	{
+		printf("bulk_upload: could not open %s\n",item->host_path);
+		return INODE_NOT_FOUND;
+	}
+	size_t chunk_length = fread(chunk,1,UPLOAD_CHUNK_BYTES,fpin);
+	lock_vdisk(fp,&pool->vdisk_lock);
+	unsigned char parent_inode_id = find_directory_inode_id(fp,item->parent_path,"bulk_upload");
+	if (parent_inode_id==INODE_NOT_FOUND)
+	{
+		unlock_vdisk(fp,&pool->vdisk_lock);
+		fclose(fpin);
+		return INODE_NOT_FOUND;
+	}
+	struct file_writer writer;
+	begin_file_writer(&writer,fp);
+	writer.vdisk_lock = &pool->vdisk_lock;
+	while (chunk_length)
+	{
+		write_to_file_writer(&writer,chunk,chunk_length);
+		if (writer.full) break;
+		unlock_vdisk(fp,&pool->vdisk_lock);
+		chunk_length = fread(chunk,1,UPLOAD_CHUNK_BYTES,fpin);
+		lock_vdisk(fp,&pool->vdisk_lock);
+	}
+	unsigned char inode_id = finish_file_writer(&writer,parent_inode_id,item->name);
+	unlock_vdisk(fp,&pool->vdisk_lock);
+	fclose(fpin);
+	return inode_id;
+}
+
+void* bulk_upload_worker(void* context)
+{
+	struct bulk_upload_pool* pool = (struct bulk_upload_pool*)context;
+	char* chunk = (char*)malloc(UPLOAD_CHUNK_BYTES);
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->queue_lock);
+		int item_index = pool->next_item++;
+		pthread_mutex_unlock(&pool->queue_lock);
+		if (item_index>=pool->item_count) break;
+		struct bulk_upload_item* item = &pool->items[item_index];
+		item->inode_id = upload_bulk_item(pool,item,chunk);
+	}
+	free(chunk);
+	return NULL;
+}
+
+//uploads every item on thread_count threads, or one per processor when thread_count is 0. each item's inode_id is
+//set to the new file's inode id, or INODE_NOT_FOUND if it failed. returns how many files were uploaded
+int bulk_upload(FILE* fp, struct bulk_upload_item* items, int item_count, int thread_count)
+{
+	if (thread_count<=0) thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (thread_count>item_count) thread_count = item_count;
+	if (thread_count<1) thread_count = 1;
+	
+	struct bulk_upload_pool pool;
+	pool.fp = fp;
+	pool.items = items;
+	pool.item_count = item_count;
+	pool.next_item = 0;
+	pthread_mutex_init(&pool.queue_lock,NULL);
+	pthread_mutex_init(&pool.vdisk_lock,NULL);
+	fflush(fp);
+	pthread_t* threads = (pthread_t*)malloc(thread_count*sizeof(pthread_t));
+	int started = 0;
+	int i;
+	for (i=0;i<thread_count;i++)
+	{
+		if (pthread_create(&threads[started],NULL,bulk_upload_worker,&pool)==0) started++;
+	}
+	//with no threads to be had, the caller's thread does the work
+	if (!started) bulk_upload_worker(&pool);
+	for (i=0;i<started;i++) pthread_join(threads[i],NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool.queue_lock);
+	pthread_mutex_destroy(&pool.vdisk_lock);
+	fflush(fp);
+	
+	int uploaded = 0;
+	for (i=0;i<item_count;i++) if (items[i].inode_id!=INODE_NOT_FOUND) uploaded++;
+	return uploaded;
+}
+//////////////FILE UPDATES
+/*
+ * write_file_range() changes part of an existing file in place, with pwrite() semantics. The logical blocks the
+ * range covers are found through the block map, and nothing outside them is touched. A block the range covers in
+ * part is read and patched, and a block it covers whole is not read at all. Blocks the file already has are
+ * written where they are. Blocks past its end, including any gap up to the range, which reads back as zeros, are
+ * added as an upload adds them. Their pointer blocks are reserved first, the blocks are claimed with one free
+ * block vector write, and map_file_blocks() maps them. Data is written straight to the disk, a run of consecutive
+ * blocks at a time, UPDATE_GROUP_BLOCKS blocks per pass. The pointer blocks, inode and free block vector go
+ * through one metadata batch. On a vdisk mounted log-structured nothing is overwritten: each block the range
+ * covers goes to a new block at the log head, and the old block is freed.
+ * append_to_file() is a write at the end of the file: the partial last block is the only block read and rewritten,
+ * and the rest of the data goes to new blocks.
+ * truncate_file() shrinks a file with the traversal delete_file() makes, limited to the pointers past the new end:
+ * in each pointer block, only the pointers from the new end on are followed. The blocks they lead to, and the
+ * pointer blocks left empty, are freed together with one free block vector write per UPDATE_GROUP_BLOCKS blocks.
+ * They are not wiped, as every allocation writes a block whole. The part of the new last block past the new end is
+ * zeroed instead, so that the file reads zeros there if it grows again.
+ */
+const size_t UPDATE_GROUP_BLOCKS = 256;
+
+//writes the group's blocks from data to block_addresses, one run of consecutive addresses at a time. blocks set in
+//shared are on the disk already and are skipped
+void write_data_blocks(FILE* fp, unsigned short* block_addresses, const char* data, unsigned int block_count, char* shared)
+{
+	unsigned int run_start = 0;
+	unsigned int i;
+	//a batched copy of one of these blocks would overwrite the new data when the batch is flushed
+	for (i=0;i<block_count;i++)
+	{
+		if (shared[i]) continue;
+		drop_batched_block(fp,block_addresses[i]);
+		retire_journal_block(fp,block_addresses[i]);
+	}
+	for (i=1;i<=block_count;i++)
+	{
+		if (i<block_count && !shared[i] && !shared[i-1] && block_addresses[i]==block_addresses[i-1]+1) continue;
+		if (!shared[run_start]) write_block_run(fp,block_addresses[run_start],data+run_start*BYTES_PER_BLOCK,i-run_start);
+		run_start = i;
+	}
+}
+
+unsigned long long get_file_size(FILE* fp, unsigned char inode_id)
+{
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_inode_address(fp,inode_id),(char*)inode_buffer);
+	unsigned long long size = get_inode_size(inode_buffer);
+	free(inode_buffer);
+	return size;
+}
+
+//sets the size in a file's inode and in its directory entry
+void set_file_size(FILE* fp, unsigned char inode_id, unsigned long long size)
+{
+	unsigned short inode_address = get_inode_address(fp,inode_id);
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,inode_address,(char*)inode_buffer);
+	set_inode_size(inode_buffer,size);
+	write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+	free(inode_buffer);
+	invalidate_block_map_cache(fp,inode_id);
+	update_directory_entry_attributes(fp,inode_id);
+}
+
+//returns 1 if inode_id is a regular file, otherwise says so for caller and returns 0
+int is_regular_file(FILE* fp, unsigned char inode_id, char* caller)
+{
+	if (inode_id<INODE_MAX_NUM-1 && get_inode_address(fp,inode_id) && get_inode_type(fp,inode_id)=='f') return 1;
+	printf("%s: inode %d is not a file\n",caller,(int)inode_id);
+	return 0;
+}
+
+//writes length bytes from buffer at byte offset of the file, which grows when they go past its end. returns the
+//number of bytes written, which is short only when the vdisk is full
+size_t write_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, const char* buffer, size_t length)
+{
+	if (!is_regular_file(fp,inode_id,"write_file_range") || !length) return 0;
+	if (is_compressed_file(fp,inode_id)) return write_compressed_file_range(fp,inode_id,offset,buffer,length);
+	begin_metadata_batch(fp);
+	unsigned long long size = get_file_size(fp,inode_id);
+	unsigned long long end = offset+length;
+	unsigned long long block_count = (size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	unsigned long long end_block = (end+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	//a range past the end of the file starts at its end, which fills the gap with zeros
+	unsigned long long group_start = offset/BYTES_PER_BLOCK;
+	if (group_start>block_count) group_start = block_count;
+	
+	char* data = (char*)malloc(UPDATE_GROUP_BLOCKS*BYTES_PER_BLOCK);
+	unsigned short* block_addresses = (unsigned short*)malloc(UPDATE_GROUP_BLOCKS*sizeof(unsigned short));
+	unsigned short* old_addresses = (unsigned short*)malloc(UPDATE_GROUP_BLOCKS*sizeof(unsigned short));
+	char* needs_block = (char*)malloc(UPDATE_GROUP_BLOCKS);
+	char* shared = (char*)malloc(UPDATE_GROUP_BLOCKS);
+	while (group_start<end_block)
+	{
+		unsigned long long group_end = group_start+UPDATE_GROUP_BLOCKS;
+		if (group_end>end_block) group_end = end_block;
+		unsigned int group_blocks = group_end-group_start;
+		unsigned int i;
+		for (i=0;i<group_blocks;i++)
+		{
+			unsigned long long logical_block_index = group_start+i;
+			unsigned long long block_offset = logical_block_index*BYTES_PER_BLOCK;
+			char* block = data+i*BYTES_PER_BLOCK;
+			old_addresses[i] = logical_block_index<block_count ? get_file_block_address(fp,inode_id,logical_block_index) : 0;
+			block_addresses[i] = old_addresses[i];
+			if (old_addresses[i] && (block_offset<offset || block_offset+BYTES_PER_BLOCK>end)) read_block(fp,old_addresses[i],block);
+			else if (!old_addresses[i]) memset(block,0,BYTES_PER_BLOCK);
+			//a new address for the blocks past the end of the file, and for all of them in a log. a block which other
+			//files may share is never overwritten either
+			needs_block[i] = !old_addresses[i] || is_log_structured(fp) || !release_data_block_would_free(fp,old_addresses[i]);
+			shared[i] = 0;
+		}
+		unsigned long long copy_start = group_start*BYTES_PER_BLOCK>offset ? group_start*BYTES_PER_BLOCK : offset;
+		unsigned long long copy_end = group_end*BYTES_PER_BLOCK<end ? group_end*BYTES_PER_BLOCK : end;
+		if (copy_start<copy_end) memcpy(data+(copy_start-group_start*BYTES_PER_BLOCK),buffer+(copy_start-offset),copy_end-copy_start);
+		
+		//addresses for each run of blocks which need one, with the run's pointer blocks reserved first
+		int full = 0;
+		unsigned int run_start;
+		for (run_start=0;run_start<group_blocks && !full;)
+		{
+			if (!needs_block[run_start])
+			{
+				run_start++;
+				continue;
+			}
+			unsigned int run_end = run_start;
+			while (run_end<group_blocks && needs_block[run_end]) run_end++;
+			unsigned int mappable = reserve_file_pointer_blocks(fp,inode_id,group_start+run_start,run_end-run_start);
+			unsigned int claimed = claim_data_blocks(fp,data+run_start*BYTES_PER_BLOCK,mappable,block_addresses+run_start,shared+run_start);
+			//before the next run is claimed, which may share these blocks
+			write_data_blocks(fp,block_addresses+run_start,data+run_start*BYTES_PER_BLOCK,claimed,shared+run_start);
+			if (claimed<run_end-run_start)
+			{
+				printf("write_file_range: the vdisk is full\n");
+				group_blocks = run_start+claimed;
+				full = 1;
+			}
+			run_start = run_end;
+		}
+		
+		//the blocks which are written in place. the new ones were written with their run
+		write_data_blocks(fp,block_addresses,data,group_blocks,needs_block);
+		for (run_start=0;run_start<group_blocks;)
+		{
+			unsigned int run_end = run_start;
+			while (run_end<group_blocks && needs_block[run_end]) run_end++;
+			if (run_end>run_start) map_file_blocks(fp,inode_id,group_start+run_start,block_addresses+run_start,run_end-run_start);
+			run_start = run_end>run_start ? run_end : run_start+1;
+		}
+		for (i=0;i<group_blocks;i++)
+		{
+			if (needs_block[i] && old_addresses[i] && release_data_block(fp,old_addresses[i])) set_fbv_bit(fp,old_addresses[i]);
+		}
+		if (full)
+		{
+			unsigned long long written_end = (group_start+group_blocks)*BYTES_PER_BLOCK;
+			if (written_end<end) end = written_end;
+			break;
+		}
+		group_start = group_end;
+	}
+	free(shared);
+	free(needs_block);
+	free(old_addresses);
+	free(block_addresses);
+	free(data);
+	
+	if (end>size) set_file_size(fp,inode_id,end);
+	commit_metadata_batch(fp);
+	return end>offset ? end-offset : 0;
+}
+
+//blocks freed by a truncate, handed back to the free block vector in groups
+struct block_release
+{
+	unsigned short* block_addresses;
+	unsigned int count;
+};
+
+//the reverse of claim_free_blocks(): frees count blocks with one read and one write of the free block vector
+void release_blocks(FILE* fp, unsigned short* block_addresses, unsigned int count)
+{
+	if (!count) return;
+	unsigned char* free_block_vector = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,FREE_BLOCK_VECTOR_OFFSET,(char*)free_block_vector);
+	unsigned int i;
+	for (i=0;i<count;i++) free_block_vector[block_addresses[i]/8] |= 1<<(block_addresses[i]%8);
+	write_block(fp,FREE_BLOCK_VECTOR_OFFSET,free_block_vector,BYTES_PER_BLOCK);
+	free(free_block_vector);
+}
+
+void add_released_block(FILE* fp, struct block_release* release, unsigned short block_address)
+{
+	//a block other files still share stays
+	if (!release_data_block(fp,block_address)) return;
+	release->block_addresses[release->count++] = block_address;
+	if (release->count<UPDATE_GROUP_BLOCKS) return;
+	release_blocks(fp,release->block_addresses,release->count);
+	release->count = 0;
+}
+
+//frees what a pointer block with levels levels of pointer blocks, itself included, leads to past its first kept
+//logical blocks, and clears those pointers. the pointer block itself is left to the caller
+void release_pointer_block_tail(FILE* fp, struct block_release* release, unsigned short pointer_block_address, int levels, unsigned long long kept)
+{
+	unsigned long long blocks_below = 1;
+	int level;
+	for (level=1;level<levels;level++) blocks_below *= POINTERS_PER_BLOCK;
+	unsigned short* pointer_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,pointer_block_address,(char*)pointer_block);
+	unsigned int index = kept/blocks_below;
+	//the pointer the new end falls under keeps part of what it leads to
+	if (kept%blocks_below)
+	{
+		if (pointer_block[index]) release_pointer_block_tail(fp,release,pointer_block[index],levels-1,kept%blocks_below);
+		index++;
+	}
+	int changed = 0;
+	for (;index<POINTERS_PER_BLOCK;index++)
+	{
+		if (!pointer_block[index]) continue;
+		if (levels>1) release_pointer_block_tail(fp,release,pointer_block[index],levels-1,0);
+		add_released_block(fp,release,pointer_block[index]);
+		pointer_block[index] = 0;
+		changed = 1;
+	}
+	if (kept && changed) write_block(fp,pointer_block_address,pointer_block,BYTES_PER_BLOCK);
+	free(pointer_block);
+}
+
+//zeros the part of the last block a cut to size keeps which is past size. returns 0, or -1 if the vdisk is full
+int cut_file_tail(FILE* fp, unsigned char inode_id, unsigned long long old_size, unsigned long long size, char* zeros)
+{
+	//the extent the new end falls in is rewritten shorter, so that none of its blocks are past the end
+	if (is_compressed_file(fp,inode_id)) return cut_compressed_extent(fp,inode_id,old_size,size);
+	if (size%BYTES_PER_BLOCK)
+	{
+		unsigned long long block_end = size-size%BYTES_PER_BLOCK+BYTES_PER_BLOCK;
+		write_file_range(fp,inode_id,size,zeros,(block_end<old_size ? block_end : old_size)-size);
+	}
+	return 0;
+}
+
+//cuts the file to size bytes, or grows it to size with zeros. returns 0, or -1 if it is not a file or the vdisk
+//filled up while it grew
+int truncate_file(FILE* fp, unsigned char inode_id, unsigned long long size)
+{
+	if (!is_regular_file(fp,inode_id,"truncate_file")) return -1;
+	unsigned long long old_size = get_file_size(fp,inode_id);
+	char* zeros = (char*)calloc(UPDATE_GROUP_BLOCKS,BYTES_PER_BLOCK);
+	begin_metadata_batch(fp);
+	unsigned long long offset = old_size;
+	while (offset<size)
+	{
+		size_t length = size-offset<UPDATE_GROUP_BLOCKS*BYTES_PER_BLOCK ? size-offset : UPDATE_GROUP_BLOCKS*BYTES_PER_BLOCK;
+		size_t written = write_file_range(fp,inode_id,offset,zeros,length);
+		offset += written;
+		if (written<length) break;
+	}
+	if (size<old_size && !cut_file_tail(fp,inode_id,old_size,size,zeros))
+	{
+		unsigned long long kept = (size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+		struct block_release release;
+		release.block_addresses = (unsigned short*)malloc(UPDATE_GROUP_BLOCKS*sizeof(unsigned short));
+		release.count = 0;
+		unsigned short inode_address = get_inode_address(fp,inode_id);
+		unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+		read_block(fp,inode_address,(char*)inode_buffer);
+		unsigned long long i;
+		for (i=kept;i<DIRECT_POINTER_COUNT;i++)
+		{
+			unsigned short* pointer = &inode_buffer[INODE_DIRECT_OFFSET/2+i];
+			if (*pointer) add_released_block(fp,&release,*pointer);
+			*pointer = 0;
+		}
+		//first logical block and number of logical blocks under each indirection block
+		unsigned long long first_block = DIRECT_POINTER_COUNT;
+		unsigned long long tree_blocks = POINTERS_PER_BLOCK;
+		int depth;
+		for (depth=1;depth<=MAX_INDIRECTION_DEPTH;depth++)
+		{
+			unsigned short* pointer = &inode_buffer[INODE_INDIRECTION_OFFSETS[depth-1]/2];
+			unsigned long long tree_kept = kept>first_block ? kept-first_block : 0;
+			if (*pointer && tree_kept<tree_blocks)
+			{
+				release_pointer_block_tail(fp,&release,*pointer,depth,tree_kept);
+				if (!tree_kept)
+				{
+					add_released_block(fp,&release,*pointer);
+					*pointer = 0;
+				}
+			}
+			first_block += tree_blocks;
+			tree_blocks *= POINTERS_PER_BLOCK;
+		}
+		write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+		free(inode_buffer);
+		release_blocks(fp,release.block_addresses,release.count);
+		free(release.block_addresses);
+		offset = size;
+	}
+	if (offset!=old_size) set_file_size(fp,inode_id,offset);
+	commit_metadata_batch(fp);
+	free(zeros);
+	return offset==size ? 0 : -1;
+}
+
+//adds length bytes from buffer to the end of the file. returns the number of bytes added, short only when the vdisk
+//is full
+size_t append_to_file(FILE* fp, unsigned char inode_id, const char* buffer, size_t length)
+{
+	if (!is_regular_file(fp,inode_id,"append_to_file")) return 0;
+	return write_file_range(fp,inode_id,get_file_size(fp,inode_id),buffer,length);
+}
+
+//////////////DEDUPLICATION
+/*
+ * enable_deduplication() makes a vdisk store each distinct data block once from then on. Every data block written
+ * by an upload or write_file_range() is hashed, and a block whose bytes are found in the index is not written: the
+ * file points at the existing copy, whose reference count goes up. A hash match is always confirmed by comparing
+ * the bytes. Freeing a block in the index, by delete_file(), truncate_file() or an overwrite, takes its reference
+ * count down, and the block is only wiped and freed once nothing points at it. A block in the index is never
+ * overwritten in place either: write_file_range() gives the file a new block instead.
+ * The index is a hidden file which is in no directory, whose inode id is in the superblock. Its block 0 is a bitmap
+ * of the blocks in the index, so freeing a block which is not shared costs no hashing. Blocks 1 to
+ * DEDUP_TABLE_BLOCKS are an open addressing hash table of DEDUP_TABLE_ENTRIES entries, probed linearly for at most
+ * DEDUP_MAX_PROBE entries. A block which finds no room is written but not indexed. Index updates go through the
+ * metadata batch, and so are journaled with the rest of the operation's metadata. Blocks written before
+ * deduplication was enabled are not in the index, and each keeps its single owner.
+ */
+const size_t SUPERBLOCK_DEDUP_INODE_OFFSET = 16;
+const size_t DEDUP_TABLE_BLOCKS = 64;
+const size_t DEDUP_ENTRIES_PER_BLOCK = 64;
+const size_t DEDUP_TABLE_ENTRIES = 4096;
+const size_t DEDUP_MAX_PROBE = 128;
+const unsigned short DEDUP_MAX_REFERENCES = 0xfffe;
+//reference count of an entry which was removed, so that probes go on past it
+const unsigned short DEDUP_REMOVED = 0xffff;
+
+struct dedup_entry
+{
+	unsigned int hash;
+	unsigned short block_address; //0 for an entry which is empty or removed
+	unsigned short reference_count;
+};
+
+//the index inode of the last vdisk asked about
+struct dedup_index
+{
+	FILE* fp;
+	unsigned char inode_id; //0 when the vdisk does not deduplicate
+};
+
+struct dedup_index dedup_index = {NULL,0};
+
+//returns the inode id of the vdisk's deduplication index, or 0 if it has none
+unsigned char get_dedup_inode(FILE* fp)
+{
+	if (dedup_index.fp==fp) return dedup_index.inode_id;
+	unsigned int inode_id;
+	read_block_value(fp,0,(char*)&inode_id,SUPERBLOCK_DEDUP_INODE_OFFSET,4);
+	if (inode_id>=INODE_MAX_NUM-1 || !get_inode_address(fp,inode_id)) inode_id = 0;
+	dedup_index.fp = fp;
+	dedup_index.inode_id = inode_id;
+	return inode_id;
+}
+
+unsigned int hash_data_block(const char* block)
+{
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i=0;i<BYTES_PER_BLOCK;i++) hash = (hash^(unsigned char)block[i])*16777619u;
+	return hash;
+}
+
+//returns the address of the table block holding entry position, reading it into table_block unless it is the one
+//at loaded_address
+unsigned short load_dedup_table_block(FILE* fp, unsigned int position, char* table_block, unsigned short loaded_address)
+{
+	unsigned short address = get_file_block_address(fp,get_dedup_inode(fp),1+position/DEDUP_ENTRIES_PER_BLOCK);
+	if (address!=loaded_address) read_block(fp,address,table_block);
+	return address;
+}
+
+int data_block_is_indexed(FILE* fp, unsigned short block_address)
+{
+	unsigned char bitmap_byte;
+	read_block_value(fp,get_file_block_address(fp,get_dedup_inode(fp),0),(char*)&bitmap_byte,block_address/8,1);
+	return (bitmap_byte>>(block_address%8))&1;
+}
+
+void set_data_block_indexed(FILE* fp, unsigned short block_address, int indexed)
+{
+	unsigned short bitmap_address = get_file_block_address(fp,get_dedup_inode(fp),0);
+	unsigned char* bitmap = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,bitmap_address,(char*)bitmap);
+	if (indexed) bitmap[block_address/8] |= 1<<(block_address%8);
+	else bitmap[block_address/8] &= ~(1<<(block_address%8));
+	write_block(fp,bitmap_address,bitmap,BYTES_PER_BLOCK);
+	free(bitmap);
+}
+
+//returns the address of an indexed block with the same bytes as block, with one more reference to it, or 0. the
+//pending_count blocks of pending_data were claimed at pending_addresses but are not written yet, so they are compared
+//in memory
+unsigned short share_duplicate_block(FILE* fp, const char* block, const unsigned short* pending_addresses, const char* pending_data, unsigned int pending_count)
+{
+	if (!get_dedup_inode(fp)) return 0;
+	unsigned int hash = hash_data_block(block);
+	char* table_block = (char*)malloc(BYTES_PER_BLOCK);
+	char* candidate = (char*)malloc(BYTES_PER_BLOCK);
+	unsigned short table_address = 0;
+	unsigned short shared_address = 0;
+	unsigned int probe;
+	for (probe=0;probe<DEDUP_MAX_PROBE && !shared_address;probe++)
+	{
+		unsigned int position = (hash+probe)%DEDUP_TABLE_ENTRIES;
+		table_address = load_dedup_table_block(fp,position,table_block,table_address);
+		struct dedup_entry* entry = (struct dedup_entry*)table_block+position%DEDUP_ENTRIES_PER_BLOCK;
+		if (!entry->block_address && !entry->reference_count) break;
+		if (!entry->block_address || entry->hash!=hash || entry->reference_count>=DEDUP_MAX_REFERENCES) continue;
+		unsigned int pending;
+		for (pending=0;pending<pending_count && pending_addresses[pending]!=entry->block_address;pending++);
+		if (pending<pending_count) memcpy(candidate,pending_data+(size_t)pending*BYTES_PER_BLOCK,BYTES_PER_BLOCK);
+		else read_block(fp,entry->block_address,candidate);
+		if (memcmp(candidate,block,BYTES_PER_BLOCK)) continue;
+		entry->reference_count++;
+		write_block(fp,table_address,table_block,BYTES_PER_BLOCK);
+		shared_address = entry->block_address;
+	}
+	free(candidate);
+	free(table_block);
+	return shared_address;
+}
+
+//adds a block which was just claimed for block's bytes to the index, with one reference
+void index_data_block(FILE* fp, unsigned short block_address, const char* block)
+{
+	unsigned int hash = hash_data_block(block);
+	char* table_block = (char*)malloc(BYTES_PER_BLOCK);
+	unsigned short table_address = 0;
+	unsigned int probe;
+	for (probe=0;probe<DEDUP_MAX_PROBE;probe++)
+	{
+		unsigned int position = (hash+probe)%DEDUP_TABLE_ENTRIES;
+		table_address = load_dedup_table_block(fp,position,table_block,table_address);
+		struct dedup_entry* entry = (struct dedup_entry*)table_block+position%DEDUP_ENTRIES_PER_BLOCK;
+		if (entry->block_address) continue;
+		entry->hash = hash;
+		entry->block_address = block_address;
+		entry->reference_count = 1;
+		write_block(fp,table_address,table_block,BYTES_PER_BLOCK);
+		set_data_block_indexed(fp,block_address,1);
+		break;
+	}
+	free(table_block);
+}
+
+//returns 1 if dropping one reference to the block would leave it unused, without dropping it
+int release_data_block_would_free(FILE* fp, unsigned short block_address)
+{
+	return !get_dedup_inode(fp) || !data_block_is_indexed(fp,block_address);
+}
+
+//drops one pointer's reference to a data block. returns 1 if nothing points at the block any more, and the caller
+//frees it, or 0 if other pointers still share it. blocks outside the index have a single pointer
+int release_data_block(FILE* fp, unsigned short block_address)
+{
+	if (release_data_block_would_free(fp,block_address)) return 1;
+	char* block = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,block_address,block);
+	unsigned int hash = hash_data_block(block);
+	char* table_block = block;
+	unsigned short table_address = 0;
+	int unused = 1;
+	unsigned int probe;
+	for (probe=0;probe<DEDUP_MAX_PROBE;probe++)
+	{
+		unsigned int position = (hash+probe)%DEDUP_TABLE_ENTRIES;
+		table_address = load_dedup_table_block(fp,position,table_block,table_address);
+		struct dedup_entry* entry = (struct dedup_entry*)table_block+position%DEDUP_ENTRIES_PER_BLOCK;
+		if (!entry->block_address && !entry->reference_count) break;
+		if (entry->block_address!=block_address) continue;
+		if (--entry->reference_count)
+		{
+			unused = 0;
+		}
+		else
+		{
+			entry->block_address = 0;
+			entry->reference_count = DEDUP_REMOVED;
+		}
+		write_block(fp,table_address,table_block,BYTES_PER_BLOCK);
+		break;
+	}
+	if (unused) set_data_block_indexed(fp,block_address,0);
+	free(block);
+	return unused;
+}
+
+//clears the referrers of indexed blocks, which the segment cleaner must leave where they are
+void forget_shared_blocks(FILE* fp, struct block_referrer* referrers)
+{
+	if (!get_dedup_inode(fp)) return;
+	unsigned char* bitmap = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_file_block_address(fp,get_dedup_inode(fp),0),(char*)bitmap);
+	unsigned int block_num;
+	for (block_num=0;block_num<=MAX_BLOCK_INDEX;block_num++)
+	{
+		if ((bitmap[block_num/8]>>(block_num%8))&1) memset(&referrers[block_num],0,sizeof(struct block_referrer));
+	}
+	free(bitmap);
+}
+
+//creates the deduplication index. returns 0, or -1 if the vdisk has no room for it
+int enable_deduplication(FILE* fp)
+{
+	if (get_dedup_inode(fp)) return 0;
+	begin_metadata_batch(fp);
+	unsigned char inode_id = find_next_free_inode_id(fp);
+	assign_location_to_inode_map(fp,create_empty_inode(fp,inode_id,0,'f'),inode_id);
+	size_t length = (DEDUP_TABLE_BLOCKS+1)*BYTES_PER_BLOCK;
+	char* zeros = (char*)calloc(DEDUP_TABLE_BLOCKS+1,BYTES_PER_BLOCK);
+	int result = write_file_range(fp,inode_id,0,zeros,length)==length ? 0 : -1;
+	free(zeros);
+	if (result)
+	{
+		printf("enable_deduplication: the vdisk has no room for the index\n");
+		delete_file(fp,inode_id);
+	}
+	else
+	{
+		unsigned int* superblock = (unsigned int*)malloc(BYTES_PER_BLOCK);
+		read_block(fp,0,(char*)superblock);
+		superblock[SUPERBLOCK_DEDUP_INODE_OFFSET/4] = inode_id;
+		write_block(fp,0,superblock,BYTES_PER_BLOCK);
+		free(superblock);
+	}
+	commit_metadata_batch(fp);
+	dedup_index.fp = NULL;
+	return result;
+}
+
+//////////////COMPRESSION
+/*
+ * set_compression() makes the files uploaded to a vdisk from then on compressed, which is marked by
+ * FILE_FORMAT_COMPRESSED in their inode's format byte. A compressed file is cut into extents of
+ * COMPRESSION_EXTENT_BLOCKS logical blocks, the first starting at logical block 0, and the last one shorter if the
+ * file is. Each extent is compressed on its own into the LZ4 block format, behind a 2 byte length, and the result
+ * is stored in the extent's first logical blocks. The extent's other pointers are 0. An extent which would not
+ * take at least one block fewer is stored as it is, in all of its blocks. The pointers therefore record how each
+ * extent is kept: it is compressed exactly when it has fewer blocks than logical blocks.
+ * Reads and downloads decompress one extent at a time. write_file_range(), append_to_file() and truncate_file()
+ * read the extents a change falls in, change them and write each back compressed to new blocks, then free the
+ * old ones. Files written before compression was turned on keep the plain format, and both kinds can be mixed.
+ * The LZ4 coder is a small greedy one of our own, so the vdisk needs no library. Its output is standard LZ4 block
+ * data, which the LZ4 library can read.
+ */
+const size_t SUPERBLOCK_COMPRESSION_OFFSET = 20;
+const size_t LZ4_HASH_BITS = 12;
+const int LZ4_MIN_MATCH = 4;
+//no match may start within the last 12 bytes of the input, and the last 5 bytes are always literals
+const int LZ4_MATCH_START_LIMIT = 12;
+const int LZ4_LAST_LITERALS = 5;
+const size_t PACKED_EXTENT_HEADER_BYTES = 2;
+
+int get_vdisk_compression(FILE* fp)
+{
+	unsigned int compression;
+	read_block_value(fp,0,(char*)&compression,SUPERBLOCK_COMPRESSION_OFFSET,4);
+	return compression==1;
+}
+
+//turns compression of newly uploaded files on or off
+void set_compression(FILE* fp, int enabled)
+{
+	unsigned int* superblock = (unsigned int*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,0,(char*)superblock);
+	superblock[SUPERBLOCK_COMPRESSION_OFFSET/4] = enabled ? 1 : 0;
+	write_block(fp,0,superblock,BYTES_PER_BLOCK);
+	free(superblock);
+}
+
+int is_compressed_file(FILE* fp, unsigned char inode_id)
+{
+	unsigned char format;
+	read_block_value(fp,get_inode_address(fp,inode_id),(char*)&format,INODE_FLAGS_OFFSET,1);
+	return format==FILE_FORMAT_COMPRESSED;
+}
+
+void set_file_format(FILE* fp, unsigned char inode_id, unsigned short inode_address, unsigned char format)
+{
+	unsigned char* inode_buffer = (unsigned char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,inode_address,(char*)inode_buffer);
+	inode_buffer[INODE_FLAGS_OFFSET] = format;
+	write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+	free(inode_buffer);
+	invalidate_block_map_cache(fp,inode_id);
+}
+
+unsigned int lz4_hash(const unsigned char* position)
+{
+	unsigned int value;
+	memcpy(&value,position,4);
+	return (value*2654435761u)>>(32-LZ4_HASH_BITS);
+}
+
+//writes the part of a length past 15 as 255s and a last byte. returns the new output length, or -1 if it is full
+int lz4_write_length(unsigned char* output, int output_length, int capacity, int length)
+{
+	for (;length>=255;length-=255)
+	{
+		if (output_length>=capacity) return -1;
+		output[output_length++] = 255;
+	}
+	if (output_length>=capacity) return -1;
+	output[output_length++] = length;
+	return output_length;
+}
+
+//writes one sequence: the literals, then a match of match_length bytes at offset back, or no match for the last
+//sequence when match_length is 0. returns the new output length, or -1 if the output is full
+int lz4_write_sequence(unsigned char* output, int output_length, int capacity, const unsigned char* literals, int literal_length, int offset, int match_length)
+{
+	if (output_length>=capacity) return -1;
+	int token = output_length++;
+	output[token] = (literal_length<15 ? literal_length : 15)<<4;
+	if (literal_length>=15 && (output_length = lz4_write_length(output,output_length,capacity,literal_length-15))<0) return -1;
+	if (literal_length>capacity-output_length) return -1;
+	memcpy(output+output_length,literals,literal_length);
+	output_length += literal_length;
+	if (!match_length) return output_length;
+	if (output_length+2>capacity) return -1;
+	output[output_length++] = offset&0xff;
+	output[output_length++] = offset>>8;
+	match_length -= LZ4_MIN_MATCH;
+	output[token] |= match_length<15 ? match_length : 15;
+	if (match_length>=15) output_length = lz4_write_length(output,output_length,capacity,match_length-15);
+	return output_length;
+}
+
+//compresses length bytes of input into an LZ4 block. returns its length, or 0 if it does not fit in capacity
+int lz4_compress(const unsigned char* input, int length, unsigned char* output, int capacity)
+{
+	int* last_positions = (int*)malloc(((size_t)1<<LZ4_HASH_BITS)*sizeof(int));
+	memset(last_positions,0xff,((size_t)1<<LZ4_HASH_BITS)*sizeof(int));
+	int output_length = 0;
+	int anchor = 0;
+	int position = 0;
+	while (position<length-LZ4_MATCH_START_LIMIT && output_length>=0)
+	{
+		unsigned int hash = lz4_hash(input+position);
+		int candidate = last_positions[hash];
+		last_positions[hash] = position;
+		if (candidate<0 || memcmp(input+candidate,input+position,LZ4_MIN_MATCH))
+		{
+			position++;
+			continue;
+		}
+		int match_length = LZ4_MIN_MATCH;
+		while (position+match_length<length-LZ4_LAST_LITERALS && input[candidate+match_length]==input[position+match_length]) match_length++;
+		output_length = lz4_write_sequence(output,output_length,capacity,input+anchor,position-anchor,position-candidate,match_length);
+		position += match_length;
+		anchor = position;
+	}
+	if (output_length>=0) output_length = lz4_write_sequence(output,output_length,capacity,input+anchor,length-anchor,0,0);
+	free(last_positions);
+	return output_length<0 ? 0 : output_length;
+}
+
+//adds the bytes after a length nibble of 15. returns the whole length, or -1 if the input ends first
+int lz4_read_length(const unsigned char* input, int* input_position, int length, int nibble)
+{
+	if (nibble<15) return nibble;
+	unsigned char byte;
+	do
+	{
+		if (*input_position>=length) return -1;
+		byte = input[(*input_position)++];
+		nibble += byte;
+	}
+	while (byte==255);
+	return nibble;
+}
+
+//decompresses an LZ4 block. returns the length of the output, or -1 if the block is damaged or would overflow it
+int lz4_decompress(const unsigned char* input, int length, unsigned char* output, int capacity)
+{
+	int input_position = 0;
+	int output_length = 0;
+	while (input_position<length)
+	{
+		unsigned char token = input[input_position++];
+		int literal_length = lz4_read_length(input,&input_position,length,token>>4);
+		if (literal_length<0 || literal_length>length-input_position || literal_length>capacity-output_length) return -1;
+		memcpy(output+output_length,input+input_position,literal_length);
+		input_position += literal_length;
+		output_length += literal_length;
+		//the last sequence has no match
+		if (input_position==length) break;
+		if (input_position+2>length) return -1;
+		int offset = input[input_position]|(input[input_position+1]<<8);
+		input_position += 2;
+		int match_length = lz4_read_length(input,&input_position,length,token&15);
+		if (!offset || offset>output_length || match_length<0 || match_length+LZ4_MIN_MATCH>capacity-output_length) return -1;
+		match_length += LZ4_MIN_MATCH;
+		//byte by byte, as a match may overlap the bytes it produces
+		int i;
+		for (i=0;i<match_length;i++) output[output_length+i] = output[output_length-offset+i];
+		output_length += match_length;
+	}
+	return output_length;
+}
+
+//returns how many logical blocks the extent starting at first_logical_block has in a file of block_count blocks
+unsigned int get_extent_block_count(unsigned long long block_count, unsigned long long first_logical_block)
+{
+	if (block_count<=first_logical_block) return 0;
+	return block_count-first_logical_block<COMPRESSION_EXTENT_BLOCKS ? block_count-first_logical_block : COMPRESSION_EXTENT_BLOCKS;
+}
+
+//compresses block_count blocks of extent into packed. returns how many blocks the packed extent fills, or
+//block_count if it is to be stored as it is
+unsigned int pack_extent(const char* extent, unsigned int block_count, char* packed)
+{
+	if (block_count<2) return block_count;
+	//it has to save a block to be worth it
+	int capacity = (block_count-1)*BYTES_PER_BLOCK-PACKED_EXTENT_HEADER_BYTES;
+	int packed_length = lz4_compress((const unsigned char*)extent,block_count*BYTES_PER_BLOCK,(unsigned char*)packed+PACKED_EXTENT_HEADER_BYTES,capacity);
+	if (!packed_length) return block_count;
+	unsigned short header = packed_length;
+	memcpy(packed,&header,PACKED_EXTENT_HEADER_BYTES);
+	packed_length += PACKED_EXTENT_HEADER_BYTES;
+	unsigned int stored_blocks = (packed_length+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	memset(packed+packed_length,0,stored_blocks*BYTES_PER_BLOCK-packed_length);
+	return stored_blocks;
+}
+
+//maps stored_blocks blocks of source at first_logical_block, in place of the old_block_count logical blocks the
+//extent had, and frees those the file no longer uses. returns 0, or -1 when the vdisk is full, which leaves the
+//extent as it was
+int store_extent(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, const char* source, unsigned int stored_blocks, unsigned int old_block_count)
+{
+	unsigned short* block_addresses = (unsigned short*)malloc(COMPRESSION_EXTENT_BLOCKS*sizeof(unsigned short));
+	unsigned short* old_addresses = (unsigned short*)malloc(COMPRESSION_EXTENT_BLOCKS*sizeof(unsigned short));
+	char* shared = (char*)malloc(COMPRESSION_EXTENT_BLOCKS);
+	unsigned int i;
+	for (i=0;i<old_block_count;i++) old_addresses[i] = get_file_block_address(fp,inode_id,first_logical_block+i);
+	unsigned int claimed = 0;
+	if (reserve_file_pointer_blocks(fp,inode_id,first_logical_block,stored_blocks)==stored_blocks)
+	{
+		claimed = claim_data_blocks(fp,source,stored_blocks,block_addresses,shared);
+		write_data_blocks(fp,block_addresses,source,claimed,shared);
+	}
+	int result = 0;
+	if (claimed<stored_blocks)
+	{
+		for (i=0;i<claimed;i++)
+		{
+			if (release_data_block(fp,block_addresses[i])) set_fbv_bit(fp,block_addresses[i]);
+		}
+		result = -1;
+	}
+	else
+	{
+		//the old pointers past the new blocks are cleared, up to the last one which was in use
+		unsigned int mapped = stored_blocks;
+		for (i=stored_blocks;i<old_block_count;i++)
+		{
+			block_addresses[i] = 0;
+			if (old_addresses[i]) mapped = i+1;
+		}
+		map_file_blocks(fp,inode_id,first_logical_block,block_addresses,mapped);
+		for (i=0;i<old_block_count;i++)
+		{
+			if (old_addresses[i] && release_data_block(fp,old_addresses[i])) set_fbv_bit(fp,old_addresses[i]);
+		}
+	}
+	free(shared);
+	free(old_addresses);
+	free(block_addresses);
+	return result;
+}
+
+//reads the extent of block_count logical blocks starting at first_logical_block into extent, decompressing it
+//through packed when it is compressed. returns 0, or -1 if it is damaged
+int read_extent(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, unsigned int block_count, char* extent, char* packed)
+{
+	unsigned int stored_blocks;
+	for (stored_blocks=0;stored_blocks<block_count;stored_blocks++)
+	{
+		unsigned short block_address = get_file_block_address(fp,inode_id,first_logical_block+stored_blocks);
+		if (!block_address) break;
+		read_block(fp,block_address,packed+stored_blocks*BYTES_PER_BLOCK);
+	}
+	if (stored_blocks==block_count)
+	{
+		memcpy(extent,packed,block_count*BYTES_PER_BLOCK);
+		return 0;
+	}
+	unsigned short packed_length = 0;
+	if (stored_blocks) memcpy(&packed_length,packed,PACKED_EXTENT_HEADER_BYTES);
+	if (!stored_blocks || packed_length>stored_blocks*BYTES_PER_BLOCK-PACKED_EXTENT_HEADER_BYTES
+		|| lz4_decompress((unsigned char*)packed+PACKED_EXTENT_HEADER_BYTES,packed_length,(unsigned char*)extent,block_count*BYTES_PER_BLOCK)!=(int)(block_count*BYTES_PER_BLOCK))
+	{
+		printf("read_extent: the extent at logical block %llu of inode %d is damaged\n",first_logical_block,(int)inode_id);
+		return -1;
+	}
+	return 0;
+}
+
+//read_file_range() for a compressed file of size bytes, with offset and length already inside it
+size_t read_compressed_file_range(FILE* fp, unsigned char inode_id, unsigned long long size, unsigned long long offset, char* buffer, size_t length)
+{
+	size_t extent_bytes = COMPRESSION_EXTENT_BLOCKS*BYTES_PER_BLOCK;
+	unsigned long long block_count = (size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	char* extent = (char*)malloc(extent_bytes);
+	char* packed = (char*)malloc(extent_bytes);
+	size_t bytes_read = 0;
+	while (bytes_read<length)
+	{
+		size_t extent_offset = (offset+bytes_read)%extent_bytes;
+		unsigned long long first_logical_block = (offset+bytes_read)/extent_bytes*COMPRESSION_EXTENT_BLOCKS;
+		if (read_extent(fp,inode_id,first_logical_block,get_extent_block_count(block_count,first_logical_block),extent,packed)) break;
+		size_t chunk = extent_bytes-extent_offset;
+		if (chunk>length-bytes_read) chunk = length-bytes_read;
+		memcpy(buffer+bytes_read,extent+extent_offset,chunk);
+		bytes_read += chunk;
+	}
+	free(packed);
+	free(extent);
+	return bytes_read;
+}
+
+//writes a compressed file of size bytes out to fpout, one extent at a time
+void download_compressed_file(FILE* fp, unsigned char inode_id, unsigned long long size, FILE* fpout)
+{
+	size_t extent_bytes = COMPRESSION_EXTENT_BLOCKS*BYTES_PER_BLOCK;
+	unsigned long long block_count = (size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	char* extent = (char*)malloc(extent_bytes);
+	char* packed = (char*)malloc(extent_bytes);
+	unsigned long long first_logical_block;
+	for (first_logical_block=0;first_logical_block<block_count;first_logical_block+=COMPRESSION_EXTENT_BLOCKS)
+	{
+		if (read_extent(fp,inode_id,first_logical_block,get_extent_block_count(block_count,first_logical_block),extent,packed)) break;
+		unsigned long long extent_start = first_logical_block*BYTES_PER_BLOCK;
+		fwrite(extent,1,size-extent_start<extent_bytes ? size-extent_start : extent_bytes,fpout);
+	}
+	free(packed);
+	free(extent);
+}
+
+//packs block_count blocks of extent and stores them in place of the extent's old_block_count blocks
+int write_extent(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, const char* extent, unsigned int block_count, unsigned int old_block_count, char* packed)
+{
+	unsigned int stored_blocks = pack_extent(extent,block_count,packed);
+	const char* source = stored_blocks<block_count ? packed : extent;
+	return store_extent(fp,inode_id,first_logical_block,source,stored_blocks,old_block_count);
+}
+
+//write_file_range() for a compressed file. each extent the range touches is read, changed and written back
+size_t write_compressed_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, const char* buffer, size_t length)
+{
+	size_t extent_bytes = COMPRESSION_EXTENT_BLOCKS*BYTES_PER_BLOCK;
+	begin_metadata_batch(fp);
+	unsigned long long size = get_file_size(fp,inode_id);
+	unsigned long long end = offset+length;
+	unsigned long long new_size = end>size ? end : size;
+	unsigned long long block_count = (size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	unsigned long long new_block_count = (new_size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	//a range past the end of the file starts at its end, which fills the gap with zeros
+	unsigned long long start = offset<size ? offset : size;
+	unsigned long long written_end = start;
+	char* extent = (char*)malloc(extent_bytes);
+	char* packed = (char*)malloc(extent_bytes);
+	unsigned long long first_logical_block;
+	for (first_logical_block=start/extent_bytes*COMPRESSION_EXTENT_BLOCKS;first_logical_block<new_block_count;first_logical_block+=COMPRESSION_EXTENT_BLOCKS)
+	{
+		unsigned long long extent_start = first_logical_block*BYTES_PER_BLOCK;
+		unsigned int old_block_count = get_extent_block_count(block_count,first_logical_block);
+		if (old_block_count && read_extent(fp,inode_id,first_logical_block,old_block_count,extent,packed)) break;
+		if (size<extent_start+extent_bytes)
+		{
+			size_t kept_bytes = size>extent_start ? size-extent_start : 0;
+			memset(extent+kept_bytes,0,extent_bytes-kept_bytes);
+		}
+		unsigned long long copy_start = extent_start>offset ? extent_start : offset;
+		unsigned long long copy_end = extent_start+extent_bytes<end ? extent_start+extent_bytes : end;
+		if (copy_start<copy_end) memcpy(extent+(copy_start-extent_start),buffer+(copy_start-offset),copy_end-copy_start);
+		if (write_extent(fp,inode_id,first_logical_block,extent,get_extent_block_count(new_block_count,first_logical_block),old_block_count,packed))
+		{
+			printf("write_file_range: the vdisk is full\n");
+			break;
+		}
+		written_end = copy_end;
+	}
+	free(packed);
+	free(extent);
+
+	if (written_end>size) set_file_size(fp,inode_id,written_end);
+	commit_metadata_batch(fp);
+	return written_end>offset ? written_end-offset : 0;
+}
+
+//rewrites the extent holding the last block a cut of a compressed file to size keeps, as an extent which ends with
+//that block and has zeros past size. returns 0, or -1 if the vdisk is full
+int cut_compressed_extent(FILE* fp, unsigned char inode_id, unsigned long long old_size, unsigned long long size)
+{
+	unsigned long long kept = (size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK;
+	if (!kept) return 0;
+	unsigned long long first_logical_block = (kept-1)/COMPRESSION_EXTENT_BLOCKS*COMPRESSION_EXTENT_BLOCKS;
+	unsigned int old_block_count = get_extent_block_count((old_size+BYTES_PER_BLOCK-1)/BYTES_PER_BLOCK,first_logical_block);
+	unsigned int block_count = kept-first_logical_block;
+	if (block_count==old_block_count && !(size%BYTES_PER_BLOCK)) return 0;
+	size_t extent_bytes = COMPRESSION_EXTENT_BLOCKS*BYTES_PER_BLOCK;
+	char* extent = (char*)malloc(extent_bytes);
+	char* packed = (char*)malloc(extent_bytes);
+	int result = read_extent(fp,inode_id,first_logical_block,old_block_count,extent,packed);
+	if (!result)
+	{
+		size_t kept_bytes = size-first_logical_block*BYTES_PER_BLOCK;
+		memset(extent+kept_bytes,0,extent_bytes-kept_bytes);
+		result = write_extent(fp,inode_id,first_logical_block,extent,block_count,old_block_count,packed);
+	}
+	free(packed);
+	free(extent);
+	return result;
+}
+
+//////////////BLOCK MAP CACHE
+/*
+ * Per-inode translation from logical block index to physical block address.
+ * The cache is a radix tree with the same shape as the inode's pointer blocks: one node
+ * per indirection block, holding a copy of its 256 pointers and, above the last level,
+ * its lazily loaded children. An entry is filled lazily: the direct pointers come from the
+ * inode block and a pointer block is copied in the first time it is needed, either by a
+ * lookup or by the streaming read engine below. Once warm, a random read costs one data block I/O.
+ * 
+ * logical blocks 0-9: direct pointers
+ * logical blocks 10-265: single indirection block
+ * logical blocks 266-65801: double indirection block
+ * logical blocks 65802 and up: triple indirection block
+ */
+const size_t BLOCK_MAP_CACHE_SLOTS = 16;
+
+struct block_map_node
+{
+	unsigned short* pointers; //copy of the pointer block
+	struct block_map_node** children; //NULL until a child is loaded, never used on the last level
+};
+
+struct block_map_cache_entry
+{
+	FILE* fp;
+	int in_use;
+	unsigned long last_used;
+	unsigned char inode_id;
+	unsigned char flags; //inode byte 33, the DIRECTORY_FORMAT of a directory or the FILE_FORMAT of a file
+	unsigned long long size;
+	unsigned short direct[10];
+	unsigned short indirection_blocks[3]; //single, double and triple indirection block addresses
+	struct block_map_node* indirection_nodes[3]; //NULL until the matching block is read
+	char* directory_index; //block 0 of a hashed directory, NULL until read
+};
+
+struct block_map_cache_entry* block_map_cache = NULL;
+unsigned long block_map_cache_clock = 0;
+
+struct block_map_node* load_block_map_node(FILE* fp, unsigned short pointer_block_address)
+{
+	struct block_map_node* node = (struct block_map_node*)calloc(1,sizeof(struct block_map_node));
+	node->pointers = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,pointer_block_address,(char*)node->pointers);
+	return node;
+}
+
+void free_block_map_node(struct block_map_node* node)
+{
+	if (!node) return;
+	int i;
+	if (node->children)
+	{
+		for (i=0;i<POINTERS_PER_BLOCK;i++) free_block_map_node(node->children[i]);
+		free(node->children);
+	}
+	free(node->pointers);
+	free(node);
+}
+
+//returns child number index of a node, reading its pointer block the first time. NULL if the pointer is empty
+struct block_map_node* get_block_map_node_child(FILE* fp, struct block_map_node* node, unsigned int index)
+{
+	if (!node->pointers[index]) return NULL;
+	if (!node->children) node->children = (struct block_map_node**)calloc(POINTERS_PER_BLOCK,sizeof(struct block_map_node*));
+	if (!node->children[index]) node->children[index] = load_block_map_node(fp,node->pointers[index]);
+	return node->children[index];
+}
+
+//returns the top node for the given depth of indirection, reading it the first time. NULL if the inode has none
+struct block_map_node* get_block_map_root(FILE* fp, struct block_map_cache_entry* entry, int depth)
+{
+	if (!entry->indirection_blocks[depth-1]) return NULL;
+	if (!entry->indirection_nodes[depth-1])
+	{
+		entry->indirection_nodes[depth-1] = load_block_map_node(fp,entry->indirection_blocks[depth-1]);
+	}
+	return entry->indirection_nodes[depth-1];
+}
+
+void release_block_map_cache_entry(struct block_map_cache_entry* entry)
+{
+	int depth;
+	for (depth=0;depth<MAX_INDIRECTION_DEPTH;depth++) free_block_map_node(entry->indirection_nodes[depth]);
+	free(entry->directory_index);
+	memset(entry,0,sizeof(struct block_map_cache_entry));
+}
+
+//returns the cache entry for this inode, reading the inode block only when it is not cached yet
+struct block_map_cache_entry* get_block_map_cache_entry(FILE* fp, unsigned char inode_id)
+{
+	if (!block_map_cache)
+	{
+		block_map_cache = calloc(BLOCK_MAP_CACHE_SLOTS,sizeof(struct block_map_cache_entry));
+	}
+	struct block_map_cache_entry* victim = &block_map_cache[0];
+	int i;
+	for (i=0;i<BLOCK_MAP_CACHE_SLOTS;i++)
+	{
+		struct block_map_cache_entry* entry = &block_map_cache[i];
+		if (entry->in_use && entry->fp==fp && entry->inode_id==inode_id)
+		{
+			entry->last_used = ++block_map_cache_clock;
+			return entry;
+		}
+		//prefer an empty slot, otherwise evict the least recently used one. directories with an open handle stay
+		if (!entry->in_use) 
+		{
+			if (victim->in_use) victim = entry;
+		}
+		else if (directory_handle_is_open(entry->fp,entry->inode_id)) continue;
+		else if (victim->in_use && (entry->last_used < victim->last_used || directory_handle_is_open(victim->fp,victim->inode_id))) victim = entry;
+	}
+	
+	release_block_map_cache_entry(victim);
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_inode_address(fp,inode_id),(char*)inode_buffer);
+	victim->fp = fp;
+	victim->in_use = 1;
+	victim->last_used = ++block_map_cache_clock;
+	victim->inode_id = inode_id;
+	victim->flags = ((unsigned char*)inode_buffer)[INODE_FLAGS_OFFSET];
+	victim->size = get_inode_size(inode_buffer);
+	memcpy(victim->direct,&inode_buffer[INODE_DIRECT_OFFSET/2],DIRECT_POINTER_COUNT*2);
+	int depth;
+	for (depth=1;depth<=MAX_INDIRECTION_DEPTH;depth++)
+	{
+		victim->indirection_blocks[depth-1] = inode_buffer[INODE_INDIRECTION_OFFSETS[depth-1]/2];
+	}
+	free(inode_buffer);
+	return victim;
+}
+
+//returns the physical block holding logical block logical_block_index of the file, or 0 if it has none
+unsigned short get_file_block_address(FILE* fp, unsigned char inode_id, unsigned long long logical_block_index)
+{
+	struct block_map_cache_entry* entry = get_block_map_cache_entry(fp,inode_id);
+	if (logical_block_index < DIRECT_POINTER_COUNT) return entry->direct[logical_block_index];
+	logical_block_index -= DIRECT_POINTER_COUNT;
+	
+	//blocks_below is the number of data blocks reachable through one pointer at the top of this depth
+	unsigned long long blocks_below = 1;
+	int depth;
+	for (depth=1;depth<=MAX_INDIRECTION_DEPTH;depth++)
+	{
+		if (logical_block_index < blocks_below*POINTERS_PER_BLOCK) break;
+		logical_block_index -= blocks_below*POINTERS_PER_BLOCK;
+		blocks_below *= POINTERS_PER_BLOCK;
+	}
+	if (depth > MAX_INDIRECTION_DEPTH) return 0;
+	
+	struct block_map_node* node = get_block_map_root(fp,entry,depth);
+	while (node && blocks_below > 1)
+	{
+		node = get_block_map_node_child(fp,node,logical_block_index/blocks_below);
+		logical_block_index %= blocks_below;
+		blocks_below /= POINTERS_PER_BLOCK;
+	}
+	if (!node) return 0;
+	return node->pointers[logical_block_index];
+}
+
+//must be called whenever the block pointers of an inode change or the inode is freed
+void invalidate_block_map_cache(FILE* fp, unsigned char inode_id)
+{
+	if (!block_map_cache) return;
+	int i;
+	for (i=0;i<BLOCK_MAP_CACHE_SLOTS;i++)
+	{
+		if (block_map_cache[i].in_use && block_map_cache[i].fp==fp && block_map_cache[i].inode_id==inode_id)
+		{
+			release_block_map_cache_entry(&block_map_cache[i]);
+		}
+	}
+}
+
+//returns the pointer block holding the pointer for logical block logical_block_index of the file, an indirect block
+//at some depth, and sets pointer_index to the pointer's position in it. indirection blocks on the way are created
+//as needed. returns 0 for a direct block, for one beyond the triple indirection block, or when the vdisk has no
+//room for a missing indirection block
+unsigned short find_file_pointer_block(FILE* fp, unsigned char inode_id, unsigned long long logical_block_index, unsigned int* pointer_index)
+{
+	if (logical_block_index < DIRECT_POINTER_COUNT) return 0;
+	logical_block_index -= DIRECT_POINTER_COUNT;
+	unsigned long long blocks_below = 1;
+	int depth;
+	for (depth=1;depth<=MAX_INDIRECTION_DEPTH;depth++)
+	{
+		if (logical_block_index < blocks_below*POINTERS_PER_BLOCK) break;
+		logical_block_index -= blocks_below*POINTERS_PER_BLOCK;
+		blocks_below *= POINTERS_PER_BLOCK;
+	}
+	if (depth > MAX_INDIRECTION_DEPTH)
+	{
+		printf("find_file_pointer_block: logical block is beyond the triple indirection block\n");
+		return 0;
+	}
+	
+	unsigned short inode_address = get_inode_address(fp,inode_id);
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,inode_address,(char*)inode_buffer);
+	unsigned short* top_pointer = &inode_buffer[INODE_INDIRECTION_OFFSETS[depth-1]/2];
+	if (!*top_pointer && (*top_pointer = allocate_empty_block(fp)))
+	{
+		write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+	}
+	unsigned short pointer_block_address = *top_pointer;
+	free(inode_buffer);
+	unsigned short* pointer_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	while (blocks_below > 1 && pointer_block_address)
+	{
+		read_block(fp,pointer_block_address,(char*)pointer_block);
+		unsigned int index = logical_block_index/blocks_below;
+		if (!pointer_block[index] && (pointer_block[index] = allocate_empty_block(fp)))
+		{
+			write_block(fp,pointer_block_address,pointer_block,BYTES_PER_BLOCK);
+		}
+		pointer_block_address = pointer_block[index];
+		logical_block_index %= blocks_below;
+		blocks_below /= POINTERS_PER_BLOCK;
+	}
+	free(pointer_block);
+	*pointer_index = logical_block_index;
+	return pointer_block_address;
+}
+
+//points logical blocks first_logical_block onwards of the file at the count addresses in block_addresses. the
+//inode and each pointer block are read and written once for the whole range. returns how many blocks were mapped,
+//which is less than count only when there was no room for an indirection block
+unsigned int map_file_blocks(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, unsigned short* block_addresses, unsigned int count)
+{
+	invalidate_block_map_cache(fp,inode_id);
+	unsigned int i = 0;
+	if (first_logical_block < DIRECT_POINTER_COUNT)
+	{
+		unsigned short inode_address = get_inode_address(fp,inode_id);
+		unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+		read_block(fp,inode_address,(char*)inode_buffer);
+		for (;i<count && first_logical_block+i<DIRECT_POINTER_COUNT;i++)
+		{
+			inode_buffer[INODE_DIRECT_OFFSET/2+first_logical_block+i] = block_addresses[i];
+		}
+		write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+		free(inode_buffer);
+	}
+	unsigned short* pointer_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	while (i<count)
+	{
+		unsigned int pointer_index;
+		unsigned short pointer_block_address = find_file_pointer_block(fp,inode_id,first_logical_block+i,&pointer_index);
+		if (!pointer_block_address) break;
+		read_block(fp,pointer_block_address,(char*)pointer_block);
+		for (;i<count && pointer_index<POINTERS_PER_BLOCK;i++) pointer_block[pointer_index++] = block_addresses[i];
+		write_block(fp,pointer_block_address,pointer_block,BYTES_PER_BLOCK);
+	}
+	free(pointer_block);
+	return i;
+}
+
+//creates the indirection blocks which logical blocks first_logical_block onwards of the file will need. returns for
+//how many of count blocks they are in place, which is less than count only when the vdisk is full
+unsigned int reserve_file_pointer_blocks(FILE* fp, unsigned char inode_id, unsigned long long first_logical_block, unsigned int count)
+{
+	unsigned long long logical_block_index = first_logical_block;
+	if (logical_block_index < DIRECT_POINTER_COUNT) logical_block_index = DIRECT_POINTER_COUNT;
+	while (logical_block_index < first_logical_block+count)
+	{
+		unsigned int pointer_index;
+		if (!find_file_pointer_block(fp,inode_id,logical_block_index,&pointer_index)) return logical_block_index-first_logical_block;
+		logical_block_index += POINTERS_PER_BLOCK-pointer_index;
+	}
+	return count;
+}
+
+//points logical block logical_block_index of the file at block_address, creating any indirection blocks on the way
+void set_file_block_address(FILE* fp, unsigned char inode_id, unsigned long long logical_block_index, unsigned short block_address)
+{
+	map_file_blocks(fp,inode_id,logical_block_index,&block_address,1);
+}
+
+//reads length bytes starting at byte offset of the file into buffer. returns the number of bytes read,
+//which is short only when the range runs past the end of the file
+size_t read_file_range(FILE* fp, unsigned char inode_id, unsigned long long offset, char* buffer, size_t length)
+{
+	struct block_map_cache_entry* entry = get_block_map_cache_entry(fp,inode_id);
+	if (offset >= entry->size) return 0;
+	if (length > entry->size-offset) length = entry->size-offset;
+	if (entry->flags==FILE_FORMAT_COMPRESSED) return read_compressed_file_range(fp,inode_id,entry->size,offset,buffer,length);
+	
+	char* temp_block = (char*)malloc(BYTES_PER_BLOCK);
+	size_t bytes_read = 0;
+	while (bytes_read < length)
+	{
+		unsigned long long logical_block_index = (offset+bytes_read)/BYTES_PER_BLOCK;
+		size_t block_offset = (offset+bytes_read)%BYTES_PER_BLOCK;
+		size_t chunk = BYTES_PER_BLOCK-block_offset;
+		if (chunk > length-bytes_read) chunk = length-bytes_read;
+		
+		unsigned short block_address = get_file_block_address(fp,inode_id,logical_block_index);
+		if (!block_address)
+		{
+			printf("read_file_range: inode %d has no block for logical block %llu\n",(int)inode_id,logical_block_index);
+			break;
+		}
+		read_block(fp,block_address,temp_block);
+		memcpy(buffer+bytes_read,temp_block+block_offset,chunk);
+		bytes_read += chunk;
+	}
+	free(temp_block);
+	return bytes_read;
+}
+
+//////////////STREAMING READ ENGINE
+/*
+ * Walks the direct pointers and then every level of indirection in order, writing the file
+ * out sequentially. Pointer blocks are loaded through the block map cache, so a download
+ * also warms the cache for later random reads. Before a pointer block is processed, the next
+ * pointer block on the same level and the data blocks it lists are handed to the kernel as
+ * read-ahead hints, so the disk is already busy with them while the current run is copied out.
+ */
+struct read_stream
+{
+	FILE* fp;
+	FILE* fpout;
+	unsigned long long bytes_remaining;
+	char* data_buffer;
+};
+
+void prefetch_block(FILE* fp, unsigned short block_address)
+{
+	if (!block_address) return;
+	posix_fadvise(fileno(fp),(off_t)block_address*BYTES_PER_BLOCK,BYTES_PER_BLOCK,POSIX_FADV_WILLNEED);
+}
+
+//hints the data blocks listed in a last-level pointer block, one hint per contiguous run
+void prefetch_data_blocks(FILE* fp, unsigned short* pointers, unsigned int count)
+{
+	unsigned int run_start = 0;
+	unsigned int i;
+	for (i=1;i<=count;i++)
+	{
+		if (i<count && pointers[i] && pointers[i]==pointers[i-1]+1) continue;
+		if (pointers[run_start])
+		{
+			posix_fadvise(fileno(fp),(off_t)pointers[run_start]*BYTES_PER_BLOCK,(off_t)(i-run_start)*BYTES_PER_BLOCK,POSIX_FADV_WILLNEED);
+		}
+		run_start = i;
+	}
+}
+
+//copies one data block to the output, trimming the last block to the file size
+int stream_data_block(struct read_stream* stream, unsigned short block_address)
+{
+	if (!stream->bytes_remaining) return 0;
+	size_t length = BYTES_PER_BLOCK;
+	if (stream->bytes_remaining < length) length = stream->bytes_remaining;
+	read_block(stream->fp,block_address,stream->data_buffer);
+	fwrite(stream->data_buffer,1,length,stream->fpout);
+	stream->bytes_remaining -= length;
+	return stream->bytes_remaining > 0;
+}
+
+//returns 0 once the whole file has been written out
+int stream_block_map_node(struct read_stream* stream, struct block_map_node* node, int depth)
+{
+	unsigned int i;
+	if (depth==1)
+	{
+		prefetch_data_blocks(stream->fp,node->pointers,POINTERS_PER_BLOCK);
+		for (i=0;i<POINTERS_PER_BLOCK;i++)
+		{
+			if (!stream_data_block(stream,node->pointers[i])) return 0;
+		}
+		return 1;
+	}
+	for (i=0;i<POINTERS_PER_BLOCK;i++)
+	{
+		if (i+1<POINTERS_PER_BLOCK) prefetch_block(stream->fp,node->pointers[i+1]);
+		struct block_map_node* child = get_block_map_node_child(stream->fp,node,i);
+		if (!child)
+		{
+			printf("stream_block_map_node: missing pointer block with %llu bytes left to read\n",stream->bytes_remaining);
+			return 0;
+		}
+		if (!stream_block_map_node(stream,child,depth-1)) return 0;
+	}
+	return 1;
+}
+
+FILE* download_file_from_inode_id(FILE* fp, unsigned char inode_id, char* new_filename)
+{
+	struct block_map_cache_entry* entry = get_block_map_cache_entry(fp,inode_id);
+	FILE* outfile = fopen(new_filename,"wb");
+	if (!outfile)
+	{
+		printf("download_file_from_inode_id: could not open %s\n",new_filename);
+		return NULL;
+	}
+	if (entry->flags==FILE_FORMAT_COMPRESSED)
+	{
+		download_compressed_file(fp,inode_id,entry->size,outfile);
+		return outfile;
+	}
+	
+	struct read_stream stream;
+	stream.fp = fp;
+	stream.fpout = outfile;
+	stream.bytes_remaining = entry->size;
+	stream.data_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	
+	int i;
+	prefetch_data_blocks(fp,entry->direct,DIRECT_POINTER_COUNT);
+	prefetch_block(fp,entry->indirection_blocks[0]);
+	for (i=0;i<DIRECT_POINTER_COUNT && stream.bytes_remaining;i++)
+	{
+		stream_data_block(&stream,entry->direct[i]);
+	}
+	int depth;
+	for (depth=1;depth<=MAX_INDIRECTION_DEPTH && stream.bytes_remaining;depth++)
+	{
+		if (depth<MAX_INDIRECTION_DEPTH) prefetch_block(fp,entry->indirection_blocks[depth]);
+		struct block_map_node* root = get_block_map_root(fp,entry,depth);
+		if (!root)
+		{
+			printf("download_file_from_inode_id: inode %d is missing its level %d indirection block\n",(int)inode_id,depth);
+			break;
+		}
+		stream_block_map_node(&stream,root,depth);
+	}
+	free(stream.data_buffer);
+	return outfile;
+}
+
+FILE* download_file(FILE* fp, char* target_filename, char* new_filename)
+{
+	
+	unsigned char inode_id = find_file_inode_id(fp,target_filename);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		printf("download_file: %s was not found\n",target_filename);
+		return NULL;
+	}
+	FILE* fpout =download_file_from_inode_id(fp,inode_id,new_filename);
+	if (fpout) fclose(fpout);
+	return NULL;
+}
+
+//will return the free block number to which this directory was written to
+unsigned short create_directory_block(FILE* fp, unsigned char parent_inode_id, unsigned char inode_id){
+	unsigned short data_block_num = check_fbv_for_available_block(fp);
+	
+	//16 entries * 32 bytes each
+	//1st byte is the inode id
+	char* this_directory_name = ".";
+	char* parent_directory_name = "..";
+	
+	char* directory_block = (char*)malloc(BYTES_PER_BLOCK);
+	memset(directory_block,0,BYTES_PER_BLOCK);
+	directory_block[32] = (char)parent_inode_id;
+	
+	memcpy((directory_block+1),this_directory_name,1);
+	memcpy((directory_block+33),parent_directory_name,2);
+	
+	directory_block[0]=(char)inode_id;
+	//the rest of the block is the hash index, empty until the first entry is added
+	get_directory_index_header(directory_block)[1] = 1;
+	
+	write_block(fp, data_block_num, (char *)directory_block, DIRECTORY_BYTES);
+	free(directory_block);
+	//reset_fbv_bit(fp, data_block_num);
+	
+//	printf("create_directory_block: creating directory data block  in %u\n",data_block_num);
+	
+	/*
+	((unsigned char*)directory_block)[DIRECTORY_INODE_OFFSET]=(unsigned char)id;
+	strncpy(((char**)directory_block)[DIRECTORY_ENTRY_OFFSET], this_directory_name, 1);
+	((unsigned char*)directory_block)[DIRECTORY_ELEMENT_SIZE+DIRECTORY_INODE_OFFSET] = (unsigned char)parent_id;
+	
+	strncpy(((char**)directory_block)[DIRECTORY_ENTRY_OFFSET+DIRECTORY_ELEMENT_SIZE], parent_directory_name, 2);
+	write_block(fp, block_num,directory_block,BYTES_PER_BLOCK);
+	*/
+	return data_block_num;
+}
+
+void assign_location_to_inode_map(FILE* fp, unsigned short inode_address, unsigned char inode_id)
+{
+	unsigned short* inode_map = malloc(INODE_MAX_NUM*2);
+	read_block(fp, INODE_MAP_OFFSET, (char*)inode_map);
+	//stored as a full 2 byte address, inodes of large files land well above block 255
+	inode_map[inode_id] = inode_address;
+	write_block(fp, INODE_MAP_OFFSET,inode_map,(INODE_MAX_NUM*2));
+	free(inode_map);
+}
+
+
+//////////////DIRECTORIES
+/*
+ * Directories are created in the hashed format (inode byte 33 set to 1):
+ * logical block 0 keeps "." and ".." in its first two slots, and the rest of it is an index
+ * 	bytes 64-65: number of index entries
+ * 	bytes 66-67: number of logical blocks in the directory, including block 0
+ * 	bytes 72-511: up to 55 index entries sorted by hash, each a 4 byte name hash and a 4 byte logical block number
+ * logical blocks 1 and up are leaf blocks:
+ * 	bytes 0-47: the 4 byte name hash of each of the 12 slots, 0 for an empty slot
+ * 	bytes 48-95: the 4 byte size of the file in each slot
+ * 	bytes 96-107: the type of the file in each slot, 'f' or 'd', or 0 if it is not recorded
+ * 	bytes 108-127: reserved
+ * 	bytes 128-511: 12 slots in the usual entry format, 1 byte inode id and 31 bytes of name
+ * The leaf named by index entry i holds the names whose hash falls between entry i and entry i+1. The index
+ * is kept with the inode in the block map cache, so a lookup reads exactly one leaf and compares 4 byte hashes,
+ * touching the name bytes only on a hash hit. A full leaf is split in two at its median hash. There is no second
+ * index level: the 55 leaves hold at least about 330 names, more than the 254 inodes a vdisk has to give out.
+ * Emptied leaves stay, so heavy churn can still fill the index, and adding a name then fails with "directory full".
+ *
+ * The type and size next to each slot let a listing skip the inodes. Every inode records its directory and name,
+ * so whenever a size changes the entry can be found and updated. A size that does not fit in 4 bytes, or an
+ * entry written before these fields existed, is stored with type 0 and is read from the inode instead.
+ *
+ * Directories from older disks are a single linear block of 16 slots (".", ".." and 14 entries) without hashes.
+ * They are still read, and are converted to the hashed format the first time an entry is added.
+ * Directories can also be created sorted, see SORTED DIRECTORIES below.
+ */
+unsigned int hash_file_name(char* name)
+{
+	//FNV-1a over the part of the name that is actually stored
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i=0;i<DIRECTORY_NAME_MAX && name[i];i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+unsigned int* get_directory_leaf_hashes(char* leaf_block)
+{
+	return (unsigned int*)leaf_block;
+}
+
+char* get_directory_leaf_slot(char* leaf_block, int slot)
+{
+	return leaf_block+DIRECTORY_LEAF_SLOTS_OFFSET+slot*DIRECTORY_ELEMENT_SIZE;
+}
+
+unsigned int* get_directory_leaf_sizes(char* leaf_block)
+{
+	return (unsigned int*)(leaf_block+DIRECTORY_LEAF_SIZES_OFFSET);
+}
+
+char* get_directory_leaf_types(char* leaf_block)
+{
+	return leaf_block+DIRECTORY_LEAF_TYPES_OFFSET;
+}
+
+void set_directory_leaf_attributes(char* leaf_block, int slot, char type, unsigned long long size)
+{
+	if (size > 0xFFFFFFFFull) type = 0;
+	get_directory_leaf_types(leaf_block)[slot] = type;
+	get_directory_leaf_sizes(leaf_block)[slot] = type ? (unsigned int)size : 0;
+}
+
+//returns the slot holding name within a leaf block, or -1
+int find_slot_in_directory_leaf(char* leaf_block, char* name, unsigned int hash)
+{
+	unsigned int* hashes = get_directory_leaf_hashes(leaf_block);
+	int i;
+	for (i=0;i<DIRECTORY_LEAF_SLOTS;i++)
+	{
+		if (hashes[i]!=hash) continue;
+		char* slot_name = get_directory_leaf_slot(leaf_block,i)+DIRECTORY_ENTRY_OFFSET;
+		if (slot_name[0] && !strncmp(name,slot_name,DIRECTORY_ELEMENT_SIZE-1)) return i;
+	}
+	return -1;
+}
+
+int find_free_slot_in_directory_leaf(char* leaf_block)
+{
+	int i;
+	for (i=0;i<DIRECTORY_LEAF_SLOTS;i++)
+	{
+		if (!get_directory_leaf_slot(leaf_block,i)[DIRECTORY_ENTRY_OFFSET]) return i;
+	}
+	return -1;
+}
+
+void write_directory_leaf_slot(char* leaf_block, int slot, unsigned char inode_id, char* name, unsigned int hash, char type, unsigned long long size)
+{
+	char* entry = get_directory_leaf_slot(leaf_block,slot);
+	memset(entry,0,DIRECTORY_ELEMENT_SIZE);
+	entry[DIRECTORY_INODE_OFFSET] = inode_id;
+	strncpy(entry+DIRECTORY_ENTRY_OFFSET,name,DIRECTORY_NAME_MAX);
+	get_directory_leaf_hashes(leaf_block)[slot] = hash;
+	set_directory_leaf_attributes(leaf_block,slot,type,size);
+}
+
+void clear_directory_leaf_slot(char* leaf_block, int slot)
+{
+	memset(get_directory_leaf_slot(leaf_block,slot),0,DIRECTORY_ELEMENT_SIZE);
+	get_directory_leaf_hashes(leaf_block)[slot] = 0;
+	set_directory_leaf_attributes(leaf_block,slot,0,0);
+}
+
+//returns the slot holding name within a linear directory block, or -1
+int find_slot_in_linear_directory_block(char* block, char* name)
+{
+	int i;
+	for (i=2;i<DIRECTORY_SLOTS_PER_BLOCK;i++)
+	{
+		char* slot_name = block+i*DIRECTORY_ELEMENT_SIZE+DIRECTORY_ENTRY_OFFSET;
+		if (slot_name[0] && !strncmp(name,slot_name,DIRECTORY_ELEMENT_SIZE-1)) return i;
+	}
+	return -1;
+}
+
+unsigned short* get_directory_index_header(char* root_block)
+{
+	return (unsigned short*)(root_block+DIRECTORY_INDEX_HEADER_OFFSET);
+}
+
+//entry[0] is the lowest hash in the leaf's range, entry[1] the leaf's logical block number
+unsigned int* get_directory_index_entry(char* root_block, int position)
+{
+	return (unsigned int*)(root_block+DIRECTORY_INDEX_ENTRIES_OFFSET+position*DIRECTORY_INDEX_ENTRY_SIZE);
+}
+
+//returns the position of the index entry whose hash range contains hash, or -1 if the directory has no leaves yet.
+//entry 0 always starts at hash 0
+int find_directory_index_position(char* root_block, unsigned int hash)
+{
+	int low = 0;
+	int high = get_directory_index_header(root_block)[0]-1;
+	while (low < high)
+	{
+		int middle = (low+high+1)/2;
+		if (get_directory_index_entry(root_block,middle)[0] <= hash) low = middle;
+		else high = middle-1;
+	}
+	return high<0 ? -1 : low;
+}
+
+unsigned char get_directory_format(FILE* fp, unsigned char directory_inode_id)
+{
+	return get_block_map_cache_entry(fp,directory_inode_id)->flags;
+}
+
+//returns the cached copy of block 0 of a hashed directory, reading it the first time
+char* get_directory_index(FILE* fp, unsigned char directory_inode_id)
+{
+	struct block_map_cache_entry* entry = get_block_map_cache_entry(fp,directory_inode_id);
+	if (!entry->directory_index)
+	{
+		entry->directory_index = (char*)malloc(BYTES_PER_BLOCK);
+		read_block(fp,entry->direct[0],entry->directory_index);
+	}
+	return entry->directory_index;
+}
+
+//records the directory format and its size in blocks in the directory's inode. this also drops the cached index,
+//so it must follow every write to block 0
+void update_directory_inode(FILE* fp, unsigned char directory_inode_id, unsigned char format, unsigned int block_count)
+{
+	unsigned short inode_address = get_inode_address(fp,directory_inode_id);
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,inode_address,(char*)inode_buffer);
+	((unsigned char*)inode_buffer)[INODE_FLAGS_OFFSET] = format;
+	set_inode_size(inode_buffer,(unsigned long long)block_count*DIRECTORY_BYTES);
+	write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+	free(inode_buffer);
+	invalidate_block_map_cache(fp,directory_inode_id);
+	update_directory_entry_attributes(fp,directory_inode_id);
+}
+
+//records in the inode of element_inode_id which directory holds it and under what name, and returns its type and size
+void link_inode_to_directory(FILE* fp, unsigned char element_inode_id, unsigned char directory_inode_id, char* element_file_name,
+							char* type, unsigned long long* size)
+{
+	unsigned short inode_address = get_inode_address(fp,element_inode_id);
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,inode_address,(char*)inode_buffer);
+	char* inode_bytes = (char*)inode_buffer;
+	inode_bytes[INODE_PARENT_OFFSET] = directory_inode_id;
+	memset(inode_bytes+INODE_NAME_OFFSET,0,DIRECTORY_ELEMENT_SIZE-1);
+	strncpy(inode_bytes+INODE_NAME_OFFSET,element_file_name,DIRECTORY_NAME_MAX);
+	write_block(fp,inode_address,inode_buffer,INODE_BYTES);
+	*type = (char)((int*)inode_buffer)[1];
+	*size = get_inode_size(inode_buffer);
+	free(inode_buffer);
+}
+
+//copies the current type and size of a file from its inode to its entry in the directory holding it
+void update_directory_entry_attributes(FILE* fp, unsigned char inode_id)
+{
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_inode_address(fp,inode_id),(char*)inode_buffer);
+	char* inode_bytes = (char*)inode_buffer;
+	unsigned char directory_inode_id = (unsigned char)inode_bytes[INODE_PARENT_OFFSET];
+	char name[31];
+	memcpy(name,inode_bytes+INODE_NAME_OFFSET,DIRECTORY_ELEMENT_SIZE-1);
+	name[DIRECTORY_ELEMENT_SIZE-2] = 0;
+	char type = (char)((int*)inode_buffer)[1];
+	unsigned long long size = get_inode_size(inode_buffer);
+	free(inode_buffer);
+	if (!name[0] || get_directory_format(fp,directory_inode_id)==DIRECTORY_FORMAT_LINEAR) return;
+	
+	char* leaf_block = (char*)malloc(BYTES_PER_BLOCK);
+	unsigned int hash = hash_file_name(name);
+	unsigned short leaf_address = load_directory_leaf_for_entry(fp,directory_inode_id,name,leaf_block);
+	int slot = leaf_address ? find_slot_in_directory_leaf(leaf_block,name,hash) : -1;
+	if (slot>=0 && (unsigned char)get_directory_leaf_slot(leaf_block,slot)[DIRECTORY_INODE_OFFSET]==inode_id)
+	{
+		set_directory_leaf_attributes(leaf_block,slot,type,size);
+		write_block(fp,leaf_address,leaf_block,BYTES_PER_BLOCK);
+	}
+	free(leaf_block);
+}
+
+//reads the leaf which holds, or would hold, name into leaf_block and returns its address. 0 if there are no leaves yet
+unsigned short load_directory_leaf_for_name(FILE* fp, unsigned char directory_inode_id, unsigned int hash, char* leaf_block)
+{
+	char* root_block = get_directory_index(fp,directory_inode_id);
+	int position = find_directory_index_position(root_block,hash);
+	if (position<0) return 0;
+	unsigned short leaf_address = get_file_block_address(fp,directory_inode_id,get_directory_index_entry(root_block,position)[1]);
+	read_block(fp,leaf_address,leaf_block);
+	return leaf_address;
+}
+
+//reads the leaf of a hashed or sorted directory which holds name, or would, and returns its address.
+//returns 0 if the directory has no leaves yet
+unsigned short load_directory_leaf_for_entry(FILE* fp, unsigned char directory_inode_id, char* name, char* leaf_block)
+{
+	if (get_directory_format(fp,directory_inode_id)==DIRECTORY_FORMAT_SORTED)
+	{
+		return load_btree_leaf_for_name(fp,directory_inode_id,name,leaf_block);
+	}
+	return load_directory_leaf_for_name(fp,directory_inode_id,hash_file_name(name),leaf_block);
+}
+
+//returns the inode id of name in the directory, or -1 if there is no such entry
+int find_directory_entry(FILE* fp, unsigned char directory_inode_id, char* name)
+{
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	int inode_id = -1;
+	int slot;
+	if (get_directory_format(fp,directory_inode_id)!=DIRECTORY_FORMAT_LINEAR)
+	{
+		unsigned int hash = hash_file_name(name);
+		if (load_directory_leaf_for_entry(fp,directory_inode_id,name,block_buffer))
+		{
+			slot = find_slot_in_directory_leaf(block_buffer,name,hash);
+			if (slot>=0) inode_id = (unsigned char)get_directory_leaf_slot(block_buffer,slot)[DIRECTORY_INODE_OFFSET];
+		}
+	}
+	else
+	{
+		read_block(fp,get_file_block_address(fp,directory_inode_id,0),block_buffer);
+		slot = find_slot_in_linear_directory_block(block_buffer,name);
+		if (slot>=0) inode_id = (unsigned char)block_buffer[slot*DIRECTORY_ELEMENT_SIZE+DIRECTORY_INODE_OFFSET];
+	}
+	free(block_buffer);
+	return inode_id;
+}
+
+//allocates a zeroed block as logical block logical_block_index of the directory and returns its address
+unsigned short append_directory_block(FILE* fp, unsigned char directory_inode_id, unsigned int logical_block_index)
+{
+	unsigned short block_address = allocate_empty_block(fp);
+	set_file_block_address(fp,directory_inode_id,logical_block_index,block_address);
+	return block_address;
+}
+
+//adds a new leaf covering hashes from lowest_hash up to the next index entry, after index position position
+unsigned short add_directory_leaf(FILE* fp, unsigned char directory_inode_id, int position, unsigned int lowest_hash)
+{
+	unsigned short root_address = get_file_block_address(fp,directory_inode_id,0);
+	char* root_block = (char*)malloc(BYTES_PER_BLOCK);
+	memcpy(root_block,get_directory_index(fp,directory_inode_id),BYTES_PER_BLOCK);
+	unsigned short* header = get_directory_index_header(root_block);
+	
+	unsigned short new_logical_block = header[1];
+	unsigned short leaf_address = append_directory_block(fp,directory_inode_id,new_logical_block);
+	memmove(get_directory_index_entry(root_block,position+2),get_directory_index_entry(root_block,position+1),
+			(header[0]-position-1)*DIRECTORY_INDEX_ENTRY_SIZE);
+	get_directory_index_entry(root_block,position+1)[0] = lowest_hash;
+	get_directory_index_entry(root_block,position+1)[1] = new_logical_block;
+	header[0]++;
+	header[1]++;
+	write_block(fp,root_address,root_block,BYTES_PER_BLOCK);
+	update_directory_inode(fp,directory_inode_id,DIRECTORY_FORMAT_HASHED,header[1]);
+	free(root_block);
+	return leaf_address;
+}
+
+//splits the full leaf at index position into two leaves and adds the new element to whichever half it belongs in
+int split_directory_leaf(FILE* fp, unsigned char directory_inode_id, int position, char* leaf_block, unsigned short leaf_address,
+						unsigned char element_inode_id, char* element_file_name, unsigned int hash, char type, unsigned long long size)
+{
+	if (get_directory_index_header(get_directory_index(fp,directory_inode_id))[0] >= DIRECTORY_INDEX_MAX_ENTRIES)
+	{
+		printf("directory full!!\n");
+		return -1;
+	}
+	
+	//sort the existing entries plus the new one by hash
+	int total = DIRECTORY_LEAF_SLOTS+1;
+	char* entries = (char*)malloc(total*DIRECTORY_ELEMENT_SIZE);
+	unsigned int* hashes = (unsigned int*)malloc(total*sizeof(unsigned int));
+	memcpy(entries,get_directory_leaf_slot(leaf_block,0),DIRECTORY_LEAF_SLOTS*DIRECTORY_ELEMENT_SIZE);
+	memcpy(hashes,get_directory_leaf_hashes(leaf_block),DIRECTORY_LEAF_SLOTS*sizeof(unsigned int));
+	memset(entries+DIRECTORY_LEAF_SLOTS*DIRECTORY_ELEMENT_SIZE,0,DIRECTORY_ELEMENT_SIZE);
+	entries[DIRECTORY_LEAF_SLOTS*DIRECTORY_ELEMENT_SIZE+DIRECTORY_INODE_OFFSET] = element_inode_id;
+	strncpy(entries+DIRECTORY_LEAF_SLOTS*DIRECTORY_ELEMENT_SIZE+DIRECTORY_ENTRY_OFFSET,element_file_name,DIRECTORY_NAME_MAX);
+	hashes[DIRECTORY_LEAF_SLOTS] = hash;
+	unsigned int sizes[13];
+	char types[13];
+	memcpy(sizes,get_directory_leaf_sizes(leaf_block),DIRECTORY_LEAF_SLOTS*sizeof(unsigned int));
+	memcpy(types,get_directory_leaf_types(leaf_block),DIRECTORY_LEAF_SLOTS);
+	types[DIRECTORY_LEAF_SLOTS] = size > 0xFFFFFFFFull ? 0 : type;
+	sizes[DIRECTORY_LEAF_SLOTS] = types[DIRECTORY_LEAF_SLOTS] ? (unsigned int)size : 0;
+	
+	char* temp_entry = (char*)malloc(DIRECTORY_ELEMENT_SIZE);
+	int i,j;
+	for (i=1;i<total;i++)
+	{
+		unsigned int temp_hash = hashes[i];
+		unsigned int temp_size = sizes[i];
+		char temp_type = types[i];
+		memcpy(temp_entry,entries+i*DIRECTORY_ELEMENT_SIZE,DIRECTORY_ELEMENT_SIZE);
+		for (j=i;j>0 && hashes[j-1]>temp_hash;j--)
+		{
+			hashes[j] = hashes[j-1];
+			sizes[j] = sizes[j-1];
+			types[j] = types[j-1];
+			memcpy(entries+j*DIRECTORY_ELEMENT_SIZE,entries+(j-1)*DIRECTORY_ELEMENT_SIZE,DIRECTORY_ELEMENT_SIZE);
+		}
+		hashes[j] = temp_hash;
+		sizes[j] = temp_size;
+		types[j] = temp_type;
+		memcpy(entries+j*DIRECTORY_ELEMENT_SIZE,temp_entry,DIRECTORY_ELEMENT_SIZE);
+	}
+	free(temp_entry);
+	
+	//split as close to the middle as possible without separating names that share a hash
+	int split = -1;
+	for (i=0;i<=total/2 && split<0;i++)
+	{
+		if (total/2+i<total && hashes[total/2+i]!=hashes[total/2+i-1]) split = total/2+i;
+		else if (total/2-i>0 && hashes[total/2-i]!=hashes[total/2-i-1]) split = total/2-i;
+	}
+	if (split<0)
+	{
+		printf("directory full!! too many names share one hash\n");
+		free(entries);
+		free(hashes);
+		return -1;
+	}
+	
+	//the new leaf takes over the upper part of the old leaf's hash range
+	unsigned short new_leaf_address = add_directory_leaf(fp,directory_inode_id,position,hashes[split]);
+	char* new_leaf_block = (char*)malloc(BYTES_PER_BLOCK);
+	memset(new_leaf_block,0,BYTES_PER_BLOCK);
+	memset(leaf_block,0,BYTES_PER_BLOCK);
+	for (i=0;i<total;i++)
+	{
+		char* target = i<split ? leaf_block : new_leaf_block;
+		int slot = i<split ? i : i-split;
+		memcpy(get_directory_leaf_slot(target,slot),entries+i*DIRECTORY_ELEMENT_SIZE,DIRECTORY_ELEMENT_SIZE);
+		get_directory_leaf_hashes(target)[slot] = hashes[i];
+		get_directory_leaf_sizes(target)[slot] = sizes[i];
+		get_directory_leaf_types(target)[slot] = types[i];
+	}
+	write_block(fp,leaf_address,leaf_block,BYTES_PER_BLOCK);
+	write_block(fp,new_leaf_address,new_leaf_block,BYTES_PER_BLOCK);
+	
+	free(new_leaf_block);
+	free(entries);
+	free(hashes);
+	return 0;
+}
+
+int add_element_to_hashed_directory(FILE* fp, unsigned char directory_inode_id, unsigned char element_inode_id, char* element_file_name)
+{
+	char type;
+	unsigned long long size;
+	link_inode_to_directory(fp,element_inode_id,directory_inode_id,element_file_name,&type,&size);
+	unsigned int hash = hash_file_name(element_file_name);
+	char* leaf_block = (char*)malloc(BYTES_PER_BLOCK);
+	unsigned short leaf_address = load_directory_leaf_for_name(fp,directory_inode_id,hash,leaf_block);
+	if (!leaf_address)
+	{//first entry of the directory, the first leaf covers every hash
+		leaf_address = add_directory_leaf(fp,directory_inode_id,-1,0);
+		memset(leaf_block,0,BYTES_PER_BLOCK);
+	}
+	
+	int result = 0;
+	int slot = find_free_slot_in_directory_leaf(leaf_block);
+	if (slot>=0)
+	{
+		write_directory_leaf_slot(leaf_block,slot,element_inode_id,element_file_name,hash,type,size);
+		write_block(fp,leaf_address,leaf_block,BYTES_PER_BLOCK);
+	}
+	else
+	{
+		int position = find_directory_index_position(get_directory_index(fp,directory_inode_id),hash);
+		result = split_directory_leaf(fp,directory_inode_id,position,leaf_block,leaf_address,element_inode_id,element_file_name,hash,type,size);
+	}
+	free(leaf_block);
+	return result;
+}
+
+//turns the linear block of an older directory into an empty index and adds its entries back through the index
+void convert_directory_to_hashed(FILE* fp, unsigned char directory_inode_id)
+{
+	unsigned short root_address = get_file_block_address(fp,directory_inode_id,0);
+	char* root_block = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,root_address,root_block);
+	char* old_entries = (char*)malloc(BYTES_PER_BLOCK);
+	memcpy(old_entries,root_block,BYTES_PER_BLOCK);
+	
+	memset(root_block+DIRECTORY_INDEX_HEADER_OFFSET,0,BYTES_PER_BLOCK-DIRECTORY_INDEX_HEADER_OFFSET);
+	get_directory_index_header(root_block)[1] = 1;
+	write_block(fp,root_address,root_block,BYTES_PER_BLOCK);
+	update_directory_inode(fp,directory_inode_id,DIRECTORY_FORMAT_HASHED,1);
+	
+	int i;
+	for (i=2;i<DIRECTORY_SLOTS_PER_BLOCK;i++)
+	{
+		char* entry = old_entries+i*DIRECTORY_ELEMENT_SIZE;
+		if (!entry[DIRECTORY_ENTRY_OFFSET]) continue;
+		entry[DIRECTORY_ELEMENT_SIZE-1] = 0;
+		add_element_to_hashed_directory(fp,directory_inode_id,(unsigned char)entry[DIRECTORY_INODE_OFFSET],entry+DIRECTORY_ENTRY_OFFSET);
+	}
+	free(old_entries);
+	free(root_block);
+}
+
+unsigned short add_element_to_directory(FILE* fp, unsigned char directory_inode_id, unsigned char element_inode_id, char* element_file_name)
+{
+	if (strlen(element_file_name)>DIRECTORY_NAME_MAX)
+	{
+		printf("add_element_to_directory: file name %s is longer than %d characters\n",element_file_name,(int)DIRECTORY_NAME_MAX);
+		return -1;
+	}
+	unsigned char format = get_directory_format(fp,directory_inode_id);
+	if (format==DIRECTORY_FORMAT_LINEAR)
+	{
+		convert_directory_to_hashed(fp,directory_inode_id);
+	}
+	remove_dentry_cache(fp,directory_inode_id,element_file_name);
+	if (format==DIRECTORY_FORMAT_SORTED)
+	{
+		if (add_element_to_sorted_directory(fp,directory_inode_id,element_inode_id,element_file_name)) return -1;
+	}
+	else if (add_element_to_hashed_directory(fp,directory_inode_id,element_inode_id,element_file_name)) return -1;
+	insert_dentry_cache(fp,directory_inode_id,element_file_name,element_inode_id);
+	add_to_name_filter(fp,directory_inode_id,element_file_name);
+	invalidate_negative_path_cache();
+	return 0;
+}
+
+//returns 0 if the entry was removed, -1 if the directory has no such entry
+int delete_directory_entry(FILE* fp, unsigned char directory_inode_id, char* removal_filename)
+{
+	remove_dentry_cache(fp,directory_inode_id,removal_filename);
+	invalidate_path_cache();
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	int slot = -1;
+	unsigned char format = get_directory_format(fp,directory_inode_id);
+	if (format!=DIRECTORY_FORMAT_LINEAR)
+	{
+		unsigned int hash = hash_file_name(removal_filename);
+		unsigned short leaf_address = load_directory_leaf_for_entry(fp,directory_inode_id,removal_filename,block_buffer);
+		if (leaf_address) slot = find_slot_in_directory_leaf(block_buffer,removal_filename,hash);
+		if (slot>=0)
+		{
+			//sorted leaves keep their names packed at the front
+			if (format==DIRECTORY_FORMAT_SORTED) remove_btree_leaf_slot(block_buffer,slot);
+			else clear_directory_leaf_slot(block_buffer,slot);
+			write_block(fp,leaf_address,block_buffer,BYTES_PER_BLOCK);
+		}
+	}
+	else
+	{
+		unsigned short block_address = get_file_block_address(fp,directory_inode_id,0);
+		read_block(fp,block_address,block_buffer);
+		slot = find_slot_in_linear_directory_block(block_buffer,removal_filename);
+		if (slot>=0)
+		{
+			memset(block_buffer+slot*DIRECTORY_ELEMENT_SIZE,0,DIRECTORY_ELEMENT_SIZE);
+			write_block(fp,block_address,block_buffer,BYTES_PER_BLOCK);
+		}
+	}
+	free(block_buffer);
+	//whether or not it was there before, the name is known to be missing now
+	insert_dentry_cache(fp,directory_inode_id,removal_filename,INODE_NOT_FOUND);
+	return slot>=0 ? 0 : -1;
+}
+
+int directory_is_empty(FILE* fp, unsigned char directory_inode_id)
+{
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	int empty = 1;
+	int i;
+	if (get_directory_format(fp,directory_inode_id)==DIRECTORY_FORMAT_SORTED)
+	{//leaves can be left empty by deletes, so every one has to be looked at
+		unsigned short leaf_address = load_btree_leaf_for_name(fp,directory_inode_id,"",block_buffer);
+		while (leaf_address && empty)
+		{
+			if (get_btree_leaf_header(block_buffer)[0]) empty = 0;
+			leaf_address = load_next_btree_leaf(fp,directory_inode_id,block_buffer);
+		}
+		free(block_buffer);
+		return empty;
+	}
+	if (get_directory_format(fp,directory_inode_id)!=DIRECTORY_FORMAT_HASHED)
+	{
+		read_block(fp,get_file_block_address(fp,directory_inode_id,0),block_buffer);
+		for (i=2;i<DIRECTORY_SLOTS_PER_BLOCK;i++) if (block_buffer[i*DIRECTORY_ELEMENT_SIZE+DIRECTORY_ENTRY_OFFSET]) empty = 0;
+		free(block_buffer);
+		return empty;
+	}
+	
+	char* root_block = get_directory_index(fp,directory_inode_id);
+	int position;
+	for (position=0;position<get_directory_index_header(root_block)[0] && empty;position++)
+	{
+		unsigned int leaf_logical_block = get_directory_index_entry(root_block,position)[1];
+		read_block(fp,get_file_block_address(fp,directory_inode_id,leaf_logical_block),block_buffer);
+		for (i=0;i<DIRECTORY_LEAF_SLOTS;i++) if (get_directory_leaf_slot(block_buffer,i)[DIRECTORY_ENTRY_OFFSET]) empty = 0;
+	}
+	free(block_buffer);
+	return empty;
+}
+
+
+
+//////////////SORTED DIRECTORIES
+/*
+ * Sorted directories (inode byte 33 set to 2) keep their names in a B+tree ordered by name, so a listing which
+ * starts at a name or a prefix reads one node per level to find its first leaf and then only the leaves it returns.
+ * logical block 0 keeps "." and ".." in its first two slots, and the header of the tree
+ * 	bytes 64-65: logical block of the root node, 0 while the directory is empty
+ * 	bytes 66-67: number of logical blocks in the directory, including block 0
+ * 	bytes 68-69: height of the tree, 1 while the root is a leaf
+ * leaves use the layout of hashed directory leaves, with the names sorted in slots 0 to count-1 and
+ * 	bytes 108-109: number of names in the leaf
+ * 	bytes 110-111: logical block of the next leaf in name order, 0 after the last one
+ * interior nodes:
+ * 	bytes 0-1: number of children
+ * 	bytes 16-495: up to 15 children, each a 2 byte logical block and the lowest 30 byte name under it.
+ * 	the name of the first child is never compared, that child covers everything below the second
+ * Removing names never merges nodes, so a leaf may stay empty until the directory is deleted.
+ */
+const size_t BTREE_LEAF_HEADER_OFFSET=108;
+const size_t BTREE_INTERIOR_ENTRIES_OFFSET=16;
+const size_t BTREE_INTERIOR_MAX_ENTRIES=15;
+const size_t BTREE_KEY_OFFSET=2;
+
+int compare_directory_names(char* a, char* b)
+{
+	return strncmp(a,b,DIRECTORY_NAME_MAX);
+}
+
+//[0] is the number of names in the leaf, [1] the logical block of the next leaf
+unsigned short* get_btree_leaf_header(char* leaf_block)
+{
+	return (unsigned short*)(leaf_block+BTREE_LEAF_HEADER_OFFSET);
+}
+
+char* get_btree_child(char* node, int position)
+{
+	return node+BTREE_INTERIOR_ENTRIES_OFFSET+position*DIRECTORY_ELEMENT_SIZE;
+}
+
+unsigned short get_btree_child_block(char* node, int position)
+{
+	return *(unsigned short*)get_btree_child(node,position);
+}
+
+void set_btree_child(char* node, int position, unsigned short child_logical_block, char* key)
+{
+	char* child = get_btree_child(node,position);
+	memset(child,0,DIRECTORY_ELEMENT_SIZE);
+	*(unsigned short*)child = child_logical_block;
+	strncpy(child+BTREE_KEY_OFFSET,key,DIRECTORY_NAME_MAX);
+}
+
+//returns the position of the child of an interior node whose names include name
+int find_btree_child(char* node, char* name)
+{
+	int low = 0;
+	int high = ((unsigned short*)node)[0]-1;
+	while (low<high)
+	{//the last child whose key is not above name
+		int middle = (low+high+1)/2;
+		if (compare_directory_names(get_btree_child(node,middle)+BTREE_KEY_OFFSET,name)<=0) low = middle;
+		else high = middle-1;
+	}
+	return low;
+}
+
+void move_directory_leaf_slot(char* to_block, int to_slot, char* from_block, int from_slot)
+{
+	memcpy(get_directory_leaf_slot(to_block,to_slot),get_directory_leaf_slot(from_block,from_slot),DIRECTORY_ELEMENT_SIZE);
+	get_directory_leaf_hashes(to_block)[to_slot] = get_directory_leaf_hashes(from_block)[from_slot];
+	get_directory_leaf_sizes(to_block)[to_slot] = get_directory_leaf_sizes(from_block)[from_slot];
+	get_directory_leaf_types(to_block)[to_slot] = get_directory_leaf_types(from_block)[from_slot];
+}
+
+//reads the leaf where name is, or would go, into leaf_block and returns its address, or 0 if the tree is empty
+unsigned short load_btree_leaf_for_name(FILE* fp, unsigned char directory_inode_id, char* name, char* leaf_block)
+{
+	unsigned short* header = get_directory_index_header(get_directory_index(fp,directory_inode_id));
+	unsigned short node_logical_block = header[0];
+	int height = header[2];
+	if (!node_logical_block) return 0;
+	int level;
+	for (level=height-1;level>0;level--)
+	{
+		read_block(fp,get_file_block_address(fp,directory_inode_id,node_logical_block),leaf_block);
+		node_logical_block = get_btree_child_block(leaf_block,find_btree_child(leaf_block,name));
+	}
+	unsigned short leaf_address = get_file_block_address(fp,directory_inode_id,node_logical_block);
+	read_block(fp,leaf_address,leaf_block);
+	return leaf_address;
+}
+
+//reads the leaf after leaf_block into it and returns its address, or 0 after the last leaf
+unsigned short load_next_btree_leaf(FILE* fp, unsigned char directory_inode_id, char* leaf_block)
+{
+	unsigned short next_logical_block = get_btree_leaf_header(leaf_block)[1];
+	if (!next_logical_block) return 0;
+	unsigned short leaf_address = get_file_block_address(fp,directory_inode_id,next_logical_block);
+	read_block(fp,leaf_address,leaf_block);
+	return leaf_address;
+}
+
+//writes a new root and height into block 0 of the directory
+void set_btree_root(FILE* fp, unsigned char directory_inode_id, unsigned short root_logical_block, unsigned short height)
+{
+	unsigned short root_address = get_file_block_address(fp,directory_inode_id,0);
+	char* root_block = (char*)malloc(BYTES_PER_BLOCK);
+	memcpy(root_block,get_directory_index(fp,directory_inode_id),BYTES_PER_BLOCK);
+	unsigned short* header = get_directory_index_header(root_block);
+	header[0] = root_logical_block;
+	header[2] = height;
+	write_block(fp,root_address,root_block,BYTES_PER_BLOCK);
+	update_directory_inode(fp,directory_inode_id,DIRECTORY_FORMAT_SORTED,header[1]);
+	free(root_block);
+}
+
+//appends a zeroed node to the directory and returns its logical block
+unsigned short allocate_btree_node(FILE* fp, unsigned char directory_inode_id)
+{
+	unsigned short node_logical_block = get_directory_index_header(get_directory_index(fp,directory_inode_id))[1];
+	append_directory_block(fp,directory_inode_id,node_logical_block);
+	
+	unsigned short root_address = get_file_block_address(fp,directory_inode_id,0);
+	char* root_block = (char*)malloc(BYTES_PER_BLOCK);
+	memcpy(root_block,get_directory_index(fp,directory_inode_id),BYTES_PER_BLOCK);
+	get_directory_index_header(root_block)[1] = node_logical_block+1;
+	write_block(fp,root_address,root_block,BYTES_PER_BLOCK);
+	update_directory_inode(fp,directory_inode_id,DIRECTORY_FORMAT_SORTED,node_logical_block+1);
+	free(root_block);
+	return node_logical_block;
+}
+
+void insert_into_btree_leaf_slot(char* leaf_block, int position, unsigned char element_inode_id, char* element_file_name,
+								char type, unsigned long long size)
+{
+	unsigned short* leaf_header = get_btree_leaf_header(leaf_block);
+	int i;
+	for (i=leaf_header[0];i>position;i--) move_directory_leaf_slot(leaf_block,i,leaf_block,i-1);
+	write_directory_leaf_slot(leaf_block,position,element_inode_id,element_file_name,hash_file_name(element_file_name),type,size);
+	leaf_header[0]++;
+}
+
+void remove_btree_leaf_slot(char* leaf_block, int slot)
+{
+	unsigned short* leaf_header = get_btree_leaf_header(leaf_block);
+	int i;
+	for (i=slot;i<leaf_header[0]-1;i++) move_directory_leaf_slot(leaf_block,i,leaf_block,i+1);
+	clear_directory_leaf_slot(leaf_block,leaf_header[0]-1);
+	leaf_header[0]--;
+}
+
+//adds the element to a leaf. a full leaf moves its upper half to a new leaf linked in after it,
+//and returns 1 with the new leaf and its lowest name in split_child and split_key
+int insert_into_btree_leaf(FILE* fp, unsigned char directory_inode_id, char* leaf_block, unsigned short leaf_address,
+						unsigned char element_inode_id, char* element_file_name, char type, unsigned long long size,
+						unsigned short* split_child, char* split_key)
+{
+	unsigned short* leaf_header = get_btree_leaf_header(leaf_block);
+	int position = 0;
+	while (position<leaf_header[0] && compare_directory_names(get_directory_leaf_slot(leaf_block,position)+DIRECTORY_ENTRY_OFFSET,element_file_name)<0)
+	{
+		position++;
+	}
+	if (leaf_header[0]<DIRECTORY_LEAF_SLOTS)
+	{
+		insert_into_btree_leaf_slot(leaf_block,position,element_inode_id,element_file_name,type,size);
+		write_block(fp,leaf_address,leaf_block,BYTES_PER_BLOCK);
+		return 0;
+	}
+	
+	unsigned short new_leaf_logical_block = allocate_btree_node(fp,directory_inode_id);
+	char* new_leaf_block = (char*)malloc(BYTES_PER_BLOCK);
+	memset(new_leaf_block,0,BYTES_PER_BLOCK);
+	int half = DIRECTORY_LEAF_SLOTS/2;
+	int i;
+	for (i=half;i<DIRECTORY_LEAF_SLOTS;i++)
+	{
+		move_directory_leaf_slot(new_leaf_block,i-half,leaf_block,i);
+		clear_directory_leaf_slot(leaf_block,i);
+	}
+	unsigned short* new_leaf_header = get_btree_leaf_header(new_leaf_block);
+	new_leaf_header[0] = DIRECTORY_LEAF_SLOTS-half;
+	new_leaf_header[1] = leaf_header[1];
+	leaf_header[0] = half;
+	leaf_header[1] = new_leaf_logical_block;
+	if (position<=half) insert_into_btree_leaf_slot(leaf_block,position,element_inode_id,element_file_name,type,size);
+	else insert_into_btree_leaf_slot(new_leaf_block,position-half,element_inode_id,element_file_name,type,size);
+	
+	write_block(fp,leaf_address,leaf_block,BYTES_PER_BLOCK);
+	write_block(fp,get_file_block_address(fp,directory_inode_id,new_leaf_logical_block),new_leaf_block,BYTES_PER_BLOCK);
+	*split_child = new_leaf_logical_block;
+	memcpy(split_key,get_directory_leaf_slot(new_leaf_block,0)+DIRECTORY_ENTRY_OFFSET,DIRECTORY_ELEMENT_SIZE-1);
+	free(new_leaf_block);
+	return 1;
+}
+
+//adds a child at position in an interior node, splitting the node in two like insert_into_btree_leaf() when it is full
+int insert_btree_child(FILE* fp, unsigned char directory_inode_id, char* node, unsigned short node_address, int position,
+					unsigned short child_logical_block, char* key, unsigned short* split_child, char* split_key)
+{
+	unsigned short count = ((unsigned short*)node)[0];
+	if (count<BTREE_INTERIOR_MAX_ENTRIES)
+	{
+		memmove(get_btree_child(node,position+1),get_btree_child(node,position),(count-position)*DIRECTORY_ELEMENT_SIZE);
+		set_btree_child(node,position,child_logical_block,key);
+		((unsigned short*)node)[0]++;
+		write_block(fp,node_address,node,BYTES_PER_BLOCK);
+		return 0;
+	}
+	
+	int total = count+1;
+	char* children = (char*)malloc(total*DIRECTORY_ELEMENT_SIZE);
+	memcpy(children,get_btree_child(node,0),position*DIRECTORY_ELEMENT_SIZE);
+	memcpy(children+(position+1)*DIRECTORY_ELEMENT_SIZE,get_btree_child(node,position),(count-position)*DIRECTORY_ELEMENT_SIZE);
+	memset(children+position*DIRECTORY_ELEMENT_SIZE,0,DIRECTORY_ELEMENT_SIZE);
+	*(unsigned short*)(children+position*DIRECTORY_ELEMENT_SIZE) = child_logical_block;
+	strncpy(children+position*DIRECTORY_ELEMENT_SIZE+BTREE_KEY_OFFSET,key,DIRECTORY_NAME_MAX);
+	
+	unsigned short new_node_logical_block = allocate_btree_node(fp,directory_inode_id);
+	char* new_node = (char*)malloc(BYTES_PER_BLOCK);
+	memset(new_node,0,BYTES_PER_BLOCK);
+	int half = total/2;
+	memset(get_btree_child(node,0),0,count*DIRECTORY_ELEMENT_SIZE);
+	memcpy(get_btree_child(node,0),children,half*DIRECTORY_ELEMENT_SIZE);
+	((unsigned short*)node)[0] = half;
+	memcpy(get_btree_child(new_node,0),children+half*DIRECTORY_ELEMENT_SIZE,(total-half)*DIRECTORY_ELEMENT_SIZE);
+	((unsigned short*)new_node)[0] = total-half;
+	
+	write_block(fp,node_address,node,BYTES_PER_BLOCK);
+	write_block(fp,get_file_block_address(fp,directory_inode_id,new_node_logical_block),new_node,BYTES_PER_BLOCK);
+	*split_child = new_node_logical_block;
+	memcpy(split_key,get_btree_child(new_node,0)+BTREE_KEY_OFFSET,DIRECTORY_NAME_MAX);
+	split_key[DIRECTORY_NAME_MAX] = 0;
+	free(children);
+	free(new_node);
+	return 1;
+}
+
+//adds the element below the node at node_logical_block, which is level levels above the leaves.
+//returns 1 if that node split, as insert_into_btree_leaf() does, and 0 if it did not
+int insert_into_btree_node(FILE* fp, unsigned char directory_inode_id, unsigned short node_logical_block, int level,
+						unsigned char element_inode_id, char* element_file_name, char type, unsigned long long size,
+						unsigned short* split_child, char* split_key)
+{
+	char* node = (char*)malloc(BYTES_PER_BLOCK);
+	unsigned short node_address = get_file_block_address(fp,directory_inode_id,node_logical_block);
+	read_block(fp,node_address,node);
+	int result;
+	if (level==0)
+	{
+		result = insert_into_btree_leaf(fp,directory_inode_id,node,node_address,element_inode_id,element_file_name,type,size,split_child,split_key);
+	}
+	else
+	{
+		int position = find_btree_child(node,element_file_name);
+		unsigned short child_split;
+		char child_key[31];
+		result = insert_into_btree_node(fp,directory_inode_id,get_btree_child_block(node,position),level-1,
+										element_inode_id,element_file_name,type,size,&child_split,child_key);
+		if (result==1)
+		{
+			result = insert_btree_child(fp,directory_inode_id,node,node_address,position+1,child_split,child_key,split_child,split_key);
+		}
+	}
+	free(node);
+	return result;
+}
+
+int add_element_to_sorted_directory(FILE* fp, unsigned char directory_inode_id, unsigned char element_inode_id, char* element_file_name)
+{
+	char type;
+	unsigned long long size;
+	link_inode_to_directory(fp,element_inode_id,directory_inode_id,element_file_name,&type,&size);
+	
+	if (!get_directory_index_header(get_directory_index(fp,directory_inode_id))[0])
+	{//the first name goes in a leaf which is the whole tree
+		set_btree_root(fp,directory_inode_id,allocate_btree_node(fp,directory_inode_id),1);
+	}
+	unsigned short* header = get_directory_index_header(get_directory_index(fp,directory_inode_id));
+	unsigned short root_logical_block = header[0];
+	unsigned short height = header[2];
+	unsigned short split_child;
+	char split_key[31];
+	if (insert_into_btree_node(fp,directory_inode_id,root_logical_block,height-1,element_inode_id,element_file_name,type,size,
+								&split_child,split_key)==1)
+	{//the root split, so the tree grows a level
+		unsigned short new_root_logical_block = allocate_btree_node(fp,directory_inode_id);
+		char* new_root = (char*)malloc(BYTES_PER_BLOCK);
+		memset(new_root,0,BYTES_PER_BLOCK);
+		set_btree_child(new_root,0,root_logical_block,"");
+		set_btree_child(new_root,1,split_child,split_key);
+		((unsigned short*)new_root)[0] = 2;
+		write_block(fp,get_file_block_address(fp,directory_inode_id,new_root_logical_block),new_root,BYTES_PER_BLOCK);
+		free(new_root);
+		set_btree_root(fp,directory_inode_id,new_root_logical_block,height+1);
+	}
+	return 0;
+}
+
+
+//////////////DENTRY CACHE
+/*
+ * Two direct mapped caches sit in front of the directory lookups made by find_file_inode_id():
+ * the dentry cache maps (parent directory inode id, name) to the inode id of the entry
+ * the path cache maps a whole path string to the inode id it resolved to
+ * Both also hold negative entries, with the inode id INODE_NOT_FOUND, for names and paths known not to exist.
+ * A dentry is replaced whenever its name is added to or removed from its directory. Removing any entry also
+ * bumps the path cache generation, which retires every cached path at once, since the removed name may be
+ * a component of any of them. Adding any entry likewise bumps the negative generation, which retires every
+ * cached missing path. A path hit costs no I/O at all, and a dentry hit saves the leaf read of one level.
+ */
+const size_t DENTRY_CACHE_SLOTS = 1024;
+const size_t PATH_CACHE_SLOTS = 256;
+
+struct dentry_cache_entry
+{
+	FILE* fp;
+	int in_use;
+	unsigned char parent_inode_id;
+	unsigned char inode_id;
+	unsigned int hash;
+	char name[31];
+};
+
+struct path_cache_entry
+{
+	FILE* fp;
+	char* path; //NULL for an empty slot
+	unsigned long generation;
+	unsigned char inode_id;
+};
+
+struct dentry_cache_entry* dentry_cache = NULL;
+struct path_cache_entry* path_cache = NULL;
+unsigned long path_cache_generation = 0;
+unsigned long negative_path_cache_generation = 0;
+
+struct dentry_cache_entry* get_dentry_cache_slot(FILE* fp, unsigned char parent_inode_id, unsigned int hash)
+{
+	if (!dentry_cache) dentry_cache = calloc(DENTRY_CACHE_SLOTS,sizeof(struct dentry_cache_entry));
+	return &dentry_cache[(hash ^ (parent_inode_id*2654435761u)) % DENTRY_CACHE_SLOTS];
+}
+
+int dentry_matches(struct dentry_cache_entry* entry, FILE* fp, unsigned char parent_inode_id, char* name, unsigned int hash)
+{
+	return entry->in_use && entry->fp==fp && entry->parent_inode_id==parent_inode_id && entry->hash==hash
+			&& !strncmp(entry->name,name,DIRECTORY_NAME_MAX);
+}
+
+//returns the cached inode id of name in the directory, INODE_NOT_FOUND if it is cached as missing, or -1 if it is not cached
+int lookup_dentry_cache(FILE* fp, unsigned char parent_inode_id, char* name)
+{
+	unsigned int hash = hash_file_name(name);
+	struct dentry_cache_entry* entry = get_dentry_cache_slot(fp,parent_inode_id,hash);
+	if (!dentry_matches(entry,fp,parent_inode_id,name,hash)) return -1;
+	return entry->inode_id;
+}
+
+void insert_dentry_cache(FILE* fp, unsigned char parent_inode_id, char* name, unsigned char inode_id)
+{
+	unsigned int hash = hash_file_name(name);
+	struct dentry_cache_entry* entry = get_dentry_cache_slot(fp,parent_inode_id,hash);
+	entry->fp = fp;
+	entry->in_use = 1;
+	entry->parent_inode_id = parent_inode_id;
+	entry->inode_id = inode_id;
+	entry->hash = hash;
+	memset(entry->name,0,sizeof(entry->name));
+	strncpy(entry->name,name,DIRECTORY_NAME_MAX);
+}
+
+void remove_dentry_cache(FILE* fp, unsigned char parent_inode_id, char* name)
+{
+	unsigned int hash = hash_file_name(name);
+	struct dentry_cache_entry* entry = get_dentry_cache_slot(fp,parent_inode_id,hash);
+	if (dentry_matches(entry,fp,parent_inode_id,name,hash)) entry->in_use = 0;
+}
+
+//djb2 over the whole path
+unsigned int hash_path(char* path)
+{
+	unsigned int hash = 5381;
+	while (*path) hash = hash*33 + (unsigned char)*path++;
+	return hash;
+}
+
+//returns the cached inode id for the path, INODE_NOT_FOUND if it is cached as missing, or -1 if it is not cached
+int lookup_path_cache(FILE* fp, char* path)
+{
+	if (!path_cache) return -1;
+	struct path_cache_entry* entry = &path_cache[hash_path(path) % PATH_CACHE_SLOTS];
+	if (!entry->path || entry->fp!=fp || strcmp(entry->path,path)) return -1;
+	if (entry->generation!=(entry->inode_id==INODE_NOT_FOUND ? negative_path_cache_generation : path_cache_generation)) return -1;
+	return entry->inode_id;
+}
+
+void insert_path_cache(FILE* fp, char* path, unsigned char inode_id)
+{
+	if (!path_cache) path_cache = calloc(PATH_CACHE_SLOTS,sizeof(struct path_cache_entry));
+	struct path_cache_entry* entry = &path_cache[hash_path(path) % PATH_CACHE_SLOTS];
+	free(entry->path);
+	entry->fp = fp;
+	entry->path = strdup(path);
+	entry->generation = inode_id==INODE_NOT_FOUND ? negative_path_cache_generation : path_cache_generation;
+	entry->inode_id = inode_id;
+}
+
+void invalidate_path_cache(void)
+{
+	path_cache_generation++;
+}
+
+void invalidate_negative_path_cache(void)
+{
+	negative_path_cache_generation++;
+}
+
+/*
+ * Per-directory Bloom filters over the names in a directory. A filter is built by scanning the directory
+ * the first time a lookup in it misses, and is kept up to date as names are added. Removing a name leaves
+ * its bits set, which only costs an occasional false positive. A name the filter has never seen is
+ * reported missing with no I/O at all.
+ */
+const size_t NAME_FILTER_SLOTS = 64;
+const size_t NAME_FILTER_BITS = 2048;
+const size_t NAME_FILTER_PROBES = 3;
+
+struct name_filter
+{
+	FILE* fp;
+	int in_use;
+	unsigned char directory_inode_id;
+	unsigned char* bits;
+};
+
+struct name_filter* name_filters = NULL;
+
+struct name_filter* get_name_filter(FILE* fp, unsigned char directory_inode_id)
+{
+	if (!name_filters) return NULL;
+	struct name_filter* filter = &name_filters[directory_inode_id % NAME_FILTER_SLOTS];
+	if (!filter->in_use || filter->fp!=fp || filter->directory_inode_id!=directory_inode_id) return NULL;
+	return filter;
+}
+
+void drop_name_filter(FILE* fp, unsigned char directory_inode_id)
+{
+	struct name_filter* filter = get_name_filter(fp,directory_inode_id);
+	if (filter) filter->in_use = 0;
+}
+
+//double hashing: the probes are hash + i*step, with the step taken from the rotated hash
+void set_name_filter_bits(struct name_filter* filter, unsigned int hash)
+{
+	unsigned int step = ((hash>>16) | (hash<<16)) | 1;
+	int i;
+	for (i=0;i<NAME_FILTER_PROBES;i++)
+	{
+		unsigned int bit = (hash + i*step) % NAME_FILTER_BITS;
+		filter->bits[bit/8] |= 1<<(bit%8);
+	}
+}
+
+int name_filter_may_contain(struct name_filter* filter, unsigned int hash)
+{
+	unsigned int step = ((hash>>16) | (hash<<16)) | 1;
+	int i;
+	for (i=0;i<NAME_FILTER_PROBES;i++)
+	{
+		unsigned int bit = (hash + i*step) % NAME_FILTER_BITS;
+		if (!(filter->bits[bit/8] & (1<<(bit%8)))) return 0;
+	}
+	return 1;
+}
+
+void add_to_name_filter(FILE* fp, unsigned char directory_inode_id, char* name)
+{
+	struct name_filter* filter = get_name_filter(fp,directory_inode_id);
+	if (filter) set_name_filter_bits(filter,hash_file_name(name));
+}
+
+//reads every block of the directory once and records each name in a fresh filter
+void build_name_filter(FILE* fp, unsigned char directory_inode_id)
+{
+	if (!name_filters) name_filters = calloc(NAME_FILTER_SLOTS,sizeof(struct name_filter));
+	struct name_filter* filter = &name_filters[directory_inode_id % NAME_FILTER_SLOTS];
+	if (!filter->bits) filter->bits = (unsigned char*)malloc(NAME_FILTER_BITS/8);
+	memset(filter->bits,0,NAME_FILTER_BITS/8);
+	filter->fp = fp;
+	filter->directory_inode_id = directory_inode_id;
+	filter->in_use = 1;
+	
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	int i;
+	if (get_directory_format(fp,directory_inode_id)==DIRECTORY_FORMAT_SORTED)
+	{
+		unsigned short leaf_address = load_btree_leaf_for_name(fp,directory_inode_id,"",block_buffer);
+		while (leaf_address)
+		{
+			for (i=0;i<get_btree_leaf_header(block_buffer)[0];i++) set_name_filter_bits(filter,get_directory_leaf_hashes(block_buffer)[i]);
+			leaf_address = load_next_btree_leaf(fp,directory_inode_id,block_buffer);
+		}
+		free(block_buffer);
+		return;
+	}
+	if (get_directory_format(fp,directory_inode_id)!=DIRECTORY_FORMAT_HASHED)
+	{
+		read_block(fp,get_file_block_address(fp,directory_inode_id,0),block_buffer);
+		for (i=2;i<DIRECTORY_SLOTS_PER_BLOCK;i++)
+		{
+			char* name = block_buffer+i*DIRECTORY_ELEMENT_SIZE+DIRECTORY_ENTRY_OFFSET;
+			if (name[0]) set_name_filter_bits(filter,hash_file_name(name));
+		}
+		free(block_buffer);
+		return;
+	}
+	char* root_block = get_directory_index(fp,directory_inode_id);
+	int position;
+	for (position=0;position<get_directory_index_header(root_block)[0];position++)
+	{
+		read_block(fp,get_file_block_address(fp,directory_inode_id,get_directory_index_entry(root_block,position)[1]),block_buffer);
+		for (i=0;i<DIRECTORY_LEAF_SLOTS;i++)
+		{
+			if (get_directory_leaf_slot(block_buffer,i)[DIRECTORY_ENTRY_OFFSET]) set_name_filter_bits(filter,get_directory_leaf_hashes(block_buffer)[i]);
+		}
+	}
+	free(block_buffer);
 }
 
-void assign_location_to_inode_map(FILE* fp, unsigned short inode_address, unsigned char inode_id)
+//forgets everything cached about a vdisk, for when its contents are replaced wholesale
+void drop_vdisk_caches(FILE* fp)
 {
-	char* inode_map = malloc(INODE_MAX_NUM*2);
-	read_block(fp, INODE_MAP_OFFSET, inode_map);
-	inode_map[inode_id*2] = inode_address;
-	write_block(fp, INODE_MAP_OFFSET,inode_map,(INODE_MAX_NUM*2));
+	int i;
+	if (block_map_cache)
+	{
+		for (i=0;i<BLOCK_MAP_CACHE_SLOTS;i++)
+		{
+			if (block_map_cache[i].in_use && block_map_cache[i].fp==fp) release_block_map_cache_entry(&block_map_cache[i]);
+		}
+	}
+	if (dentry_cache)
+	{
+		for (i=0;i<DENTRY_CACHE_SLOTS;i++) if (dentry_cache[i].fp==fp) dentry_cache[i].in_use = 0;
+	}
+	if (name_filters)
+	{
+		for (i=0;i<NAME_FILTER_SLOTS;i++) if (name_filters[i].fp==fp) name_filters[i].in_use = 0;
+	}
+	invalidate_path_cache();
+	invalidate_negative_path_cache();
+	if (dedup_index.fp==fp) dedup_index.fp = NULL;
 }
 
-
-unsigned short add_element_to_directory(FILE* fp, unsigned char directory_inode_id, unsigned char element_inode_id, char* element_file_name)
+//find_directory_entry() behind the dentry cache and the directory's name filter. returns -1 for a missing name
+int lookup_directory_name(FILE* fp, unsigned char parent_inode_id, char* name)
 {
-//	printf("add_element_to_directory:entering function\n");
-	unsigned short parent_directory_inode_block_address = get_inode_address(fp, directory_inode_id);
-	//HARDCODING TO FIND THE DIRECTORY ADDRESS WITHIN THE INODE BECAUSE THERE IS ONLY EVER ONE DIRECTORY FILE ATTACHED TO A DIRECTORY INODE
-	unsigned short* parent_directory_inode_contents = (unsigned short*)malloc(BYTES_PER_BLOCK);
-	read_block(fp,parent_directory_inode_block_address,(char*)parent_directory_inode_contents);
-	unsigned short directory_data_block_address = parent_directory_inode_contents[4];
-	
-//	printf("add_element_to_directory:directory block address %d\n",directory_data_block_address);
-	char* directory_block_data = (char*)malloc(BYTES_PER_BLOCK);
-	read_block(fp,directory_data_block_address,directory_block_data);
-	//now we have a directory data block stored in directory_block_data
-	
-	int i=0;
-//	printf("[i*32+1] = %d\n",i*32+1);
-	while (directory_block_data[i*32+1])
-	{
-//		printf("i=%d\n",i*32+1);
-		i++;
-		if (i>BYTES_PER_BLOCK)
-		{
-			printf("directory full!!\n");
-			return -1;
-			
-			}
-		}
-	 
-	//now i points to the empty directory slot
-//	printf("add_element_to_directory:assigned byte number %d to the element_inode_id %d\n",i,element_inode_id);
-	directory_block_data[i*32]=element_inode_id;
-	int j=0;
+	int inode_id = lookup_dentry_cache(fp,parent_inode_id,name);
+	if (inode_id==INODE_NOT_FOUND) return -1;
+	if (inode_id>=0) return inode_id;
 	
-//	printf("add_element_to_directory:about to write the element/file name to byte %d \n",i*32+1+j);
-	while(element_file_name[j])
+	struct name_filter* filter = get_name_filter(fp,parent_inode_id);
+	if (filter && !name_filter_may_contain(filter,hash_file_name(name)))
 	{
-		directory_block_data[i*32+1+j] = element_file_name[j];
-		if (j>31)
-		{
-			break;
-			}
-		j++;
+		insert_dentry_cache(fp,parent_inode_id,name,INODE_NOT_FOUND);
+		return -1;
 	}
-	write_block(fp, directory_data_block_address, directory_block_data, i*32+1+j);
-	
-	
+	inode_id = find_directory_entry(fp,parent_inode_id,name);
+	if (inode_id>=0)
+	{
+		insert_dentry_cache(fp,parent_inode_id,name,(unsigned char)inode_id);
+		return inode_id;
+	}
+	insert_dentry_cache(fp,parent_inode_id,name,INODE_NOT_FOUND);
+	//a directory which has missed once is likely to be probed for more missing names
+	if (!filter) build_name_filter(fp,parent_inode_id);
+	return -1;
 }
 
 
-
 unsigned short create_directory_from_inode(FILE* fp, unsigned char parent_inode_id,char* new_directory_name)
 {
+	return create_directory_with_format(fp,parent_inode_id,new_directory_name,DIRECTORY_FORMAT_HASHED);
+}
+
+//format is DIRECTORY_FORMAT_HASHED or DIRECTORY_FORMAT_SORTED
+unsigned short create_directory_with_format(FILE* fp, unsigned char parent_inode_id,char* new_directory_name, unsigned char format)
+{
+	begin_metadata_batch(fp);
 	
 //	printf("creating directory\n");
 	unsigned char inode_id  = find_next_free_inode_id(fp);
@@ -986,9 +4774,13 @@ unsigned short create_directory_from_inode(FILE* fp, unsigned char parent_inode_
 	unsigned short* dir_inode_block = (unsigned short*)malloc(BYTES_PER_BLOCK);
 	read_block(fp,inode_block,(char*)dir_inode_block);
 	dir_inode_block[4] = directory_block;
-	write_block(fp, inode_block,dir_inode_block,10);
+	((unsigned char*)dir_inode_block)[INODE_FLAGS_OFFSET] = format;
+	write_block(fp, inode_block,dir_inode_block,INODE_BYTES);
+	free(dir_inode_block);
 //	printf("create_directory: added the block address %d to inode id %d\n",directory_block, inode_block);
-	add_element_to_directory(fp,parent_inode_id,inode_id,new_directory_name);
+	//the root directory is its own parent and has no entry anywhere
+	if (inode_id != parent_inode_id) add_element_to_directory(fp,parent_inode_id,inode_id,new_directory_name);
+	commit_metadata_batch(fp);
 	
 	//returning the block address to which the directory file was created
 	return directory_block;
@@ -998,10 +4790,69 @@ unsigned short create_directory_from_inode(FILE* fp, unsigned char parent_inode_
 
 void create_directory(FILE* fp, char* parent_directory_name, char* new_directory_name)
 {
-	unsigned char parent_inode_id = find_file_inode_id(fp,parent_directory_name);
+	unsigned char parent_inode_id = find_directory_inode_id(fp,parent_directory_name,"create_directory");
+	if (parent_inode_id==INODE_NOT_FOUND) return;
+	begin_metadata_batch(fp);
 	create_directory_from_inode(fp,parent_inode_id,new_directory_name);
-	
+	commit_metadata_batch(fp);
+	}
+
+//creates the directory at the path along with every missing directory above it, like mkdir -p, in one walk with
+//all the metadata written together. returns the inode id of the directory, or INODE_NOT_FOUND if a component is a
+//file, a name is too long or a directory could not be made
+unsigned char create_directory_path(FILE* fp, char* path)
+{
+	unsigned char inode_id = 0;
+	char name[31];
+	char* cursor = path;
+	char* component;
+	size_t length;
+	begin_metadata_batch(fp);
+	while ((length = next_path_component(&cursor,&component)))
+	{
+		if (length>DIRECTORY_NAME_MAX)
+		{
+			printf("create_directory_path: a name in %s is longer than %d characters\n",path,(int)DIRECTORY_NAME_MAX);
+			inode_id = INODE_NOT_FOUND;
+			break;
+		}
+		memcpy(name,component,length);
+		name[length] = 0;
+		int element_inode_id = lookup_directory_name(fp,inode_id,name);
+		if (element_inode_id<0)
+		{
+			create_directory_from_inode(fp,inode_id,name);
+			//adding the entry put it in the dentry cache, so this costs no I/O
+			element_inode_id = lookup_directory_name(fp,inode_id,name);
+			if (element_inode_id<0)
+			{
+				printf("create_directory_path: could not create %s in %s\n",name,path);
+				inode_id = INODE_NOT_FOUND;
+				break;
+			}
+		}
+		else
+		{
+			if (get_inode_type(fp,(unsigned char)element_inode_id)!='d')
+			{
+				printf("create_directory_path: %s in %s is not a directory\n",name,path);
+				inode_id = INODE_NOT_FOUND;
+				break;
+			}
+		}
+		inode_id = (unsigned char)element_inode_id;
 	}
+	commit_metadata_batch(fp);
+	return inode_id;
+}
+
+//like create_directory(), but the new directory keeps its names in order for listings from a name or of a prefix
+void create_sorted_directory(FILE* fp, char* parent_directory_name, char* new_directory_name)
+{
+	unsigned char parent_inode_id = find_directory_inode_id(fp,parent_directory_name,"create_sorted_directory");
+	if (parent_inode_id==INODE_NOT_FOUND) return;
+	create_directory_with_format(fp,parent_inode_id,new_directory_name,DIRECTORY_FORMAT_SORTED);
+}
 //	RETURNS AN INODE ID
 
 /*
@@ -1017,80 +4868,566 @@ unsigned char* create_file(FILE* fp, FILE* new_file, unsigned char directory_ino
 */
 
 
+//////////////PATH RESOLUTION
+/*
+ * Paths are walked in place. Each component is a view into the caller's string, copied onto the stack only to be
+ * looked up, so there is no limit on depth or total length and nothing is allocated. Repeated slashes are skipped.
+ * A component longer than DIRECTORY_NAME_MAX characters cannot name anything.
+ */
+
+//points component at the next component after *cursor and moves *cursor past it. returns its length, 0 at the end
+size_t next_path_component(char** cursor, char** component)
+{
+	char* position = *cursor;
+	while (*position=='/') position++;
+	*component = position;
+	while (*position && *position!='/') position++;
+	*cursor = position;
+	return position-*component;
+}
+
+//walks the path once and returns the inode id it names, or INODE_NOT_FOUND, also when the path goes on below a file.
+//if parent_inode_id is not NULL it gets the directory holding the last component, or INODE_NOT_FOUND if the walk
+//stopped before it. if leaf_name is not
+//NULL it gets the last component, and must have room for DIRECTORY_NAME_MAX+1 characters
+unsigned char resolve_path(FILE* fp, char* path, unsigned char* parent_inode_id, char* leaf_name)
+{
+	//the root directory is inode 0, and is its own parent
+	unsigned char inode_id = 0;
+	unsigned char parent = 0;
+	char name[31];
+	name[0] = 0;
+	char* cursor = path;
+	char* component;
+	size_t length;
+	while ((length = next_path_component(&cursor,&component)))
+	{
+		if (inode_id==INODE_NOT_FOUND)
+		{//a component below one which does not exist
+			parent = INODE_NOT_FOUND;
+			break;
+		}
+		//a component below a file
+		if (inode_id && get_inode_type(fp,inode_id)!='d')
+		{
+			parent = INODE_NOT_FOUND;
+			inode_id = INODE_NOT_FOUND;
+			break;
+		}
+		parent = inode_id;
+		if (length>DIRECTORY_NAME_MAX)
+		{
+			name[0] = 0;
+			inode_id = INODE_NOT_FOUND;
+			continue;
+		}
+		memcpy(name,component,length);
+		name[length] = 0;
+		int element_inode_id = lookup_directory_name(fp,parent,name);
+		inode_id = element_inode_id<0 ? INODE_NOT_FOUND : (unsigned char)element_inode_id;
+	}
+	if (parent_inode_id) *parent_inode_id = parent;
+	if (leaf_name) strcpy(leaf_name,name);
+	return inode_id;
+}
+
 unsigned char find_file_inode_id(FILE* fp, char* absolute_file_path)
 {
+	int cached_inode_id = lookup_path_cache(fp,absolute_file_path);
+	if (cached_inode_id>=0) return (unsigned char)cached_inode_id;
 	
-	unsigned short* inode_map = (unsigned short*)malloc(BYTES_PER_BLOCK);
-	memset(inode_map,0,BYTES_PER_BLOCK);
-	read_block(fp,2,(char*)inode_map);
-	char* temp_directory_data_block = (char*)malloc(BYTES_PER_BLOCK);
-	memset(temp_directory_data_block,0,BYTES_PER_BLOCK);
-	char* temp_inode_data_block = (char*)malloc(BYTES_PER_BLOCK);
-	memset(temp_inode_data_block,0,BYTES_PER_BLOCK);
-	
-	//working file path can be at most 4 directory names at once, each one being a max of 31 chars, so the total filepath can be 124+1 for null char
-	char* working_file_path= (char*)malloc(125);
-	memset(working_file_path,0,125);
-	strncpy(working_file_path,absolute_file_path,strnlen(absolute_file_path,125));
-	char* delimiter="/";
-	//Use strtok to break up the filepath into directory names:
-	char* token;
-	token= strtok(working_file_path,delimiter);
-	//current inode id will be initialized to 0 which is the root directory
-	unsigned short directory_data_block_num;
-	unsigned char current_inode_id=0;
-	while(token!=NULL)
-	{
-//		printf("find_file_inode_id:dir name requested: %s\n",token);
-//		printf("find_file_inode_id:looking through current directory with inode id %d\n", current_inode_id);
-		int i;
-		
-		read_block(fp, inode_map[current_inode_id],(char*)temp_inode_data_block);
-		//now to read the directory data in from the first direct pointer in the inode data block
-		read_block(fp,temp_inode_data_block[8],temp_directory_data_block);
-//		printf("copying directory data block from block num %d\n",inode_map[current_inode_id]);
-		for (i=2;i<16;i++)
+	unsigned char inode_id = resolve_path(fp,absolute_file_path,NULL,NULL);
+	insert_path_cache(fp,absolute_file_path,inode_id);
+	return inode_id;
+}
+
+//find_file_inode_id() for a path which has to name a directory. otherwise says why for caller and returns
+//INODE_NOT_FOUND
+unsigned char find_directory_inode_id(FILE* fp, char* absolute_directory_path, char* caller)
+{
+	unsigned char inode_id = find_file_inode_id(fp,absolute_directory_path);
+	if (inode_id==INODE_NOT_FOUND) printf("%s: directory %s was not found\n",caller,absolute_directory_path);
+	else if (get_inode_type(fp,inode_id)!='d')
+	{
+		printf("%s: %s is not a directory\n",caller,absolute_directory_path);
+		inode_id = INODE_NOT_FOUND;
+	}
+	return inode_id;
+}
+
+//returns 1 if the path names a file or directory, 0 if it does not. a repeated miss costs no I/O
+int file_exists(FILE* fp, char* absolute_file_path)
+{
+	return find_file_inode_id(fp,absolute_file_path)!=INODE_NOT_FOUND;
+}
+
+//////////////DIRECTORY HANDLES
+
+/*
+ * A directory handle is a directory resolved once, so that every operation on a name inside it costs a single
+ * lookup in that directory instead of a walk from the root, and names are not limited by find_file_inode_id()'s
+ * path buffer. While a handle is open the directory's block map cache entry, which holds its block 0, is never
+ * evicted. Deleting the directory, or closing the vdisk with close_vdisk(), leaves its handles stale: every call on
+ * them fails until they are closed.
+ */
+struct directory_handle
+{
+	FILE* fp;
+	unsigned char inode_id;
+	int stale;
+	struct directory_handle* next;
+};
+
+struct directory_handle* open_directory_handles = NULL;
+
+int directory_handle_is_open(FILE* fp, unsigned char directory_inode_id)
+{
+	struct directory_handle* dir;
+	for (dir=open_directory_handles;dir;dir=dir->next)
+	{
+		if (!dir->stale && dir->fp==fp && dir->inode_id==directory_inode_id) return 1;
+	}
+	return 0;
+}
+
+void retire_directory_handles(FILE* fp, unsigned char directory_inode_id)
+{
+	struct directory_handle* dir;
+	for (dir=open_directory_handles;dir;dir=dir->next)
+	{
+		if (dir->fp==fp && dir->inode_id==directory_inode_id) dir->stale = 1;
+	}
+}
+
+//writes out what is still held in memory for a vdisk, forgets everything cached about it and closes it. the caches
+//go by FILE* alone, and a vdisk opened later may get the same one, so vdisks are closed with this, not fclose()
+int close_vdisk(FILE* fp)
+{
+	write_deferred_metadata_batch(fp);
+	unmount_log_structured(fp);
+	drop_vdisk_caches(fp);
+	if (journal.fp==fp) journal.fp = NULL;
+	struct directory_handle* dir;
+	for (dir=open_directory_handles;dir;dir=dir->next)
+	{
+		if (dir->fp==fp) dir->stale = 1;
+	}
+	return fclose(fp);
+}
+
+int directory_handle_is_usable(struct directory_handle* dir, char* caller)
+{
+	if (!dir) return 0;
+	if (dir->stale)
+	{
+		printf("%s: the directory of this handle has been deleted, or its vdisk closed\n",caller);
+		return 0;
+	}
+	return 1;
+}
+
+//returns a handle on the directory directory_inode_id, or NULL if that inode is not a directory
+struct directory_handle* open_directory_from_inode(FILE* fp, unsigned char directory_inode_id)
+{
+	if (get_inode_type(fp,directory_inode_id)!='d') return NULL;
+	
+	struct directory_handle* dir = (struct directory_handle*)calloc(1,sizeof(struct directory_handle));
+	dir->fp = fp;
+	dir->inode_id = directory_inode_id;
+	dir->next = open_directory_handles;
+	open_directory_handles = dir;
+	//read the inode and block 0 now, so the first call on the handle finds them cached
+	if (get_directory_format(fp,directory_inode_id)==DIRECTORY_FORMAT_HASHED) get_directory_index(fp,directory_inode_id);
+	return dir;
+}
+
+//returns a handle on the directory at the path, or NULL if there is no directory there
+struct directory_handle* open_directory(FILE* fp, char* absolute_directory_path)
+{
+	unsigned char inode_id = find_file_inode_id(fp,absolute_directory_path);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		printf("open_directory: %s was not found\n",absolute_directory_path);
+		return NULL;
+	}
+	struct directory_handle* dir = open_directory_from_inode(fp,inode_id);
+	if (!dir) printf("open_directory: %s is not a directory\n",absolute_directory_path);
+	return dir;
+}
+
+//returns a handle on the subdirectory name of dir, or NULL if there is no such directory
+struct directory_handle* open_directory_at(struct directory_handle* dir, char* name)
+{
+	unsigned char inode_id = find_file_inode_id_at(dir,name);
+	if (inode_id==INODE_NOT_FOUND) return NULL;
+	return open_directory_from_inode(dir->fp,inode_id);
+}
+
+void close_directory(struct directory_handle* dir)
+{
+	if (!dir) return;
+	struct directory_handle** link = &open_directory_handles;
+	while (*link && *link!=dir) link = &(*link)->next;
+	if (*link) *link = dir->next;
+	free(dir);
+}
+
+unsigned char get_directory_handle_inode_id(struct directory_handle* dir)
+{
+	return dir->inode_id;
+}
+
+//returns the inode id of name inside dir, or INODE_NOT_FOUND
+unsigned char find_file_inode_id_at(struct directory_handle* dir, char* name)
+{
+	if (!directory_handle_is_usable(dir,"find_file_inode_id_at")) return INODE_NOT_FOUND;
+	int inode_id = lookup_directory_name(dir->fp,dir->inode_id,name);
+	return inode_id<0 ? INODE_NOT_FOUND : (unsigned char)inode_id;
+}
+
+unsigned char upload_file_at(struct directory_handle* dir, char* file_name, FILE* fpin)
+{
+	if (!directory_handle_is_usable(dir,"upload_file_at")) return INODE_NOT_FOUND;
+	return create_file_in_directory(dir->fp,dir->inode_id,file_name,fpin);
+}
+
+FILE* download_file_at(struct directory_handle* dir, char* file_name, char* new_filename)
+{
+	unsigned char inode_id = find_file_inode_id_at(dir,file_name);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		printf("download_file_at: %s was not found\n",file_name);
+		return NULL;
+	}
+	FILE* fpout = download_file_from_inode_id(dir->fp,inode_id,new_filename);
+	if (fpout) fclose(fpout);
+	return NULL;
+}
+
+void create_directory_at(struct directory_handle* dir, char* new_directory_name)
+{
+	if (!directory_handle_is_usable(dir,"create_directory_at")) return;
+	create_directory_from_inode(dir->fp,dir->inode_id,new_directory_name);
+}
+
+void create_sorted_directory_at(struct directory_handle* dir, char* new_directory_name)
+{
+	if (!directory_handle_is_usable(dir,"create_sorted_directory_at")) return;
+	create_directory_with_format(dir->fp,dir->inode_id,new_directory_name,DIRECTORY_FORMAT_SORTED);
+}
+
+//deletes the file or empty directory name inside dir. returns 0 once it is gone, -1 otherwise
+int delete_file_at(struct directory_handle* dir, char* name)
+{
+	unsigned char inode_id = find_file_inode_id_at(dir,name);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		printf("delete_file_at: %s was not found\n",name);
+		return -1;
+	}
+	return delete_element_from_directory(dir->fp,dir->inode_id,name,inode_id);
+}
+
+//////////////RENAME
+
+//returns 1 if directory_inode_id is ancestor_inode_id or lies somewhere below it, following ".." up to the root
+int directory_is_within(FILE* fp, unsigned char directory_inode_id, unsigned char ancestor_inode_id)
+{
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	unsigned char current = directory_inode_id;
+	int within = 0;
+	int depth;
+	//the depth bound only guards against a corrupted loop of ".." entries
+	for (depth=0;depth<INODE_MAX_NUM;depth++)
+	{
+		if (current==ancestor_inode_id)
 		{
-//			printf("looking in slot # %d, \n",i);
-			
-//				printf("printing test: %s\n",(char*)temp_directory_data_block+i*32+1);
-			if (!strncmp(token,temp_directory_data_block+i*32+1,31))
-			{
-//				printf("find_file_inode_id: found a match! with inode id %d\n", temp_directory_data_block[i*32]);
-				current_inode_id = temp_directory_data_block[i*32];
-				token=strtok(NULL,delimiter);
-				break;
-			////////////////////////////////////////////////////////////////////
-			}
-		
-			if (i==15)
+			within = 1;
+			break;
+		}
+		if (current==0) break;
+		read_block(fp,get_file_block_address(fp,current,0),block_buffer);
+		current = (unsigned char)block_buffer[DIRECTORY_ELEMENT_SIZE+DIRECTORY_INODE_OFFSET];
+	}
+	free(block_buffer);
+	return within;
+}
+
+//points the ".." entry of a directory at its new parent
+void set_directory_parent(FILE* fp, unsigned char directory_inode_id, unsigned char parent_inode_id)
+{
+	unsigned short block_address = get_file_block_address(fp,directory_inode_id,0);
+	char* block_buffer = (char*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,block_address,block_buffer);
+	block_buffer[DIRECTORY_ELEMENT_SIZE+DIRECTORY_INODE_OFFSET] = (char)parent_inode_id;
+	write_block(fp,block_address,block_buffer,BYTES_PER_BLOCK);
+	free(block_buffer);
+	//the block map cache holds a copy of block 0
+	invalidate_block_map_cache(fp,directory_inode_id);
+}
+
+/*
+ * Moves the entry of inode_id from old_name in old_parent_inode_id to new_name in new_parent_inode_id. Only
+ * directory entries change, never the data, so the cost does not depend on the size of the file. The new entry is
+ * added before the old one is removed and both happen in one metadata batch.
+ * returns 0 on success, -1 if the new name is taken or a directory would be moved below itself
+ */
+int move_directory_entry(FILE* fp, unsigned char old_parent_inode_id, char* old_name, unsigned char inode_id,
+						unsigned char new_parent_inode_id, char* new_name)
+{
+	if (get_inode_type(fp,new_parent_inode_id)!='d')
+	{
+		printf("rename: the new parent is not a directory\n");
+		return -1;
+	}
+	if (lookup_directory_name(fp,new_parent_inode_id,new_name)>=0)
+	{
+		printf("rename: %s already exists\n",new_name);
+		return -1;
+	}
+	int is_directory = get_inode_type(fp,inode_id)=='d';
+	if (is_directory && directory_is_within(fp,new_parent_inode_id,inode_id))
+	{
+		printf("rename: a directory cannot be moved inside itself\n");
+		return -1;
+	}
+	
+	begin_metadata_batch(fp);
+	int result = add_element_to_directory(fp,new_parent_inode_id,inode_id,new_name) ? -1 : 0;
+	if (!result)
+	{
+		delete_directory_entry(fp,old_parent_inode_id,old_name);
+		if (is_directory && old_parent_inode_id!=new_parent_inode_id) set_directory_parent(fp,inode_id,new_parent_inode_id);
+	}
+	commit_metadata_batch(fp);
+	return result;
+}
+
+int rename_file(FILE* fp, char* old_path, char* new_path)
+{
+	unsigned char old_parent_inode_id;
+	unsigned char new_parent_inode_id;
+	char old_name[31];
+	char new_name[31];
+	unsigned char inode_id = resolve_path(fp,old_path,&old_parent_inode_id,old_name);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		printf("rename_file: %s was not found\n",old_path);
+		return -1;
+	}
+	if (inode_id==0)
+	{
+		printf("rename_file: the root directory cannot be moved\n");
+		return -1;
+	}
+	if (resolve_path(fp,new_path,&new_parent_inode_id,new_name)!=INODE_NOT_FOUND)
+	{
+		printf("rename_file: %s already exists\n",new_path);
+		return -1;
+	}
+	if (new_parent_inode_id==INODE_NOT_FOUND || !new_name[0])
+	{
+		printf("rename_file: the directory for %s was not found, or the name is too long\n",new_path);
+		return -1;
+	}
+	return move_directory_entry(fp,old_parent_inode_id,old_name,inode_id,new_parent_inode_id,new_name);
+}
+
+int rename_file_at(struct directory_handle* old_dir, char* old_name, struct directory_handle* new_dir, char* new_name)
+{
+	if (!directory_handle_is_usable(new_dir,"rename_file_at")) return -1;
+	if (strlen(new_name)>DIRECTORY_NAME_MAX)
+	{
+		printf("rename_file_at: file name %s is longer than %d characters\n",new_name,(int)DIRECTORY_NAME_MAX);
+		return -1;
+	}
+	unsigned char inode_id = find_file_inode_id_at(old_dir,old_name);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		printf("rename_file_at: %s was not found\n",old_name);
+		return -1;
+	}
+	return move_directory_entry(old_dir->fp,old_dir->inode_id,old_name,inode_id,new_dir->inode_id,new_name);
+}
+
+//////////////DIRECTORY LISTING
+
+/*
+ * A directory iterator hands out the entries of a directory in batches, one leaf block read per 12 slots and no
+ * inode reads for entries which carry their type and size. An iterator may be limited to names after a given one
+ * and to names starting with a prefix.
+ * In a sorted directory the entries come in name order, and each batch starts by looking up the last name returned,
+ * so paging costs one walk down the tree per batch plus the leaves returned, whatever is added or removed in between.
+ * Other directories are scanned whole in hash order: the limits only filter, and entries added or removed between
+ * two batches may be missed, or returned twice when a leaf split moves them.
+ */
+struct directory_iterator
+{
+	struct directory_handle* dir;
+	int position; //index position of the leaf to read next, or 0 for the single block of a linear directory
+	int slot; //next slot to look at in block
+	int block_loaded;
+	int hashed;
+	int finished;
+	char* block;
+	char after[31]; //only names after this one are returned, unless it is empty
+	char prefix[31]; //only names starting with this are returned, unless it is empty
+};
+
+struct directory_iterator* open_directory_iterator(struct directory_handle* dir)
+{
+	return open_directory_iterator_from(dir,NULL,NULL);
+}
+
+//after_name and prefix may each be NULL for no limit
+struct directory_iterator* open_directory_iterator_from(struct directory_handle* dir, char* after_name, char* prefix)
+{
+	if (!directory_handle_is_usable(dir,"open_directory_iterator")) return NULL;
+	struct directory_iterator* it = (struct directory_iterator*)calloc(1,sizeof(struct directory_iterator));
+	it->dir = dir;
+	it->block = (char*)malloc(BYTES_PER_BLOCK);
+	if (after_name) strncpy(it->after,after_name,DIRECTORY_NAME_MAX);
+	if (prefix) strncpy(it->prefix,prefix,DIRECTORY_NAME_MAX);
+	return it;
+}
+
+void close_directory_iterator(struct directory_iterator* it)
+{
+	if (!it) return;
+	free(it->block);
+	free(it);
+}
+
+//returns below zero for a name the iterator has not reached yet, 0 for one it returns and above zero past the end
+int compare_to_directory_iterator_range(struct directory_iterator* it, char* name)
+{
+	if (it->after[0] && compare_directory_names(name,it->after)<=0) return -1;
+	if (!it->prefix[0]) return 0;
+	return strncmp(name,it->prefix,strlen(it->prefix));
+}
+
+//copies the entry in slot of block into info. type 0 means the type and size have to come from the inode
+void fill_directory_entry_info(FILE* fp, struct directory_entry_info* info, char* entry, char type, unsigned int size)
+{
+	info->inode_id = (unsigned char)entry[DIRECTORY_INODE_OFFSET];
+	memcpy(info->name,entry+DIRECTORY_ENTRY_OFFSET,DIRECTORY_ELEMENT_SIZE-1);
+	info->name[DIRECTORY_ELEMENT_SIZE-2] = 0;
+	if (type)
+	{
+		info->type = type;
+		info->size = size;
+		return;
+	}
+	unsigned short* inode_buffer = (unsigned short*)malloc(BYTES_PER_BLOCK);
+	read_block(fp,get_inode_address(fp,info->inode_id),(char*)inode_buffer);
+	info->type = (char)((int*)inode_buffer)[1];
+	info->size = get_inode_size(inode_buffer);
+	free(inode_buffer);
+}
+
+int read_sorted_directory_entries(struct directory_iterator* it, struct directory_entry_info* entries, int max_entries)
+{
+	FILE* fp = it->dir->fp;
+	unsigned char directory_inode_id = it->dir->inode_id;
+	char* start = it->after;
+	if (it->prefix[0] && compare_directory_names(it->prefix,it->after)>0) start = it->prefix;
+	unsigned short leaf_address = load_btree_leaf_for_name(fp,directory_inode_id,start,it->block);
+	int count = 0;
+	while (leaf_address && count<max_entries)
+	{
+		int slot;
+		for (slot=0;slot<get_btree_leaf_header(it->block)[0] && count<max_entries;slot++)
+		{
+			char* entry = get_directory_leaf_slot(it->block,slot);
+			int range = compare_to_directory_iterator_range(it,entry+DIRECTORY_ENTRY_OFFSET);
+			if (range<0) continue;
+			if (range>0)
 			{
-//			printf("find_file_inode_id: could not find the file requested!\n");
-			return 0;
+				it->finished = 1;
+				return count;
 			}
+			fill_directory_entry_info(fp,&entries[count],entry,get_directory_leaf_types(it->block)[slot],get_directory_leaf_sizes(it->block)[slot]);
+			//the next batch resumes after the last name handed out
+			strncpy(it->after,entries[count].name,DIRECTORY_NAME_MAX);
+			count++;
 		}
+		if (count<max_entries) leaf_address = load_next_btree_leaf(fp,directory_inode_id,it->block);
+	}
+	if (!leaf_address) it->finished = 1;
+	return count;
+}
+
+//reads the next leaf, or the linear block, into the iterator. returns 0 once the directory is exhausted
+int load_directory_iterator_block(struct directory_iterator* it)
+{
+	FILE* fp = it->dir->fp;
+	unsigned char directory_inode_id = it->dir->inode_id;
+	it->hashed = get_directory_format(fp,directory_inode_id)==DIRECTORY_FORMAT_HASHED;
+	if (it->hashed)
+	{
+		char* root_block = get_directory_index(fp,directory_inode_id);
+		if (it->position >= get_directory_index_header(root_block)[0]) return 0;
+		read_block(fp,get_file_block_address(fp,directory_inode_id,get_directory_index_entry(root_block,it->position)[1]),it->block);
+		it->slot = 0;
+	}
+	else
+	{
+		if (it->position>0) return 0;
+		read_block(fp,get_file_block_address(fp,directory_inode_id,0),it->block);
+		//skipping "." and ".."
+		it->slot = 2;
+	}
+	it->block_loaded = 1;
+	return 1;
+}
+
+//fills entries with up to max_entries entries of the directory. returns how many, 0 at the end, -1 on a stale handle
+int read_directory_entries(struct directory_iterator* it, struct directory_entry_info* entries, int max_entries)
+{
+	if (!it || !directory_handle_is_usable(it->dir,"read_directory_entries")) return -1;
+	if (it->finished) return 0;
+	if (get_directory_format(it->dir->fp,it->dir->inode_id)==DIRECTORY_FORMAT_SORTED)
+	{
+		return read_sorted_directory_entries(it,entries,max_entries);
+	}
+	int count = 0;
+	while (count<max_entries)
+	{
+		if (!it->block_loaded && !load_directory_iterator_block(it))
+		{
+			it->finished = 1;
+			break;
+		}
+		if (it->slot >= (it->hashed ? DIRECTORY_LEAF_SLOTS : DIRECTORY_SLOTS_PER_BLOCK))
+		{
+			it->block_loaded = 0;
+			it->position++;
+			continue;
+		}
+		int slot = it->slot++;
+		char* entry = it->hashed ? get_directory_leaf_slot(it->block,slot) : it->block+slot*DIRECTORY_ELEMENT_SIZE;
+		if (!entry[DIRECTORY_ENTRY_OFFSET] || compare_to_directory_iterator_range(it,entry+DIRECTORY_ENTRY_OFFSET)) continue;
 		
-		
+		if (it->hashed) fill_directory_entry_info(it->dir->fp,&entries[count],entry,get_directory_leaf_types(it->block)[slot],get_directory_leaf_sizes(it->block)[slot]);
+		//not recorded in a linear directory, so the inode has to be read
+		else fill_directory_entry_info(it->dir->fp,&entries[count],entry,0,0);
+		count++;
 	}
-	
-	free(inode_map);
-	free(temp_directory_data_block);
-	free(temp_inode_data_block);
-	free(working_file_path);
-	return current_inode_id;
-	//store current directory inode id, initialized to 0 ie the root
-	//while token!= NULL
-		//look through the directory for the inode_id corresponding to the token
-		//if not found, return file not found error
-		//set current directory inode id to the matching string's inode id 
-		//set current directory inode id to the next token
-	
-	
-	return 0;
+	return count;
 }
 
 
 void init_vdisk(FILE* fp){
+	init_vdisk_with_journal(fp,JOURNAL_DEFAULT_BLOCKS);
+}
+
+//journal_blocks is the size of the metadata journal from block 3, at most JOURNAL_MAX_BLOCKS. past block 15 it
+//takes blocks from the data section
+void init_vdisk_with_journal(FILE* fp, unsigned int journal_blocks){
+	if (journal_blocks<JOURNAL_DEFAULT_BLOCKS) journal_blocks = JOURNAL_DEFAULT_BLOCKS;
+	if (journal_blocks>JOURNAL_MAX_BLOCKS) journal_blocks = JOURNAL_MAX_BLOCKS;
+	drop_vdisk_caches(fp);
+	journal.fp = NULL;
 	//FIRSTLY CLEARING ALL THE DATA FROM THE vdisk file
 	void* buffer = malloc(BYTES_PER_BLOCK);
 	memset(buffer,0,BYTES_PER_BLOCK);
@@ -1104,7 +5441,8 @@ void init_vdisk(FILE* fp){
 	memset(buffer,0,BYTES_PER_BLOCK);
 	((unsigned int*)buffer)[1] = 4096;
 	((unsigned int*)buffer)[2] = 256;
-	write_block(fp, 0, buffer, 12);
+	((unsigned int*)buffer)[SUPERBLOCK_JOURNAL_BLOCKS_OFFSET/4] = journal_blocks;
+	write_block(fp, 0, buffer, 16);
 	
 	
 	
@@ -1113,11 +5451,12 @@ void init_vdisk(FILE* fp){
 	
 	//SETTING THE first 16 blocks as unavailable because of superblock, FBV, and reserved spaces
 	memset(buffer,0,2);
+	for (index=DATA_SECTION_OFFSET;index<JOURNAL_OFFSET+journal_blocks;index++) ((unsigned char*)buffer)[index/8] &= ~(1<<(index%8));
 	
 	write_block(fp, FREE_BLOCK_VECTOR_OFFSET, buffer,BYTES_PER_BLOCK);
 	free(buffer);
 	//printf("init_vdisk: creating the root directory\n");
-	create_directory_from_inode(fp,-1,"");
+	create_directory_from_inode(fp,0,"");
 	
 }
 /*
@@ -0,0 +1,1017 @@
+#define _GNU_SOURCE
+#include "file.h"
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+//runs each newer call of the file system once, checks what comes back, and prints ok or FAILED for it
+//the vdisks it makes are its own (../vdisk3*), so app1 and app2 can run before or after it
+
+int failures=0;
+
+void report(char* test_name, int bad)
+{
+	printf("%-40s %s\n",test_name,bad?"FAILED":"ok");
+	if (bad)
+	{
+		failures++;
+	}
+}
+
+//reads a whole host file into a malloc'd buffer
+char* load_host_file(char* filename, size_t* length)
+{
+	FILE* fpin = fopen(filename,"rb");
+	if (fpin==NULL)
+	{
+		printf("could not open %s\n",filename);
+		exit(1);
+	}
+	fseek(fpin,0,SEEK_END);
+	*length = ftell(fpin);
+	fseek(fpin,0,SEEK_SET);
+	char* data = malloc(*length+1);
+	if (fread(data,1,*length,fpin)!=*length)
+	{
+		printf("could not read %s\n",filename);
+		exit(1);
+	}
+	fclose(fpin);
+	return data;
+}
+
+//1 when the host file holds exactly length bytes of data
+int host_file_matches(char* filename, const char* data, size_t length)
+{
+	size_t file_length;
+	char* file_data = load_host_file(filename,&file_length);
+	int matches = file_length==length && memcmp(file_data,data,length)==0;
+	free(file_data);
+	return matches;
+}
+
+//1 when the whole file at path on the vdisk holds exactly length bytes of data
+int vdisk_file_matches(FILE* fp, char* path, const char* data, size_t length)
+{
+	unsigned char inode_id = find_file_inode_id(fp,path);
+	if (inode_id==INODE_NOT_FOUND)
+	{
+		return 0;
+	}
+	char* buffer = malloc(length+512);
+	size_t read_length = read_file_range(fp,inode_id,0,buffer,length+512);
+	int matches = read_length==length && memcmp(buffer,data,length)==0;
+	free(buffer);
+	return matches;
+}
+
+int count_free_blocks(FILE* fp)
+{
+	char fbv[512];
+	read_block(fp,1,fbv);
+	int free_blocks=0;
+	for (int i=0;i<4096;i++)
+	{
+		free_blocks += (fbv[i/8]>>(i%8))&1;
+	}
+	return free_blocks;
+}
+
+
+struct chunked_source
+{
+	const char* data;
+	size_t length;
+	size_t position;
+};
+
+//hands out the data a few hundred bytes at a time, so upload_stream has to join the pieces into blocks
+size_t read_chunk(void* context, char* buffer, size_t length)
+{
+	struct chunked_source* source = context;
+	if (length>300)
+	{
+		length=300;
+	}
+	if (length>source->length-source->position)
+	{
+		length=source->length-source->position;
+	}
+	memcpy(buffer,source->data+source->position,length);
+	source->position+=length;
+	return length;
+}
+
+struct hashed_name
+{
+	char name[16];
+	unsigned int hash;
+};
+
+//the FNV-1a hash the library files names under, so names can be added in the order of their hashes
+unsigned int name_hash(char* name)
+{
+	unsigned int hash = 2166136261u;
+	for (int i=0;i<30 && name[i];i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int compare_hashed_names(const void* a, const void* b)
+{
+	unsigned int hash_a = ((const struct hashed_name*)a)->hash;
+	unsigned int hash_b = ((const struct hashed_name*)b)->hash;
+	return hash_a<hash_b ? -1 : hash_a>hash_b;
+}
+
+//a vdisk file which stops taking writes at a commit, as if the machine had stopped there. the commit is the write
+//of the journal descriptor, block 3, with a state other than empty in its bytes 8 and 9
+struct crashing_disk
+{
+	int fd;
+	off64_t position;
+	int armed;
+	int keep_descriptor; //whether the descriptor itself still reaches the file when the disk stops
+	int stopped;
+	int commits;
+};
+
+ssize_t crashing_read(void* context, char* buffer, size_t length)
+{
+	struct crashing_disk* disk = context;
+	ssize_t n = pread(disk->fd,buffer,length,disk->position);
+	if (n>0)
+	{
+		disk->position+=n;
+	}
+	return n;
+}
+
+ssize_t crashing_write(void* context, const char* buffer, size_t length)
+{
+	struct crashing_disk* disk = context;
+	int commit = disk->position==3*512 && length>=512 && *(unsigned short*)(buffer+8)!=0;
+	if (commit)
+	{
+		disk->commits++;
+	}
+	if (commit && disk->armed && !disk->stopped)
+	{
+		disk->stopped=1;
+		if (disk->keep_descriptor && pwrite(disk->fd,buffer,length,disk->position)!=(ssize_t)length)
+		{
+			return -1;
+		}
+	}
+	if (!disk->stopped && pwrite(disk->fd,buffer,length,disk->position)!=(ssize_t)length)
+	{
+		return -1;
+	}
+	//what comes after the crash is lost, though the caller is told it was written
+	disk->position+=length;
+	return length;
+}
+
+int crashing_seek(void* context, off64_t* offset, int whence)
+{
+	struct crashing_disk* disk = context;
+	if (whence==SEEK_SET)
+	{
+		disk->position = *offset;
+	}
+	else if (whence==SEEK_CUR)
+	{
+		disk->position += *offset;
+	}
+	else
+	{
+		disk->position = lseek(disk->fd,0,SEEK_END)+*offset;
+	}
+	*offset = disk->position;
+	return 0;
+}
+
+int crashing_close(void* context)
+{
+	struct crashing_disk* disk = context;
+	return close(disk->fd);
+}
+
+FILE* open_crashing_disk(char* filename, struct crashing_disk* disk)
+{
+	cookie_io_functions_t functions = {crashing_read,crashing_write,crashing_seek,crashing_close};
+	memset(disk,0,sizeof(*disk));
+	disk->fd = open(filename,O_RDWR);
+	return fopencookie(disk,"r+",functions);
+}
+
+int main(int argc,char* argv[] )
+{
+	printf("Running tests of the newer file system calls\n");
+	size_t small_length;
+	char* small_data = load_host_file("../app1/smalltestfile",&small_length);
+	size_t large_length;
+	char* large_data = load_host_file("../app1/largetestfile",&large_length);
+	//the test files are small, so the bigger files are made up here
+	size_t big_length = 150000;
+	char* big_data = malloc(big_length);
+	srand(1);
+	for (size_t i=0;i<big_length;i++)
+	{
+		big_data[i] = 'a'+rand()%26;
+	}
+	char name[64], path[128];
+	int bad;
+
+	FILE* fp = fopen("../vdisk3","wb+");
+	init_vdisk(fp);
+
+	create_directory(fp,"/","testdir3");
+
+	//upload_file, download_file, read_file_range
+	bad=0;
+	FILE* fpin = fopen("../app1/largetestfile","rb");
+	upload_file(fp,"/testdir3/","largetestfile",fpin);
+	fclose(fpin);
+	fpin = fopen("../app1/smalltestfile","rb");
+	upload_file(fp,"/testdir3/","smalltestfile",fpin);
+	fclose(fpin);
+	download_file(fp,"/testdir3/largetestfile","downloadedlargetestfile");
+	download_file(fp,"/testdir3/smalltestfile","downloadedsmalltestfile");
+	bad |= !host_file_matches("downloadedlargetestfile",large_data,large_length);
+	bad |= !host_file_matches("downloadedsmalltestfile",small_data,small_length);
+	report("upload and download",bad);
+
+	//random reads go through the block map cache
+	bad=0;
+	{
+		unsigned char inode_id = find_file_inode_id(fp,"/testdir3/largetestfile");
+		char buffer[3000];
+		srand(3);
+		for (int i=0;i<200;i++)
+		{
+			size_t offset = rand()%(large_length+100);
+			size_t length = rand()%sizeof(buffer);
+			size_t expected = offset>=large_length ? 0 : (offset+length>large_length ? large_length-offset : length);
+			if (read_file_range(fp,inode_id,offset,buffer,length)!=expected || memcmp(buffer,large_data+offset,expected))
+			{
+				bad=1;
+			}
+		}
+	}
+	report("read_file_range",bad);
+
+	//a file past the single indirection block, 10 direct and 256 indirect blocks, is read through double indirection
+	bad=0;
+	{
+		unsigned char inode_id = upload_buffer(fp,"/testdir3","big",big_data,big_length);
+		download_file(fp,"/testdir3/big","downloadedbig");
+		bad |= !host_file_matches("downloadedbig",big_data,big_length);
+		char buffer[3000];
+		size_t boundary = 266*512;
+		for (size_t offset=boundary-2000;offset<boundary+2000;offset+=333)
+		{
+			bad |= read_file_range(fp,inode_id,offset,buffer,sizeof(buffer))!=sizeof(buffer);
+			bad |= memcmp(buffer,big_data+offset,sizeof(buffer))!=0;
+		}
+	}
+	report("reads through double indirection",bad);
+
+	//many files in one directory, spread over several leaves
+	bad=0;
+	create_directory(fp,"/","many");
+	unsigned char many_ids[100];
+	for (int i=0;i<100;i++)
+	{
+		sprintf(name,"a_fairly_long_file_name_%d",i);
+		many_ids[i] = upload_buffer(fp,"/many",name,small_data,i*7);
+	}
+	for (int i=0;i<100;i++)
+	{
+		sprintf(path,"/many/a_fairly_long_file_name_%d",i);
+		bad |= find_file_inode_id(fp,path)!=many_ids[i] || many_ids[i]==INODE_NOT_FOUND;
+	}
+	report("lookups in a large directory",bad);
+
+	//names of the longest length which differ only in their last character have different hashes to compare
+	bad=0;
+	{
+		create_directory(fp,"/","hashed");
+		unsigned char ids[26];
+		for (int i=0;i<26;i++)
+		{
+			sprintf(name,"a_name_of_twenty_nine_letters%c",'a'+i);
+			ids[i] = upload_buffer(fp,"/hashed",name,small_data,i);
+			bad |= strlen(name)!=30 || ids[i]==INODE_NOT_FOUND;
+		}
+		for (int i=0;i<26;i++)
+		{
+			sprintf(path,"/hashed/a_name_of_twenty_nine_letters%c",'a'+i);
+			bad |= find_file_inode_id(fp,path)!=ids[i];
+		}
+		bad |= find_file_inode_id(fp,"/hashed/a_name_of_twenty_nine_letters")!=INODE_NOT_FOUND;
+	}
+	report("lookups by name hash",bad);
+
+	//cached paths must follow the vdisk when it is closed and opened again
+	bad=0;
+	{
+		unsigned char inode_id = find_file_inode_id(fp,"/testdir3/largetestfile");
+		close_vdisk(fp);
+		fp = fopen("../vdisk3","rb+");
+		bad |= find_file_inode_id(fp,"/testdir3/largetestfile")!=inode_id;
+		bad |= !vdisk_file_matches(fp,"/testdir3/largetestfile",large_data,large_length);
+		bad |= !vdisk_file_matches(fp,"/testdir3/big",big_data,big_length);
+
+		//a fresh vdisk in the same file must not answer from what was cached about the old one
+		FILE* other = fopen("../vdisk3_fresh","wb+");
+		init_vdisk(other);
+		create_directory(other,"/","stale");
+		upload_buffer(other,"/stale","file",small_data,small_length);
+		bad |= !file_exists(other,"/stale/file");
+		close_vdisk(other);
+		other = fopen("../vdisk3_fresh","wb+");
+		init_vdisk(other);
+		bad |= find_file_inode_id(other,"/stale/file")!=INODE_NOT_FOUND;
+		create_directory(other,"/","stale");
+		bad |= file_exists(other,"/stale/file");
+		close_vdisk(other);
+	}
+	report("reopening a vdisk",bad);
+
+	//a missing path is remembered as missing only until it is made
+	bad=0;
+	bad |= !file_exists(fp,"/") || !file_exists(fp,"/many/a_fairly_long_file_name_42");
+	bad |= file_exists(fp,"/many/no_such_file") || file_exists(fp,"/no_such_directory/file");
+	bad |= file_exists(fp,"/many/no_such_file");
+	upload_buffer(fp,"/many","no_such_file",small_data,10);
+	bad |= !file_exists(fp,"/many/no_such_file");
+	delete_filepath(fp,"/many/no_such_file");
+	bad |= file_exists(fp,"/many/no_such_file");
+	create_directory(fp,"/","no_such_directory");
+	bad |= file_exists(fp,"/no_such_directory/file");
+	upload_buffer(fp,"/no_such_directory","file",small_data,10);
+	bad |= !file_exists(fp,"/no_such_directory/file");
+	report("file_exists and missing paths",bad);
+
+	//directory handles and calls relative to them
+	bad=0;
+	{
+		create_directory(fp,"/","handles");
+		struct directory_handle* dir = open_directory(fp,"/handles");
+		fpin = fopen("../app1/smalltestfile","rb");
+		unsigned char inode_id = upload_file_at(dir,"small",fpin);
+		fclose(fpin);
+		bad |= inode_id==INODE_NOT_FOUND || find_file_inode_id_at(dir,"small")!=inode_id;
+		bad |= find_file_inode_id(fp,"/handles/small")!=inode_id;
+		download_file_at(dir,"small","downloadedsmall");
+		bad |= !host_file_matches("downloadedsmall",small_data,small_length);
+		create_directory_at(dir,"sub");
+		struct directory_handle* sub = open_directory_at(dir,"sub");
+		upload_buffer(fp,"/handles/sub","inner",large_data,5000);
+		bad |= find_file_inode_id_at(sub,"inner")==INODE_NOT_FOUND;
+		bad |= rename_file_at(sub,"inner",dir,"outer")!=0;
+		bad |= !vdisk_file_matches(fp,"/handles/outer",large_data,5000);
+		bad |= delete_file_at(dir,"outer")!=0 || delete_file_at(dir,"outer")!=-1;
+		bad |= file_exists(fp,"/handles/outer");
+		close_directory(sub);
+		close_directory(dir);
+	}
+	report("directory handles",bad);
+
+	//the iterator hands out every entry once, with its type and size
+	bad=0;
+	{
+		struct directory_handle* dir = open_directory(fp,"/many");
+		struct directory_iterator* it = open_directory_iterator(dir);
+		struct directory_entry_info entries[16];
+		int total=0, count;
+		while ((count=read_directory_entries(it,entries,16))>0)
+		{
+			for (int i=0;i<count;i++)
+			{
+				int number = atoi(entries[i].name+strlen("a_fairly_long_file_name_"));
+				bad |= entries[i].type!='f' || entries[i].inode_id!=find_file_inode_id_at(dir,entries[i].name);
+				bad |= entries[i].size!=(unsigned long long)number*7;
+			}
+			total+=count;
+		}
+		close_directory_iterator(it);
+		close_directory(dir);
+		bad |= total!=100;
+	}
+	report("directory iterator",bad);
+
+	//a sorted directory lists a prefix in order
+	bad=0;
+	{
+		create_sorted_directory(fp,"/","sorted");
+		for (int i=99;i>=0;i--)
+		{
+			sprintf(name,"log-%02d-%03d",i%10,i);
+			bad |= upload_buffer(fp,"/sorted",name,small_data,100)==INODE_NOT_FOUND;
+		}
+		struct directory_handle* dir = open_directory(fp,"/sorted");
+		struct directory_iterator* it = open_directory_iterator_from(dir,NULL,"log-03-");
+		struct directory_entry_info entries[4];
+		char last[31]="";
+		int total=0, count;
+		while ((count=read_directory_entries(it,entries,4))>0)
+		{
+			for (int i=0;i<count;i++)
+			{
+				bad |= strncmp(entries[i].name,"log-03-",7)!=0 || strcmp(last,entries[i].name)>=0;
+				strcpy(last,entries[i].name);
+			}
+			total+=count;
+		}
+		close_directory_iterator(it);
+		close_directory(dir);
+		bad |= total!=10;
+		bad |= find_file_inode_id(fp,"/sorted/log-07-057")==INODE_NOT_FOUND;
+	}
+	report("sorted directory listing",bad);
+
+	//a path that goes through a file finds nothing, and nothing can be made there
+	bad=0;
+	bad |= find_file_inode_id(fp,"/testdir3/smalltestfile/x")!=INODE_NOT_FOUND;
+	bad |= file_exists(fp,"/testdir3/smalltestfile/x");
+	bad |= upload_buffer(fp,"/testdir3/smalltestfile","x",small_data,10)!=INODE_NOT_FOUND;
+	create_directory(fp,"/testdir3/smalltestfile","x");
+	bad |= file_exists(fp,"/testdir3/smalltestfile/x");
+	bad |= !vdisk_file_matches(fp,"/testdir3/smalltestfile",small_data,small_length);
+	//a path longer than any fixed buffer is walked in place, and a component too long for a name names nothing
+	{
+		char* long_path = malloc(4096);
+		memset(long_path,'/',3000);
+		strcpy(long_path+3000,"testdir3//////smalltestfile");
+		bad |= find_file_inode_id(fp,long_path)!=find_file_inode_id(fp,"/testdir3/smalltestfile");
+		bad |= file_exists(fp,"/testdir3/smalltestfile_with_a_name_past_thirty_characters");
+		free(long_path);
+	}
+	report("path through a regular file",bad);
+
+	//create_directory_path makes what is missing, and stops at a component it cannot make
+	bad=0;
+	bad |= create_directory_path(fp,"/deep/er/and/deeper")==INODE_NOT_FOUND;
+	bad |= create_directory_path(fp,"/deep/er/and/deeper")!=find_file_inode_id(fp,"/deep/er/and/deeper");
+	bad |= create_directory_path(fp,"/deep/er/more")!=find_file_inode_id(fp,"/deep/er/more");
+	bad |= create_directory_path(fp,"/testdir3/smalltestfile/x/y")!=INODE_NOT_FOUND;
+	bad |= create_directory_path(fp,"/deep/a_directory_name_past_thirty_characters/x")!=INODE_NOT_FOUND;
+	bad |= file_exists(fp,"/deep/a_directory_name_past_thirty_characters");
+	report("create_directory_path",bad);
+
+	//rename_file moves files and whole directories without copying them
+	bad=0;
+	{
+		upload_buffer(fp,"/deep/er/and/deeper","leaf",big_data,20000);
+		int free_before = count_free_blocks(fp);
+		bad |= rename_file(fp,"/deep/er/and/deeper/leaf","/deep/leaf")!=0;
+		bad |= file_exists(fp,"/deep/er/and/deeper/leaf") || !vdisk_file_matches(fp,"/deep/leaf",big_data,20000);
+		bad |= rename_file(fp,"/deep/er","/moved")!=0;
+		bad |= file_exists(fp,"/deep/er") || !file_exists(fp,"/moved/and/deeper");
+		bad |= rename_file(fp,"/deep/nothing","/deep/something")!=-1;
+		bad |= count_free_blocks(fp)!=free_before;
+	}
+	report("rename_file",bad);
+
+	//sources whose length is not known up front
+	bad=0;
+	create_directory(fp,"/","uploads");
+	{
+		int pipe_fds[2];
+		if (pipe(pipe_fds)==0)
+		{
+			pid_t child = fork();
+			if (child==0)
+			{
+				close(pipe_fds[0]);
+				size_t written=0;
+				while (written<big_length)
+				{
+					ssize_t n = write(pipe_fds[1],big_data+written,big_length-written);
+					if (n<=0)
+					{
+						_exit(1);
+					}
+					written+=n;
+				}
+				_exit(0);
+			}
+			close(pipe_fds[1]);
+			upload_fd(fp,"/uploads","from_pipe",pipe_fds[0]);
+			close(pipe_fds[0]);
+			waitpid(child,NULL,0);
+			bad |= !vdisk_file_matches(fp,"/uploads/from_pipe",big_data,big_length);
+		}
+		else
+		{
+			bad=1;
+		}
+	}
+	report("upload_fd from a pipe",bad);
+
+	bad=0;
+	{
+		struct chunked_source source = {big_data,big_length,0};
+		upload_stream(fp,"/uploads","streamed",read_chunk,&source);
+		bad |= !vdisk_file_matches(fp,"/uploads/streamed",big_data,big_length);
+	}
+	report("upload_stream",bad);
+
+	//uploads straight from memory
+	bad=0;
+	{
+		upload_buffer(fp,"/uploads","buffered",big_data,big_length);
+		bad |= !vdisk_file_matches(fp,"/uploads/buffered",big_data,big_length);
+		upload_buffer(fp,"/uploads","empty",large_data,0);
+		bad |= !vdisk_file_matches(fp,"/uploads/empty",large_data,0);
+		struct iovec pieces[3];
+		pieces[0].iov_base = small_data;
+		pieces[0].iov_len = small_length;
+		pieces[1].iov_base = big_data;
+		pieces[1].iov_len = 777;
+		pieces[2].iov_base = big_data+777;
+		pieces[2].iov_len = 40000;
+		upload_iovec(fp,"/uploads","gathered",pieces,3);
+		char* joined = malloc(small_length+40777);
+		memcpy(joined,small_data,small_length);
+		memcpy(joined+small_length,big_data,40777);
+		bad |= !vdisk_file_matches(fp,"/uploads/gathered",joined,small_length+40777);
+		free(joined);
+	}
+	report("upload_buffer and upload_iovec",bad);
+
+	//a file whose name cannot be added to its directory is not left behind
+	bad=0;
+	{
+		int free_before = count_free_blocks(fp);
+		char* long_name = "a_file_name_that_is_past_thirty_characters";
+		bad |= upload_buffer(fp,"/uploads",long_name,big_data,big_length)!=INODE_NOT_FOUND;
+		struct chunked_source source = {big_data,big_length,0};
+		bad |= upload_stream(fp,"/uploads",long_name,read_chunk,&source)!=INODE_NOT_FOUND;
+		bad |= count_free_blocks(fp)!=free_before;
+	}
+	report("upload with a name too long",bad);
+
+	//names added in the order of their hashes, with the older ones deleted, split leaf after leaf until the
+	//directory index is full. the upload which finds it full must give back all it took
+	bad=0;
+	{
+		FILE* full_fp = fopen("../vdisk3_full","wb+");
+		init_vdisk(full_fp);
+		create_directory(full_fp,"/","full");
+		int name_count = 1000;
+		struct hashed_name* names = malloc(name_count*sizeof(struct hashed_name));
+		for (int i=0;i<name_count;i++)
+		{
+			sprintf(names[i].name,"churn_%d",i);
+			names[i].hash = name_hash(names[i].name);
+		}
+		qsort(names,name_count,sizeof(struct hashed_name),compare_hashed_names);
+		int oldest=0, added=0, found_full=0;
+		for (int i=0;i<name_count && !found_full;i++)
+		{
+			int free_before = count_free_blocks(full_fp);
+			if (upload_buffer(full_fp,"/full",names[i].name,big_data,600)==INODE_NOT_FOUND)
+			{
+				found_full=1;
+				sprintf(path,"/full/%s",names[i].name);
+				bad |= file_exists(full_fp,path) || count_free_blocks(full_fp)!=free_before;
+				continue;
+			}
+			added++;
+			//13 names in the newest leaf split it, and the 6 with the lowest hashes went to the leaf below
+			if (i-oldest+1==13)
+			{
+				for (int j=0;j<6;j++,oldest++)
+				{
+					sprintf(path,"/full/%s",names[oldest].name);
+					delete_filepath(full_fp,path);
+				}
+			}
+		}
+		bad |= !found_full;
+		//the names not deleted are all still there
+		for (int i=oldest;i<added;i++)
+		{
+			sprintf(path,"/full/%s",names[i].name);
+			bad |= !vdisk_file_matches(full_fp,path,big_data,600);
+		}
+		printf("the directory was full after %d names\n",added);
+		free(names);
+		close_vdisk(full_fp);
+	}
+	report("upload to a full directory",bad);
+
+	//several host files uploaded by a pool of workers
+	bad=0;
+	{
+		struct bulk_upload_item items[3];
+		items[0].host_path="../app1/largetestfile";
+		items[0].parent_path="/uploads";
+		items[0].name="bulk_large";
+		items[1].host_path="../app1/smalltestfile";
+		items[1].parent_path="/uploads";
+		items[1].name="bulk_small";
+		items[2].host_path="../app1/no_such_file";
+		items[2].parent_path="/uploads";
+		items[2].name="bulk_missing";
+		bad |= bulk_upload(fp,items,3,2)!=2 || items[2].inode_id!=INODE_NOT_FOUND;
+		bad |= find_file_inode_id(fp,"/uploads/bulk_large")!=items[0].inode_id;
+		bad |= !vdisk_file_matches(fp,"/uploads/bulk_large",large_data,large_length);
+		bad |= !vdisk_file_matches(fp,"/uploads/bulk_small",small_data,small_length);
+		bad |= file_exists(fp,"/uploads/bulk_missing");
+	}
+	report("bulk_upload",bad);
+
+	//the journal
+	bad=0;
+	{
+		FILE* journal_fp = fopen("../vdisk3_journal","wb+");
+		init_vdisk_with_journal(journal_fp,40);
+		create_directory_path(journal_fp,"/journaled/dir");
+		upload_buffer(journal_fp,"/journaled/dir","file",big_data,big_length);
+		close_vdisk(journal_fp);
+		journal_fp = fopen("../vdisk3_journal","rb+");
+		bad |= recover_vdisk(journal_fp)<0;
+		bad |= !vdisk_file_matches(journal_fp,"/journaled/dir/file",big_data,big_length);
+		bad |= recover_vdisk(journal_fp)!=0;
+		close_vdisk(journal_fp);
+	}
+	report("journal and recover_vdisk",bad);
+
+	//crashes around the commit of an upload on a vdisk with the default journal. an upload with deduplication
+	//changes more blocks than the journal holds, and is still one transaction
+	bad=0;
+	{
+		struct crashing_disk disk;
+		FILE* crash_fp = fopen("../vdisk3_crash","wb+");
+		init_vdisk(crash_fp);
+		create_directory(crash_fp,"/","crash");
+		bad |= enable_deduplication(crash_fp)!=0;
+		//the directory's first leaf stays once made, so it is made before free blocks are counted
+		upload_buffer(crash_fp,"/crash","resident",small_data,small_length);
+		close_vdisk(crash_fp);
+		size_t length = 100000;
+
+		crash_fp = open_crashing_disk("../vdisk3_crash",&disk);
+		int free_before = count_free_blocks(crash_fp);
+		upload_buffer(crash_fp,"/crash","first",big_data,length);
+		bad |= disk.commits!=1;
+		delete_filepath(crash_fp,"/crash/first");
+		bad |= count_free_blocks(crash_fp)!=free_before;
+		//committed, but none of its blocks is home yet
+		disk.armed=1;
+		disk.keep_descriptor=1;
+		upload_buffer(crash_fp,"/crash","committed",big_data,length);
+		bad |= !disk.stopped;
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_crash","rb+");
+		bad |= file_exists(crash_fp,"/crash/committed");
+		bad |= recover_vdisk(crash_fp)<=0;
+		bad |= !vdisk_file_matches(crash_fp,"/crash/committed",big_data,length);
+		close_vdisk(crash_fp);
+
+		//stopped just before the commit, the upload is lost whole and what came before it stays
+		crash_fp = open_crashing_disk("../vdisk3_crash",&disk);
+		disk.armed=1;
+		upload_buffer(crash_fp,"/crash","uncommitted",big_data+1000,length);
+		bad |= !disk.stopped;
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_crash","rb+");
+		bad |= recover_vdisk(crash_fp)!=0;
+		bad |= file_exists(crash_fp,"/crash/uncommitted");
+		bad |= !vdisk_file_matches(crash_fp,"/crash/committed",big_data,length);
+		bad |= !vdisk_file_matches(crash_fp,"/crash/resident",small_data,small_length);
+
+		//a small operation fits in the journal itself
+		close_vdisk(crash_fp);
+		crash_fp = open_crashing_disk("../vdisk3_crash",&disk);
+		disk.armed=1;
+		disk.keep_descriptor=1;
+		create_directory(crash_fp,"/","small");
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_crash","rb+");
+		bad |= recover_vdisk(crash_fp)<=0;
+		bad |= !file_exists(crash_fp,"/small");
+		bad |= !vdisk_file_matches(crash_fp,"/crash/committed",big_data,length);
+		close_vdisk(crash_fp);
+	}
+	report("crashes around a journal commit",bad);
+
+	//log-structured mode
+	bad=0;
+	{
+		FILE* log_fp = fopen("../vdisk3_log","wb+");
+		init_vdisk(log_fp);
+		bad |= mount_log_structured(log_fp)!=0;
+		create_directory_path(log_fp,"/log/files");
+		for (int i=0;i<20;i++)
+		{
+			sprintf(name,"f%d",i);
+			upload_buffer(log_fp,"/log/files",name,big_data,(i+1)*1500);
+		}
+		for (int i=0;i<20;i+=2)
+		{
+			sprintf(path,"/log/files/f%d",i);
+			delete_filepath(log_fp,path);
+		}
+		unmount_log_structured(log_fp);
+		for (int i=0;i<20;i++)
+		{
+			sprintf(path,"/log/files/f%d",i);
+			bad |= i%2==0 ? file_exists(log_fp,path) : !vdisk_file_matches(log_fp,path,big_data,(i+1)*1500);
+		}
+		close_vdisk(log_fp);
+	}
+	report("log-structured mode",bad);
+
+	//the inode map checkpoint of the log is part of each transaction, so a crash before the commit leaves it as it was
+	bad=0;
+	{
+		struct crashing_disk disk;
+		FILE* crash_fp = fopen("../vdisk3_log_crash","wb+");
+		init_vdisk(crash_fp);
+		create_directory(crash_fp,"/","log");
+		close_vdisk(crash_fp);
+
+		crash_fp = open_crashing_disk("../vdisk3_log_crash",&disk);
+		bad |= mount_log_structured(crash_fp)!=0;
+		upload_buffer(crash_fp,"/log","kept",big_data,20000);
+		disk.armed=1;
+		upload_buffer(crash_fp,"/log","lost",big_data+1000,20000);
+		bad |= !disk.stopped;
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_log_crash","rb+");
+		recover_vdisk(crash_fp);
+		bad |= file_exists(crash_fp,"/log/lost");
+		bad |= !vdisk_file_matches(crash_fp,"/log/kept",big_data,20000);
+		close_vdisk(crash_fp);
+
+		//an append moves the inode of the file, and the checkpoint must not point at where it would have gone
+		crash_fp = open_crashing_disk("../vdisk3_log_crash",&disk);
+		bad |= mount_log_structured(crash_fp)!=0;
+		disk.armed=1;
+		append_to_file(crash_fp,find_file_inode_id(crash_fp,"/log/kept"),big_data+20000,3000);
+		bad |= !disk.stopped;
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_log_crash","rb+");
+		recover_vdisk(crash_fp);
+		bad |= !vdisk_file_matches(crash_fp,"/log/kept",big_data,20000);
+		close_vdisk(crash_fp);
+
+		crash_fp = open_crashing_disk("../vdisk3_log_crash",&disk);
+		bad |= mount_log_structured(crash_fp)!=0;
+		disk.armed=1;
+		disk.keep_descriptor=1;
+		upload_buffer(crash_fp,"/log","replayed",big_data+2000,20000);
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_log_crash","rb+");
+		bad |= recover_vdisk(crash_fp)<=0;
+		bad |= !vdisk_file_matches(crash_fp,"/log/replayed",big_data+2000,20000);
+		bad |= !vdisk_file_matches(crash_fp,"/log/kept",big_data,20000);
+		close_vdisk(crash_fp);
+	}
+	report("crashes in log-structured mode",bad);
+
+	//the segment cleaner moves live blocks and keeps what they hold
+	bad=0;
+	{
+		FILE* log_fp = fopen("../vdisk3_log","rb+");
+		bad |= set_cleaner_budget(log_fp,0)!=-1;
+		bad |= mount_log_structured(log_fp)!=0;
+		//with no budget, cleaning happens only when asked for
+		bad |= set_cleaner_budget(log_fp,0)!=0;
+		for (int round=0;round<8;round++)
+		{
+			for (int i=1;i<20;i+=2)
+			{
+				sprintf(name,"f%d",i);
+				sprintf(path,"/log/files/f%d",i);
+				delete_filepath(log_fp,path);
+				upload_buffer(log_fp,"/log/files",name,big_data+round,(i+1)*1500);
+			}
+		}
+		int free_before = count_free_blocks(log_fp);
+		int moved = clean_segments(log_fp,1000);
+		bad |= moved<=0 || count_free_blocks(log_fp)!=free_before;
+		//and with a budget again, each commit cleans a little
+		bad |= set_cleaner_budget(log_fp,16)!=0;
+		for (int i=1;i<20;i+=2)
+		{
+			sprintf(path,"/log/files/f%d",i);
+			bad |= write_file_range(log_fp,find_file_inode_id(log_fp,path),0,"rewritten",9)!=9;
+		}
+		unmount_log_structured(log_fp);
+		char* expected = malloc(30000);
+		for (int i=0;i<20;i++)
+		{
+			sprintf(path,"/log/files/f%d",i);
+			memcpy(expected,big_data+7,(i+1)*1500);
+			memcpy(expected,"rewritten",9);
+			bad |= i%2==0 ? file_exists(log_fp,path) : !vdisk_file_matches(log_fp,path,expected,(i+1)*1500);
+		}
+		free(expected);
+		printf("the cleaner moved %d blocks\n",moved);
+		close_vdisk(log_fp);
+	}
+	report("clean_segments and set_cleaner_budget",bad);
+
+	//deferred commits reach the disk with the next sync or the next commit, and a crash before that loses them whole
+	bad=0;
+	{
+		FILE* deferred_fp = fopen("../vdisk3_crash","rb+");
+		begin_metadata_batch(deferred_fp);
+		upload_buffer(deferred_fp,"/crash","deferred",small_data,small_length);
+		commit_metadata_batch_with_durability(deferred_fp,DURABILITY_DEFERRED);
+		bad |= !file_exists(deferred_fp,"/crash/deferred");
+		sync_vdisk(deferred_fp);
+		FILE* other = fopen("../vdisk3_crash","rb");
+		bad |= !vdisk_file_matches(other,"/crash/deferred",small_data,small_length);
+		close_vdisk(other);
+		close_vdisk(deferred_fp);
+
+		struct crashing_disk disk;
+		FILE* crash_fp = open_crashing_disk("../vdisk3_crash",&disk);
+		for (int i=0;i<5;i++)
+		{
+			sprintf(name,"deferred_%d",i);
+			begin_metadata_batch(crash_fp);
+			upload_buffer(crash_fp,"/crash",name,big_data,3000*(i+1));
+			commit_metadata_batch_with_durability(crash_fp,DURABILITY_DEFERRED);
+		}
+		bad |= disk.commits!=0;
+		//the next operation which is not deferred commits them all with it, in one transaction
+		disk.armed=1;
+		upload_buffer(crash_fp,"/crash","not_deferred",big_data,3000);
+		bad |= disk.commits!=1;
+		close_vdisk(crash_fp);
+		crash_fp = fopen("../vdisk3_crash","rb+");
+		recover_vdisk(crash_fp);
+		for (int i=0;i<5;i++)
+		{
+			sprintf(path,"/crash/deferred_%d",i);
+			bad |= file_exists(crash_fp,path);
+		}
+		bad |= file_exists(crash_fp,"/crash/not_deferred");
+		bad |= !vdisk_file_matches(crash_fp,"/crash/committed",big_data,100000);
+		close_vdisk(crash_fp);
+	}
+	report("deferred commit and sync_vdisk",bad);
+
+	//writing into files that already exist
+	bad=0;
+	{
+		FILE* rw_fp = fopen("../vdisk3_rw","wb+");
+		init_vdisk(rw_fp);
+		create_directory(rw_fp,"/","rw");
+		size_t length = 60000;
+		char* model = malloc(length+4000);
+		memcpy(model,big_data,length);
+		unsigned char inode_id = upload_buffer(rw_fp,"/rw","rewritten",model,length);
+		int free_before = count_free_blocks(rw_fp);
+		bad |= write_file_range(rw_fp,inode_id,1000,"in place",8)!=8;
+		memcpy(model+1000,"in place",8);
+		bad |= write_file_range(rw_fp,inode_id,511,small_data,600)!=600;
+		memcpy(model+511,small_data,600);
+		//blocks the file has are written where they are
+		bad |= count_free_blocks(rw_fp)!=free_before;
+		bad |= write_file_range(rw_fp,inode_id,length+3000,"past the end",12)!=12;
+		memset(model+length,0,3000);
+		memcpy(model+length+3000,"past the end",12);
+		length+=3012;
+		bad |= !vdisk_file_matches(rw_fp,"/rw/rewritten",model,length);
+		free(model);
+		close_vdisk(rw_fp);
+	}
+	report("write_file_range",bad);
+
+	//appending, in pieces which do not end on block boundaries
+	bad=0;
+	{
+		FILE* rw_fp = fopen("../vdisk3_rw","rb+");
+		unsigned char inode_id = upload_buffer(rw_fp,"/rw","appended",big_data,1000);
+		size_t length = 1000;
+		for (int i=0;i<40;i++)
+		{
+			size_t piece = 37+i*61;
+			bad |= append_to_file(rw_fp,inode_id,big_data+length,piece)!=piece;
+			length+=piece;
+		}
+		bad |= !vdisk_file_matches(rw_fp,"/rw/appended",big_data,length);
+		close_vdisk(rw_fp);
+	}
+	report("append_to_file",bad);
+
+	//cutting a file gives its tail blocks back, and growing it reads as zeros
+	bad=0;
+	{
+		FILE* rw_fp = fopen("../vdisk3_rw","rb+");
+		char* model = malloc(9000);
+		memcpy(model,big_data,7000);
+		memset(model+7000,0,2000);
+		unsigned char inode_id = upload_buffer(rw_fp,"/rw","truncated",big_data,big_length);
+		int free_before = count_free_blocks(rw_fp);
+		bad |= truncate_file(rw_fp,inode_id,7000)!=0;
+		bad |= !vdisk_file_matches(rw_fp,"/rw/truncated",model,7000);
+		//14 blocks are kept of the 293, and the indirection blocks go too
+		bad |= count_free_blocks(rw_fp)-free_before<293-14;
+		bad |= truncate_file(rw_fp,inode_id,9000)!=0;
+		bad |= !vdisk_file_matches(rw_fp,"/rw/truncated",model,9000);
+		bad |= truncate_file(rw_fp,inode_id,0)!=0;
+		bad |= !vdisk_file_matches(rw_fp,"/rw/truncated",model,0);
+		free(model);
+		close_vdisk(rw_fp);
+	}
+	report("truncate_file",bad);
+
+	//deduplication, including blocks repeated inside one file
+	bad=0;
+	{
+		FILE* dedup_fp = fopen("../vdisk3_dedup","wb+");
+		init_vdisk(dedup_fp);
+		create_directory(dedup_fp,"/","dedup");
+		bad |= enable_deduplication(dedup_fp)!=0;
+		size_t length = 40*512;
+		char* repeated = malloc(length);
+		for (size_t i=0;i<length;i+=512)
+		{
+			memcpy(repeated+i,large_data,512);
+		}
+		int free_before = count_free_blocks(dedup_fp);
+		upload_buffer(dedup_fp,"/dedup","repeated",repeated,length);
+		int used_first = free_before-count_free_blocks(dedup_fp);
+		//40 equal blocks, the inode and an indirection block
+		bad |= used_first>4;
+		free_before = count_free_blocks(dedup_fp);
+		unsigned char copy_id = upload_buffer(dedup_fp,"/dedup","copy",big_data,big_length);
+		int used_copy = free_before-count_free_blocks(dedup_fp);
+		free_before = count_free_blocks(dedup_fp);
+		upload_buffer(dedup_fp,"/dedup","second_copy",big_data,big_length);
+		int used_second = free_before-count_free_blocks(dedup_fp);
+		bad |= used_second>4 || used_copy<(int)(big_length/512);
+		//a shared block which is written to is copied first, so the other file keeps its data
+		bad |= write_file_range(dedup_fp,copy_id,0,"changed",7)!=7;
+		bad |= !vdisk_file_matches(dedup_fp,"/dedup/second_copy",big_data,big_length);
+		bad |= !vdisk_file_matches(dedup_fp,"/dedup/repeated",repeated,length);
+		//deleting one of the files which share blocks frees none of those. it frees its inode, its three
+		//indirection blocks, and its first block, which the write above made its own
+		free_before = count_free_blocks(dedup_fp);
+		delete_filepath(dedup_fp,"/dedup/second_copy");
+		bad |= count_free_blocks(dedup_fp)-free_before!=5;
+		bad |= !vdisk_file_matches(dedup_fp,"/dedup/repeated",repeated,length);
+		printf("the repeated file took %d blocks, the second copy %d\n",used_first,used_second);
+		free(repeated);
+		close_vdisk(dedup_fp);
+	}
+	report("deduplication",bad);
+
+	//compression
+	bad=0;
+	{
+		size_t length=0;
+		char* text = malloc(200000);
+		while (length<190000)
+		{
+			length += sprintf(text+length,"line %zu of a file that compresses well\n",length%1000);
+		}
+		create_directory(fp,"/","compressed");
+		set_compression(fp,1);
+		int free_before = count_free_blocks(fp);
+		unsigned char inode_id = upload_buffer(fp,"/compressed","text",text,length);
+		int used = free_before-count_free_blocks(fp);
+		set_compression(fp,0);
+		bad |= used*2 > (int)(length/512);
+		bad |= !vdisk_file_matches(fp,"/compressed/text",text,length);
+		char buffer[2000];
+		bad |= read_file_range(fp,inode_id,100000,buffer,2000)!=2000 || memcmp(buffer,text+100000,2000);
+		download_file(fp,"/compressed/text","downloadedcompressed");
+		bad |= !host_file_matches("downloadedcompressed",text,length);
+		report("compressed upload and download",bad);
+
+		bad=0;
+		bad |= find_file_inode_id(fp,"/compressed/text/x")!=INODE_NOT_FOUND;
+		bad |= file_exists(fp,"/compressed/text/x");
+		bad |= upload_buffer(fp,"/compressed/text","x",small_data,10)!=INODE_NOT_FOUND;
+		bad |= open_directory(fp,"/compressed/text")!=NULL;
+		bad |= !vdisk_file_matches(fp,"/compressed/text",text,length);
+		report("path through a compressed file",bad);
+		free(text);
+	}
+	close_vdisk(fp);
+
+	free(large_data);
+	free(small_data);
+	free(big_data);
+	printf("%d test(s) failed\n",failures);
+	return failures!=0;
+}